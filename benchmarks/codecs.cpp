@@ -0,0 +1,228 @@
+#include "common.hpp"
+#include <imgio/image.hpp>
+#include <imgio/stream.hpp>
+#include <imgio/file.hpp>
+#include <imgio/format.hpp>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Measures all loaders and writers on synthetic images (and optionally
+// a corpus of real images, see --corpus) of different sizes and formats.
+// Writers are measured into memory and into a file, loaders from memory,
+// from a file in the page cache (warm) and from a file that was evicted
+// from the page cache before every run (cold, linux only). Loads include
+// reading the first mip of every layer, since most loaders decode lazily.
+// Throughput is given in MB of decoded texel data per second.
+
+using namespace imgio;
+using namespace imgio::bench;
+
+namespace {
+
+const Format formats[] = {
+	Format::r8g8b8a8Srgb,
+	Format::r8g8b8Srgb,
+	Format::r16g16b16a16Unorm,
+	Format::r16g16b16a16Sfloat,
+	Format::r32g32b32a32Sfloat,
+};
+
+struct Source {
+	std::string name;
+	ImageData image;
+};
+
+// Loads the image and reads the first mip of all layers. Throws on error.
+void loadAndDecode(const Codec& codec, std::unique_ptr<Read> stream,
+		std::vector<std::byte>& buf) {
+	std::unique_ptr<ImageProvider> provider;
+	auto res = codec.load(std::move(stream), provider);
+	if(res != ReadError::none) {
+		throw std::runtime_error("load failed: " + std::to_string(int(res)));
+	}
+
+	buf.resize(sizeBytes(provider->size(), 0u, provider->format()));
+	for(auto l = 0u; l < provider->layers(); ++l) {
+		provider->read(buf, 0u, l);
+	}
+}
+
+std::unique_ptr<Read> openFile(const std::string& path) {
+	auto file = FileHandle(path.c_str(), "rb");
+	if(!file) {
+		throw std::runtime_error("can't open " + path);
+	}
+
+	return std::make_unique<FileRead>(std::move(file));
+}
+
+bool writeFile(const std::string& path, span<const std::byte> data) {
+	auto file = FileHandle(path.c_str(), "wb");
+	return file && std::fwrite(data.data(), 1u, data.size(), file.get()) == data.size();
+}
+
+class Runner {
+public:
+	const Options& opts;
+	std::vector<Record> records;
+
+	// Runs a single measurement and records it. Errors are reported
+	// but don't stop the benchmark.
+	template<typename F, typename P>
+	void run(const Codec& codec, const Source& src, const char* op,
+			const char* stream, const char* cache, u64 encodedBytes,
+			F&& func, P&& prepare) {
+		auto& img = src.image;
+		auto name = std::string(codec.name) + "/" + op + "/" + stream + "/" +
+			cache + "/" + src.name + "/" + std::to_string(img.size.x) + "x" +
+			std::to_string(img.size.y) + "/" + formatName(img.format);
+		if(!matches(opts, name)) {
+			return;
+		}
+
+		Timing timing;
+		try {
+			timing = measure(opts, std::string_view(cache) != "cold", func, prepare);
+		} catch(const std::exception& err) {
+			std::printf("%-60s failed: %s\n", name.c_str(), err.what());
+			return;
+		}
+
+		auto bytes = double(imageBytes(img));
+		auto mbps = (bytes / 1e6) / (timing.medianMs / 1e3);
+		std::printf("%-60s %10.3f ms %10.1f MB/s\n", name.c_str(),
+			timing.medianMs, mbps);
+
+		Record rec;
+		rec.set("codec", codec.name);
+		rec.set("op", op);
+		rec.set("stream", stream);
+		rec.set("cache", cache);
+		rec.set("image", src.name);
+		rec.set("width", double(img.size.x));
+		rec.set("height", double(img.size.y));
+		rec.set("format", formatName(img.format));
+		rec.set("bytes", bytes);
+		rec.set("encodedBytes", double(encodedBytes));
+		rec.set("runs", double(timing.runs));
+		rec.set("msMin", timing.minMs);
+		rec.set("msMedian", timing.medianMs);
+		rec.set("mbps", mbps);
+		records.push_back(std::move(rec));
+	}
+
+	template<typename F>
+	void run(const Codec& codec, const Source& src, const char* op,
+			const char* stream, const char* cache, u64 encodedBytes, F&& func) {
+		run(codec, src, op, stream, cache, encodedBytes, func, []{});
+	}
+
+	void run(const Codec& codec, const Source& src);
+};
+
+void Runner::run(const Codec& codec, const Source& src) {
+	auto& img = src.image;
+	auto data = span<const std::byte>(img.data.get(), imageBytes(img));
+	auto provider = wrapImage(img.size, img.format, data);
+
+	MemoryWrite encoded;
+	if(codec.encode(encoded, *provider) != WriteError::none) {
+		std::printf("%s: can't write %s %s\n", codec.name, src.name.c_str(),
+			formatName(img.format));
+		return;
+	}
+
+	auto encodedBytes = encoded.buffer().size();
+	auto path = std::string("imgio-bench") + codec.ext;
+
+	if(codec.writeFile) {
+		run(codec, src, "write", "memory", "warm", encodedBytes, [&]{
+			MemoryWrite write;
+			if(codec.encode(write, *provider) != WriteError::none) {
+				throw std::runtime_error("write failed");
+			}
+		});
+
+		run(codec, src, "write", "file", "warm", encodedBytes, [&]{
+			if(codec.writeFile(path.c_str(), *provider) != WriteError::none) {
+				throw std::runtime_error("write failed");
+			}
+		});
+	}
+
+	if(!writeFile(path, encoded.buffer())) {
+		std::printf("can't write %s\n", path.c_str());
+		return;
+	}
+
+	std::vector<std::byte> buf;
+	run(codec, src, "read", "memory", "warm", encodedBytes, [&]{
+		loadAndDecode(codec, std::make_unique<MemoryRead>(encoded.buffer()), buf);
+	});
+
+	run(codec, src, "read", "file", "warm", encodedBytes, [&]{
+		loadAndDecode(codec, openFile(path), buf);
+	});
+
+	if(dropFileCache(path)) {
+		run(codec, src, "read", "file", "cold", encodedBytes, [&]{
+			loadAndDecode(codec, openFile(path), buf);
+		}, [&]{
+			dropFileCache(path);
+		});
+	}
+
+	std::remove(path.c_str());
+}
+
+} // anon namespace
+
+int main(int argc, const char** argv) {
+	Options opts;
+	if(!parseOptions(argc, argv, opts)) {
+		return 1;
+	}
+
+	// The sources are created on demand, all of them at once
+	// would need a lot of memory for large sizes.
+	Runner runner {opts, {}};
+	auto runAll = [&](const Source& src) {
+		for(auto& codec : codecs()) {
+			if(codec.supports(src.image.format)) {
+				runner.run(codec, src);
+			}
+		}
+	};
+
+	for(auto size : opts.sizes) {
+		for(auto pattern : {Pattern::noise, Pattern::gradient}) {
+			for(auto format : formats) {
+				runAll({name(pattern), makeImage(pattern, {size, size}, format)});
+			}
+		}
+	}
+
+	for(auto& path : opts.corpus) {
+		auto image = loadImage(path.c_str());
+		if(!image) {
+			std::printf("can't load corpus image %s\n", path.c_str());
+			continue;
+		}
+
+		// imgio::convert can't decode block-compressed formats
+		if(blockSize(image->format()) != Vec3ui{1u, 1u, 1u}) {
+			std::printf("skipping block-compressed corpus image %s\n", path.c_str());
+			continue;
+		}
+
+		auto name = path.substr(path.find_last_of("/\\") + 1);
+		for(auto format : formats) {
+			runAll({name, convertImage(*image, format)});
+		}
+	}
+
+	return writeJson(opts, "codecs", runner.records) ? 0 : 1;
+}
@@ -0,0 +1,603 @@
+#include "common.hpp"
+#include <imgio/stream.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <random>
+#include <stdexcept>
+#include <utility>
+
+#ifdef IMGIO_WITH_JPEG
+	#include <imgio/jpeg.hpp>
+#endif // IMGIO_WITH_JPEG
+
+#ifdef __linux__
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif // __linux__
+
+#ifndef IMGIO_BENCH_VERSION
+	#define IMGIO_BENCH_VERSION "unknown"
+#endif
+
+#ifndef IMGIO_BENCH_BUILDTYPE
+	#define IMGIO_BENCH_BUILDTYPE "unknown"
+#endif
+
+namespace imgio::bench {
+namespace {
+
+void printUsage(const char* program) {
+	std::fprintf(stderr, "usage: %s [--json <path>] [--corpus <path>]... "
+		"[--sizes <a,b,...>] [--iterations <n>] [--min-time <ms>] "
+		"[--filter <str>]\n", program);
+}
+
+template<typename T>
+bool parseNumber(std::string_view str, T& out) {
+	auto end = str.data() + str.size();
+	auto res = std::from_chars(str.data(), end, out);
+	return res.ec == std::errc{} && res.ptr == end;
+}
+
+bool addCorpus(const std::string& path, std::vector<std::string>& out) {
+	namespace fs = std::filesystem;
+	std::error_code ec;
+	if(fs::is_directory(path, ec)) {
+		std::vector<std::string> files;
+		for(auto& entry : fs::directory_iterator(path, ec)) {
+			if(entry.is_regular_file(ec)) {
+				files.push_back(entry.path().string());
+			}
+		}
+
+		// directory order is unspecified, keep results comparable
+		std::sort(files.begin(), files.end());
+		out.insert(out.end(), files.begin(), files.end());
+		return !ec;
+	}
+
+	if(!fs::is_regular_file(path, ec)) {
+		std::fprintf(stderr, "corpus path '%s' does not exist\n", path.c_str());
+		return false;
+	}
+
+	out.push_back(path);
+	return true;
+}
+
+void writeEscaped(std::FILE* file, std::string_view str) {
+	std::fputc('"', file);
+	for(auto c : str) {
+		if(c == '"' || c == '\\') {
+			std::fputc('\\', file);
+			std::fputc(c, file);
+		} else if(u8(c) < 0x20) {
+			std::fprintf(file, "\\u%04x", unsigned(u8(c)));
+		} else {
+			std::fputc(c, file);
+		}
+	}
+	std::fputc('"', file);
+}
+
+void writeValue(std::FILE* file, const Record::Value& value) {
+	if(auto str = std::get_if<std::string>(&value)) {
+		writeEscaped(file, *str);
+		return;
+	}
+
+	// JSON has no representation for inf/nan
+	auto num = std::get<double>(value);
+	if(std::isfinite(num)) {
+		std::fprintf(file, "%.6g", num);
+	} else {
+		std::fputs("null", file);
+	}
+}
+
+bool isRgb8(Format fmt) {
+	return fmt == Format::r8g8b8a8Srgb || fmt == Format::r8g8b8Srgb;
+}
+
+bool isPng(Format fmt) {
+	return isRgb8(fmt) || fmt == Format::r16g16b16a16Unorm;
+}
+
+bool isFloat(Format fmt) {
+	return fmt == Format::r16g16b16a16Sfloat || fmt == Format::r32g32b32a32Sfloat;
+}
+
+// Uncompressed 32-bit or 24-bit TGA, only used as input for stb.
+WriteError writeTga(Write& write, const ImageProvider& image) {
+	auto size = image.size();
+	auto channels = image.format() == Format::r8g8b8a8Srgb ? 4u : 3u;
+	if(!isRgb8(image.format()) || size.x > 0xFFFFu || size.y > 0xFFFFu) {
+		return WriteError::unsupportedFormat;
+	}
+
+	std::byte header[18] {};
+	header[2] = std::byte(2u); // uncompressed true-color
+	header[12] = std::byte(size.x & 0xFFu);
+	header[13] = std::byte(size.x >> 8u);
+	header[14] = std::byte(size.y & 0xFFu);
+	header[15] = std::byte(size.y >> 8u);
+	header[16] = std::byte(8u * channels);
+	header[17] = std::byte(channels == 4u ? 0x28u : 0x20u); // top-left origin
+
+	auto data = image.read(0u, 0u);
+	std::vector<std::byte> bgr(data.begin(), data.end());
+	for(auto i = 0u; i + channels <= bgr.size(); i += channels) {
+		std::swap(bgr[i], bgr[i + 2]);
+	}
+
+	try {
+		write.write(header, sizeof(header));
+		write.write(bgr.data(), bgr.size());
+	} catch(const std::runtime_error&) {
+		return WriteError::cantWrite;
+	}
+
+	return WriteError::none;
+}
+
+const Codec codecTable[] = {
+	{"png", ".png", isPng, writePng, writePng, loadPng},
+	{"stb-png", ".png", isPng, writePng, nullptr, loadStb},
+	{"stb-tga", ".tga", isRgb8, writeTga, nullptr, loadStb},
+	{"qoi", ".qoi", isRgb8, writeQoi, writeQoi, loadQoi},
+#ifdef IMGIO_WITH_JPEG
+	{"jpeg", ".jpg", isRgb8,
+		[](Write& write, const ImageProvider& image) {
+			return writeJpeg(write, image);
+		},
+		[](StringParam path, const ImageProvider& image) {
+			return writeJpeg(path, image);
+		},
+		loadJpeg},
+#endif // IMGIO_WITH_JPEG
+	{"ktx", ".ktx", [](Format) { return true; }, writeKtx, writeKtx, loadKtx},
+	{"ktx2", ".ktx2", [](Format) { return true; },
+		[](Write& write, const ImageProvider& image) {
+			return writeKtx2(write, image);
+		},
+		[](StringParam path, const ImageProvider& image) {
+			return writeKtx2(path, image);
+		},
+		loadKtx2},
+	{"ktx2-zlib", ".ktx2", [](Format) { return true; },
+		[](Write& write, const ImageProvider& image) {
+			return writeKtx2(write, image, true);
+		},
+		[](StringParam path, const ImageProvider& image) {
+			return writeKtx2(path, image, true);
+		},
+		loadKtx2},
+	{"dds", ".dds", [](Format fmt) { return fmt != Format::r8g8b8Srgb; },
+		writeDds, writeDds, loadDds},
+	{"exr", ".exr", isFloat, writeExr, writeExr,
+		[](std::unique_ptr<Read>&& stream, std::unique_ptr<ImageProvider>& provider) {
+			return loadExr(std::move(stream), provider);
+		}},
+	{"hdr", ".hdr", isFloat, writeHdr, writeHdr, loadHdr},
+};
+
+} // anon namespace
+
+bool parseOptions(int argc, const char** argv, Options& opts,
+		std::vector<std::string_view>* extra) {
+	for(auto i = 1; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		auto hasValue = i + 1 < argc;
+		auto ok = true;
+		if(arg == "--json" && hasValue) {
+			opts.json = argv[++i];
+		} else if(arg == "--corpus" && hasValue) {
+			ok = addCorpus(argv[++i], opts.corpus);
+		} else if(arg == "--sizes" && hasValue) {
+			opts.sizes.clear();
+			std::string_view list = argv[++i];
+			while(ok && !list.empty()) {
+				auto comma = std::min(list.find(','), list.size());
+				unsigned size;
+				ok = parseNumber(list.substr(0, comma), size) && size > 0u;
+				opts.sizes.push_back(size);
+				list.remove_prefix(std::min(comma + 1, list.size()));
+			}
+		} else if(arg == "--iterations" && hasValue) {
+			ok = parseNumber(std::string_view(argv[++i]), opts.iterations) &&
+				opts.iterations > 0u;
+		} else if(arg == "--min-time" && hasValue) {
+			char* end;
+			opts.minTimeMs = std::strtod(argv[++i], &end);
+			ok = *end == '\0';
+		} else if(arg == "--filter" && hasValue) {
+			opts.filter = argv[++i];
+		} else if(extra) {
+			extra->push_back(arg);
+		} else {
+			ok = false;
+		}
+
+		if(!ok) {
+			std::fprintf(stderr, "invalid argument '%s'\n", argv[i]);
+			printUsage(argv[0]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool matches(const Options& opts, std::string_view name) {
+	return name.find(opts.filter) != name.npos;
+}
+
+const char* name(Pattern pattern) {
+	switch(pattern) {
+		case Pattern::noise: return "noise";
+		case Pattern::gradient: return "gradient";
+		default: return "?";
+	}
+}
+
+ImageData makeImage(Pattern pattern, Vec2ui size, Format format, u32 seed) {
+	ImageData img;
+	img.size = {size.x, size.y, 1u};
+	img.format = format;
+
+	auto byteSize = sizeBytes(img.size, 0u, format);
+	img.data = std::make_unique<std::byte[]>(byteSize);
+
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> dist(0.0, 1.0);
+	span<std::byte> dst{img.data.get(), std::size_t(byteSize)};
+	for(auto y = 0u; y < size.y; ++y) {
+		for(auto x = 0u; x < size.x; ++x) {
+			Vec4d color;
+			if(pattern == Pattern::noise) {
+				color = {dist(rng), dist(rng), dist(rng), dist(rng)};
+			} else {
+				auto fx = double(x) / size.x;
+				auto fy = double(y) / size.y;
+				color = {fx, fy, 0.5 + 0.5 * std::sin(8.0 * (fx + fy)), 1.0};
+			}
+
+			write(format, dst, color);
+		}
+	}
+
+	return img;
+}
+
+ImageData convertImage(const ImageProvider& provider, Format format) {
+	ImageData img;
+	img.size = provider.size();
+	img.size.z = 1u;
+	img.format = format;
+
+	auto byteSize = sizeBytes(img.size, 0u, format);
+	img.data = std::make_unique<std::byte[]>(byteSize);
+
+	auto src = provider.read(0u, 0u);
+	span<std::byte> dst{img.data.get(), std::size_t(byteSize)};
+	auto numTexels = u64(img.size.x) * img.size.y;
+	convertTexels(format, dst, provider.format(), src, numTexels);
+	return img;
+}
+
+u64 imageBytes(const ImageData& img) {
+	return sizeBytes(img.size, 0u, img.format);
+}
+
+const char* formatName(Format format) {
+	switch(format) {
+		case Format::undefined: return "undefined";
+		case Format::r4g4UnormPack8: return "r4g4UnormPack8";
+		case Format::r4g4b4a4UnormPack16: return "r4g4b4a4UnormPack16";
+		case Format::b4g4r4a4UnormPack16: return "b4g4r4a4UnormPack16";
+		case Format::r5g6b5UnormPack16: return "r5g6b5UnormPack16";
+		case Format::b5g6r5UnormPack16: return "b5g6r5UnormPack16";
+		case Format::r5g5b5a1UnormPack16: return "r5g5b5a1UnormPack16";
+		case Format::b5g5r5a1UnormPack16: return "b5g5r5a1UnormPack16";
+		case Format::a1r5g5b5UnormPack16: return "a1r5g5b5UnormPack16";
+		case Format::r8Unorm: return "r8Unorm";
+		case Format::r8Snorm: return "r8Snorm";
+		case Format::r8Uscaled: return "r8Uscaled";
+		case Format::r8Sscaled: return "r8Sscaled";
+		case Format::r8Uint: return "r8Uint";
+		case Format::r8Sint: return "r8Sint";
+		case Format::r8Srgb: return "r8Srgb";
+		case Format::r8g8Unorm: return "r8g8Unorm";
+		case Format::r8g8Snorm: return "r8g8Snorm";
+		case Format::r8g8Uscaled: return "r8g8Uscaled";
+		case Format::r8g8Sscaled: return "r8g8Sscaled";
+		case Format::r8g8Uint: return "r8g8Uint";
+		case Format::r8g8Sint: return "r8g8Sint";
+		case Format::r8g8Srgb: return "r8g8Srgb";
+		case Format::r8g8b8Unorm: return "r8g8b8Unorm";
+		case Format::r8g8b8Snorm: return "r8g8b8Snorm";
+		case Format::r8g8b8Uscaled: return "r8g8b8Uscaled";
+		case Format::r8g8b8Sscaled: return "r8g8b8Sscaled";
+		case Format::r8g8b8Uint: return "r8g8b8Uint";
+		case Format::r8g8b8Sint: return "r8g8b8Sint";
+		case Format::r8g8b8Srgb: return "r8g8b8Srgb";
+		case Format::b8g8r8Unorm: return "b8g8r8Unorm";
+		case Format::b8g8r8Snorm: return "b8g8r8Snorm";
+		case Format::b8g8r8Uscaled: return "b8g8r8Uscaled";
+		case Format::b8g8r8Sscaled: return "b8g8r8Sscaled";
+		case Format::b8g8r8Uint: return "b8g8r8Uint";
+		case Format::b8g8r8Sint: return "b8g8r8Sint";
+		case Format::b8g8r8Srgb: return "b8g8r8Srgb";
+		case Format::r8g8b8a8Unorm: return "r8g8b8a8Unorm";
+		case Format::r8g8b8a8Snorm: return "r8g8b8a8Snorm";
+		case Format::r8g8b8a8Uscaled: return "r8g8b8a8Uscaled";
+		case Format::r8g8b8a8Sscaled: return "r8g8b8a8Sscaled";
+		case Format::r8g8b8a8Uint: return "r8g8b8a8Uint";
+		case Format::r8g8b8a8Sint: return "r8g8b8a8Sint";
+		case Format::r8g8b8a8Srgb: return "r8g8b8a8Srgb";
+		case Format::b8g8r8a8Unorm: return "b8g8r8a8Unorm";
+		case Format::b8g8r8a8Snorm: return "b8g8r8a8Snorm";
+		case Format::b8g8r8a8Uscaled: return "b8g8r8a8Uscaled";
+		case Format::b8g8r8a8Sscaled: return "b8g8r8a8Sscaled";
+		case Format::b8g8r8a8Uint: return "b8g8r8a8Uint";
+		case Format::b8g8r8a8Sint: return "b8g8r8a8Sint";
+		case Format::b8g8r8a8Srgb: return "b8g8r8a8Srgb";
+		case Format::a8b8g8r8UnormPack32: return "a8b8g8r8UnormPack32";
+		case Format::a8b8g8r8SnormPack32: return "a8b8g8r8SnormPack32";
+		case Format::a8b8g8r8UscaledPack32: return "a8b8g8r8UscaledPack32";
+		case Format::a8b8g8r8SscaledPack32: return "a8b8g8r8SscaledPack32";
+		case Format::a8b8g8r8UintPack32: return "a8b8g8r8UintPack32";
+		case Format::a8b8g8r8SintPack32: return "a8b8g8r8SintPack32";
+		case Format::a8b8g8r8SrgbPack32: return "a8b8g8r8SrgbPack32";
+		case Format::a2r10g10b10UnormPack32: return "a2r10g10b10UnormPack32";
+		case Format::a2r10g10b10SnormPack32: return "a2r10g10b10SnormPack32";
+		case Format::a2r10g10b10UscaledPack32: return "a2r10g10b10UscaledPack32";
+		case Format::a2r10g10b10SscaledPack32: return "a2r10g10b10SscaledPack32";
+		case Format::a2r10g10b10UintPack32: return "a2r10g10b10UintPack32";
+		case Format::a2r10g10b10SintPack32: return "a2r10g10b10SintPack32";
+		case Format::a2b10g10r10UnormPack32: return "a2b10g10r10UnormPack32";
+		case Format::a2b10g10r10SnormPack32: return "a2b10g10r10SnormPack32";
+		case Format::a2b10g10r10UscaledPack32: return "a2b10g10r10UscaledPack32";
+		case Format::a2b10g10r10SscaledPack32: return "a2b10g10r10SscaledPack32";
+		case Format::a2b10g10r10UintPack32: return "a2b10g10r10UintPack32";
+		case Format::a2b10g10r10SintPack32: return "a2b10g10r10SintPack32";
+		case Format::r16Unorm: return "r16Unorm";
+		case Format::r16Snorm: return "r16Snorm";
+		case Format::r16Uscaled: return "r16Uscaled";
+		case Format::r16Sscaled: return "r16Sscaled";
+		case Format::r16Uint: return "r16Uint";
+		case Format::r16Sint: return "r16Sint";
+		case Format::r16Sfloat: return "r16Sfloat";
+		case Format::r16g16Unorm: return "r16g16Unorm";
+		case Format::r16g16Snorm: return "r16g16Snorm";
+		case Format::r16g16Uscaled: return "r16g16Uscaled";
+		case Format::r16g16Sscaled: return "r16g16Sscaled";
+		case Format::r16g16Uint: return "r16g16Uint";
+		case Format::r16g16Sint: return "r16g16Sint";
+		case Format::r16g16Sfloat: return "r16g16Sfloat";
+		case Format::r16g16b16Unorm: return "r16g16b16Unorm";
+		case Format::r16g16b16Snorm: return "r16g16b16Snorm";
+		case Format::r16g16b16Uscaled: return "r16g16b16Uscaled";
+		case Format::r16g16b16Sscaled: return "r16g16b16Sscaled";
+		case Format::r16g16b16Uint: return "r16g16b16Uint";
+		case Format::r16g16b16Sint: return "r16g16b16Sint";
+		case Format::r16g16b16Sfloat: return "r16g16b16Sfloat";
+		case Format::r16g16b16a16Unorm: return "r16g16b16a16Unorm";
+		case Format::r16g16b16a16Snorm: return "r16g16b16a16Snorm";
+		case Format::r16g16b16a16Uscaled: return "r16g16b16a16Uscaled";
+		case Format::r16g16b16a16Sscaled: return "r16g16b16a16Sscaled";
+		case Format::r16g16b16a16Uint: return "r16g16b16a16Uint";
+		case Format::r16g16b16a16Sint: return "r16g16b16a16Sint";
+		case Format::r16g16b16a16Sfloat: return "r16g16b16a16Sfloat";
+		case Format::r32Uint: return "r32Uint";
+		case Format::r32Sint: return "r32Sint";
+		case Format::r32Sfloat: return "r32Sfloat";
+		case Format::r32g32Uint: return "r32g32Uint";
+		case Format::r32g32Sint: return "r32g32Sint";
+		case Format::r32g32Sfloat: return "r32g32Sfloat";
+		case Format::r32g32b32Uint: return "r32g32b32Uint";
+		case Format::r32g32b32Sint: return "r32g32b32Sint";
+		case Format::r32g32b32Sfloat: return "r32g32b32Sfloat";
+		case Format::r32g32b32a32Uint: return "r32g32b32a32Uint";
+		case Format::r32g32b32a32Sint: return "r32g32b32a32Sint";
+		case Format::r32g32b32a32Sfloat: return "r32g32b32a32Sfloat";
+		case Format::r64Uint: return "r64Uint";
+		case Format::r64Sint: return "r64Sint";
+		case Format::r64Sfloat: return "r64Sfloat";
+		case Format::r64g64Uint: return "r64g64Uint";
+		case Format::r64g64Sint: return "r64g64Sint";
+		case Format::r64g64Sfloat: return "r64g64Sfloat";
+		case Format::r64g64b64Uint: return "r64g64b64Uint";
+		case Format::r64g64b64Sint: return "r64g64b64Sint";
+		case Format::r64g64b64Sfloat: return "r64g64b64Sfloat";
+		case Format::r64g64b64a64Uint: return "r64g64b64a64Uint";
+		case Format::r64g64b64a64Sint: return "r64g64b64a64Sint";
+		case Format::r64g64b64a64Sfloat: return "r64g64b64a64Sfloat";
+		case Format::b10g11r11UfloatPack32: return "b10g11r11UfloatPack32";
+		case Format::e5b9g9r9UfloatPack32: return "e5b9g9r9UfloatPack32";
+		case Format::d16Unorm: return "d16Unorm";
+		case Format::x8D24UnormPack32: return "x8D24UnormPack32";
+		case Format::d32Sfloat: return "d32Sfloat";
+		case Format::s8Uint: return "s8Uint";
+		case Format::d16UnormS8Uint: return "d16UnormS8Uint";
+		case Format::d24UnormS8Uint: return "d24UnormS8Uint";
+		case Format::d32SfloatS8Uint: return "d32SfloatS8Uint";
+		case Format::bc1RgbUnormBlock: return "bc1RgbUnormBlock";
+		case Format::bc1RgbSrgbBlock: return "bc1RgbSrgbBlock";
+		case Format::bc1RgbaUnormBlock: return "bc1RgbaUnormBlock";
+		case Format::bc1RgbaSrgbBlock: return "bc1RgbaSrgbBlock";
+		case Format::bc2UnormBlock: return "bc2UnormBlock";
+		case Format::bc2SrgbBlock: return "bc2SrgbBlock";
+		case Format::bc3UnormBlock: return "bc3UnormBlock";
+		case Format::bc3SrgbBlock: return "bc3SrgbBlock";
+		case Format::bc4UnormBlock: return "bc4UnormBlock";
+		case Format::bc4SnormBlock: return "bc4SnormBlock";
+		case Format::bc5UnormBlock: return "bc5UnormBlock";
+		case Format::bc5SnormBlock: return "bc5SnormBlock";
+		case Format::bc6hUfloatBlock: return "bc6hUfloatBlock";
+		case Format::bc6hSfloatBlock: return "bc6hSfloatBlock";
+		case Format::bc7UnormBlock: return "bc7UnormBlock";
+		case Format::bc7SrgbBlock: return "bc7SrgbBlock";
+		case Format::etc2R8g8b8UnormBlock: return "etc2R8g8b8UnormBlock";
+		case Format::etc2R8g8b8SrgbBlock: return "etc2R8g8b8SrgbBlock";
+		case Format::etc2R8g8b8a1UnormBlock: return "etc2R8g8b8a1UnormBlock";
+		case Format::etc2R8g8b8a1SrgbBlock: return "etc2R8g8b8a1SrgbBlock";
+		case Format::etc2R8g8b8a8UnormBlock: return "etc2R8g8b8a8UnormBlock";
+		case Format::etc2R8g8b8a8SrgbBlock: return "etc2R8g8b8a8SrgbBlock";
+		case Format::eacR11UnormBlock: return "eacR11UnormBlock";
+		case Format::eacR11SnormBlock: return "eacR11SnormBlock";
+		case Format::eacR11g11UnormBlock: return "eacR11g11UnormBlock";
+		case Format::eacR11g11SnormBlock: return "eacR11g11SnormBlock";
+		case Format::astc4x4UnormBlock: return "astc4x4UnormBlock";
+		case Format::astc4x4SrgbBlock: return "astc4x4SrgbBlock";
+		case Format::astc5x4UnormBlock: return "astc5x4UnormBlock";
+		case Format::astc5x4SrgbBlock: return "astc5x4SrgbBlock";
+		case Format::astc5x5UnormBlock: return "astc5x5UnormBlock";
+		case Format::astc5x5SrgbBlock: return "astc5x5SrgbBlock";
+		case Format::astc6x5UnormBlock: return "astc6x5UnormBlock";
+		case Format::astc6x5SrgbBlock: return "astc6x5SrgbBlock";
+		case Format::astc6x6UnormBlock: return "astc6x6UnormBlock";
+		case Format::astc6x6SrgbBlock: return "astc6x6SrgbBlock";
+		case Format::astc8x5UnormBlock: return "astc8x5UnormBlock";
+		case Format::astc8x5SrgbBlock: return "astc8x5SrgbBlock";
+		case Format::astc8x6UnormBlock: return "astc8x6UnormBlock";
+		case Format::astc8x6SrgbBlock: return "astc8x6SrgbBlock";
+		case Format::astc8x8UnormBlock: return "astc8x8UnormBlock";
+		case Format::astc8x8SrgbBlock: return "astc8x8SrgbBlock";
+		case Format::astc10x5UnormBlock: return "astc10x5UnormBlock";
+		case Format::astc10x5SrgbBlock: return "astc10x5SrgbBlock";
+		case Format::astc10x6UnormBlock: return "astc10x6UnormBlock";
+		case Format::astc10x6SrgbBlock: return "astc10x6SrgbBlock";
+		case Format::astc10x8UnormBlock: return "astc10x8UnormBlock";
+		case Format::astc10x8SrgbBlock: return "astc10x8SrgbBlock";
+		case Format::astc10x10UnormBlock: return "astc10x10UnormBlock";
+		case Format::astc10x10SrgbBlock: return "astc10x10SrgbBlock";
+		case Format::astc12x10UnormBlock: return "astc12x10UnormBlock";
+		case Format::astc12x10SrgbBlock: return "astc12x10SrgbBlock";
+		case Format::astc12x12UnormBlock: return "astc12x12UnormBlock";
+		case Format::astc12x12SrgbBlock: return "astc12x12SrgbBlock";
+		default: return "unknown";
+	}
+}
+
+span<const Codec> codecs() {
+	return codecTable;
+}
+
+const Codec* findCodec(std::string_view name) {
+	for(auto& codec : codecTable) {
+		if(name == codec.name) {
+			return &codec;
+		}
+	}
+
+	return nullptr;
+}
+
+bool parseFormat(std::string_view name, Format& out) {
+	for(auto i = u32(Format::r4g4UnormPack8); i <= u32(Format::astc12x12SrgbBlock); ++i) {
+		if(name == formatName(Format(i))) {
+			out = Format(i);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool dropFileCache(const std::string& path) {
+#ifdef __linux__
+	auto fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+
+	// dirty pages can't be dropped
+	::fdatasync(fd);
+	auto res = ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	::close(fd);
+	return res == 0;
+#else // __linux__
+	(void) path;
+	return false;
+#endif // __linux__
+}
+
+Record& Record::set(std::string key, std::string value) {
+	fields_.emplace_back(std::move(key), std::move(value));
+	return *this;
+}
+
+Record& Record::set(std::string key, const char* value) {
+	return set(std::move(key), std::string(value));
+}
+
+Record& Record::set(std::string key, double value) {
+	fields_.emplace_back(std::move(key), value);
+	return *this;
+}
+
+bool writeJson(const Options& opts, std::string_view benchmark,
+		const std::vector<Record>& records) {
+	if(opts.json.empty()) {
+		return true;
+	}
+
+	auto file = std::fopen(opts.json.c_str(), "w");
+	if(!file) {
+		std::fprintf(stderr, "can't open '%s': %s\n", opts.json.c_str(),
+			std::strerror(errno));
+		return false;
+	}
+
+	char time[64] {};
+	auto now = std::time(nullptr);
+	std::strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+	std::fputs("{\n\t\"benchmark\": ", file);
+	writeEscaped(file, benchmark);
+	std::fputs(",\n\t\"version\": ", file);
+	writeEscaped(file, IMGIO_BENCH_VERSION);
+	std::fputs(",\n\t\"buildtype\": ", file);
+	writeEscaped(file, IMGIO_BENCH_BUILDTYPE);
+	std::fputs(",\n\t\"compiler\": ", file);
+#ifdef __VERSION__
+	writeEscaped(file, __VERSION__);
+#else
+	writeEscaped(file, "unknown");
+#endif
+	std::fputs(",\n\t\"time\": ", file);
+	writeEscaped(file, time);
+	std::fputs(",\n\t\"results\": [", file);
+
+	for(auto i = 0u; i < records.size(); ++i) {
+		std::fputs(i == 0u ? "\n\t\t{" : ",\n\t\t{", file);
+		auto& fields = records[i].fields();
+		for(auto j = 0u; j < fields.size(); ++j) {
+			if(j > 0u) {
+				std::fputs(", ", file);
+			}
+
+			writeEscaped(file, fields[j].first);
+			std::fputs(": ", file);
+			writeValue(file, fields[j].second);
+		}
+		std::fputc('}', file);
+	}
+
+	std::fputs("\n\t]\n}\n", file);
+	auto ok = std::fclose(file) == 0;
+	if(!ok) {
+		std::fprintf(stderr, "writing '%s' failed\n", opts.json.c_str());
+	}
+
+	return ok;
+}
+
+} // namespace imgio::bench
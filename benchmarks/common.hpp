@@ -0,0 +1,165 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <imgio/image.hpp>
+#include <imgio/format.hpp>
+#include <nytl/vec.hpp>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Shared utilities for the benchmarks: argument parsing, timing,
+// synthetic images and JSON output.
+
+namespace imgio::bench {
+
+using Clock = std::chrono::steady_clock;
+
+// Options shared by all benchmarks:
+// --json <path>: write the results as JSON to the given file.
+// --corpus <path>: add an image file or all files in a directory as
+//   source images (in addition to the synthetic ones). Can be repeated.
+// --sizes <a,b,...>: edge lengths of the synthetic images.
+// --iterations <n>: maximum number of timed runs per measurement.
+// --min-time <ms>: stop measuring after this time, once at least
+//   two runs were done.
+// --filter <str>: only run measurements whose name contains str.
+struct Options {
+	std::string json;
+	std::vector<std::string> corpus; // expanded to files
+	std::vector<unsigned> sizes {256u, 1024u, 2048u};
+	unsigned iterations {10u};
+	double minTimeMs {1000.0};
+	std::string filter;
+};
+
+// Parses the options described above. Unknown arguments are passed
+// to 'extra' (if not null) and otherwise reported as error.
+// Returns false on error, after printing the usage.
+bool parseOptions(int argc, const char** argv, Options& opts,
+	std::vector<std::string_view>* extra = nullptr);
+
+// Whether a measurement with the given name should run, see --filter.
+bool matches(const Options& opts, std::string_view name);
+
+struct Timing {
+	double minMs {};
+	double medianMs {};
+	unsigned runs {};
+};
+
+// Calls 'func' repeatedly and returns the timing statistics.
+// 'prepare' is called (untimed) before each run, e.g. to drop caches.
+// When 'warmup' is true, an additional untimed run is done first.
+template<typename F, typename P>
+Timing measure(const Options& opts, bool warmup, F&& func, P&& prepare);
+
+template<typename F>
+Timing measure(const Options& opts, F&& func) {
+	return measure(opts, true, func, []{});
+}
+
+// Synthetic source images.
+enum class Pattern {
+	noise, // uniform random, incompressible
+	gradient, // smooth, compresses well
+};
+
+const char* name(Pattern);
+ImageData makeImage(Pattern, Vec2ui size, Format format, u32 seed = 0u);
+
+// Returns the first mip and layer of the given image in the given format.
+// Only works for formats supported by imgio::convert.
+ImageData convertImage(const ImageProvider& src, Format dst);
+
+// Returns the name of the given format, without the "Format::" prefix.
+const char* formatName(Format);
+
+// Returns the bytes of the first mip and layer of the given image.
+u64 imageBytes(const ImageData&);
+
+// Evicts the given file from the page cache so that the next read
+// has to go to the storage device. Returns false if that isn't
+// supported on this platform.
+bool dropFileCache(const std::string& path);
+
+using WriteFunc = WriteError(*)(Write&, const ImageProvider&);
+using WriteFileFunc = WriteError(*)(StringParam, const ImageProvider&);
+using LoadFunc = ReadError(*)(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
+
+// Loader and writer of a file format. There may be multiple codecs per
+// file format, e.g. for different loaders or writer settings.
+struct Codec {
+	const char* name;
+	const char* ext;
+	bool (*supports)(Format);
+	WriteFunc encode; // used to create the files for the loader
+	WriteFileFunc writeFile; // null when the writer isn't measured
+	LoadFunc load;
+};
+
+// All available codecs and lookup by name (null if not found).
+span<const Codec> codecs();
+const Codec* findCodec(std::string_view name);
+
+// Inverse of formatName. Returns false for unknown names.
+bool parseFormat(std::string_view name, Format& out);
+
+// One measured result. Written as flat JSON object, in insertion order.
+class Record {
+public:
+	using Value = std::variant<std::string, double>;
+
+	Record& set(std::string key, std::string value);
+	Record& set(std::string key, const char* value);
+	Record& set(std::string key, double value);
+
+	const auto& fields() const { return fields_; }
+
+private:
+	std::vector<std::pair<std::string, Value>> fields_;
+};
+
+// Writes all records to the JSON file given via --json, together with
+// information about the build (version, compiler, build type).
+// Does nothing if no JSON output was requested.
+bool writeJson(const Options& opts, std::string_view benchmark,
+	const std::vector<Record>& records);
+
+// Implementation
+template<typename F, typename P>
+Timing measure(const Options& opts, bool warmup, F&& func, P&& prepare) {
+	if(warmup) {
+		prepare();
+		func();
+	}
+
+	std::vector<double> times;
+	double total = 0.0;
+	while(times.size() < std::max(opts.iterations, 1u)) {
+		prepare();
+		auto start = Clock::now();
+		func();
+		auto ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+		times.push_back(ms);
+		total += ms;
+
+		if(times.size() >= 2u && total >= opts.minTimeMs) {
+			break;
+		}
+	}
+
+	std::sort(times.begin(), times.end());
+	Timing ret;
+	ret.runs = times.size();
+	ret.minMs = times.front();
+	ret.medianMs = times[times.size() / 2];
+	return ret;
+}
+
+} // namespace imgio::bench
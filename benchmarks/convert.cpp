@@ -0,0 +1,227 @@
+#include "common.hpp"
+#include <imgio/format.hpp>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Measures the throughput of imgio::convertTexels for pairs of formats
+// and prints it as matrix (source formats as rows, destination formats
+// as columns) in Gtexel/s. Pairs marked with '*' have no specialized
+// kernel and go through the generic per-texel path via Vec4d.
+// For pairs with a kernel, the generic path is measured as well (to
+// show the speedup) and the kernel output is compared against it. Any
+// difference is reported and makes the benchmark fail, so this also
+// guards the kernels against regressions.
+// By default only a set of common formats is used, --all-formats uses
+// all formats supported by imgio::convert (about 15k pairs, takes a while).
+// The spans have size*size texels, for every size given via --sizes.
+
+using namespace imgio;
+using namespace imgio::bench;
+
+namespace {
+
+const Format commonFormats[] = {
+	Format::r8Unorm,
+	Format::r8g8Unorm,
+	Format::r8g8b8Unorm,
+	Format::r8g8b8Srgb,
+	Format::b8g8r8Srgb,
+	Format::r8g8b8a8Unorm,
+	Format::r8g8b8a8Srgb,
+	Format::b8g8r8a8Unorm,
+	Format::b8g8r8a8Srgb,
+	Format::a8b8g8r8UnormPack32,
+	Format::a2b10g10r10UnormPack32,
+	Format::r16g16b16a16Unorm,
+	Format::r16Sfloat,
+	Format::r16g16b16a16Sfloat,
+	Format::r32Sfloat,
+	Format::r32g32b32Sfloat,
+	Format::r32g32b32a32Sfloat,
+	Format::e5b9g9r9UfloatPack32,
+};
+
+// All formats supported by imgio::read and imgio::write, without
+// the depth-stencil formats.
+std::vector<Format> allFormats() {
+	std::vector<Format> ret;
+	for(auto i = u32(Format::r4g4UnormPack8); i <= u32(Format::r64g64b64a64Sfloat); ++i) {
+		ret.push_back(Format(i));
+	}
+
+	ret.push_back(Format::e5b9g9r9UfloatPack32);
+	return ret;
+}
+
+// Reference implementation, the way convertTexels works for pairs
+// without a specialized kernel.
+void convertGeneric(Format dstFormat, span<std::byte> dst,
+		Format srcFormat, span<const std::byte> src, u64 count) {
+	for(u64 i = 0u; i < count; ++i) {
+		convert(dstFormat, dst, srcFormat, src);
+	}
+}
+
+struct Result {
+	double gtexels {}; // via convertTexels
+	bool kernel {};
+	bool mismatch {};
+};
+
+class Runner {
+public:
+	const Options& opts;
+	std::vector<Record> records;
+	unsigned mismatches {};
+
+	// Returns false if the pair was filtered out.
+	bool run(Format dstFormat, Format srcFormat, const ImageData& src,
+		Result& result);
+};
+
+bool Runner::run(Format dstFormat, Format srcFormat, const ImageData& src,
+		Result& result) {
+	auto count = u64(src.size.x) * src.size.y;
+	auto name = std::string(formatName(srcFormat)) + "->" +
+		formatName(dstFormat) + "/" + std::to_string(count);
+	if(!matches(opts, name)) {
+		return false;
+	}
+
+	auto srcSpan = span<const std::byte>(src.data.get(), imageBytes(src));
+	auto dstSize = std::size_t(count * formatElementSize(dstFormat));
+	auto dst = std::make_unique<std::byte[]>(dstSize);
+	auto dstSpan = span<std::byte>(dst.get(), dstSize);
+
+	result = {};
+	result.kernel = hasConvertKernel(dstFormat, srcFormat, count);
+	auto timing = measure(opts, [&]{
+		convertTexels(dstFormat, dstSpan, srcFormat, srcSpan, count);
+	});
+	result.gtexels = (count / 1e9) / (timing.medianMs / 1e3);
+
+	Record rec;
+	rec.set("src", formatName(srcFormat));
+	rec.set("dst", formatName(dstFormat));
+	rec.set("texels", double(count));
+	rec.set("path", result.kernel ? "kernel" : "generic");
+	rec.set("runs", double(timing.runs));
+	rec.set("msMin", timing.minMs);
+	rec.set("msMedian", timing.medianMs);
+	rec.set("gtexels", result.gtexels);
+
+	// Identical formats are copied, the generic path may round there
+	if(result.kernel && dstFormat != srcFormat) {
+		auto ref = std::make_unique<std::byte[]>(dstSize);
+		auto refSpan = span<std::byte>(ref.get(), dstSize);
+		auto genericTiming = measure(opts, [&]{
+			convertGeneric(dstFormat, refSpan, srcFormat, srcSpan, count);
+		});
+
+		auto genericGtexels = (count / 1e9) / (genericTiming.medianMs / 1e3);
+		rec.set("genericGtexels", genericGtexels);
+		rec.set("speedup", result.gtexels / genericGtexels);
+
+		result.mismatch = std::memcmp(dst.get(), ref.get(), dstSize) != 0;
+		rec.set("matchesGeneric", result.mismatch ? "no" : "yes");
+		if(result.mismatch) {
+			std::printf("%s: kernel output differs from generic path\n", name.c_str());
+			++mismatches;
+		}
+	}
+
+	records.push_back(std::move(rec));
+	return true;
+}
+
+void printMatrix(span<const Format> formats, const std::vector<Result>& results,
+		const std::vector<bool>& ran) {
+	for(auto i = 0u; i < formats.size(); ++i) {
+		std::printf("%4u: %s\n", i, formatName(formats[i]));
+	}
+
+	std::printf("\nsrc\\dst");
+	for(auto i = 0u; i < formats.size(); ++i) {
+		std::printf(" %7u", i);
+	}
+
+	for(auto s = 0u; s < formats.size(); ++s) {
+		std::printf("\n%7u", s);
+		for(auto d = 0u; d < formats.size(); ++d) {
+			auto id = s * formats.size() + d;
+			if(!ran[id]) {
+				std::printf(" %7s", "-");
+				continue;
+			}
+
+			auto& res = results[id];
+			std::printf(" %6.3f%c", res.gtexels,
+				res.mismatch ? '!' : (res.kernel ? ' ' : '*'));
+		}
+	}
+
+	std::printf("\n\nGtexel/s; *: generic per-texel path, "
+		"!: kernel output differs from generic path\n\n");
+}
+
+} // anon namespace
+
+int main(int argc, const char** argv) {
+	Options opts;
+	opts.sizes = {1024u};
+	opts.iterations = 5u;
+	opts.minTimeMs = 100.0;
+
+	std::vector<std::string_view> extra;
+	if(!parseOptions(argc, argv, opts, &extra)) {
+		return 1;
+	}
+
+	auto all = false;
+	for(auto arg : extra) {
+		if(arg == "--all-formats") {
+			all = true;
+		} else {
+			std::fprintf(stderr, "unknown argument '%.*s' (additional "
+				"options: [--all-formats])\n", int(arg.size()), arg.data());
+			return 1;
+		}
+	}
+
+	auto formats = all ? allFormats() :
+		std::vector<Format>(std::begin(commonFormats), std::end(commonFormats));
+
+	Runner runner {opts, {}, 0u};
+	for(auto size : opts.sizes) {
+		auto numPairs = formats.size() * formats.size();
+		std::vector<Result> results(numPairs);
+		std::vector<bool> ran(numPairs);
+		unsigned kernels {};
+		unsigned generic {};
+
+		for(auto s = 0u; s < formats.size(); ++s) {
+			auto src = makeImage(Pattern::noise, {size, size}, formats[s]);
+			for(auto d = 0u; d < formats.size(); ++d) {
+				auto id = s * formats.size() + d;
+				ran[id] = runner.run(formats[d], formats[s], src, results[id]);
+				if(ran[id]) {
+					++(results[id].kernel ? kernels : generic);
+				}
+			}
+		}
+
+		std::printf("%u texels per conversion, %u pairs with kernel, "
+			"%u generic\n\n", size * size, kernels, generic);
+		printMatrix(formats, results, ran);
+	}
+
+	if(runner.mismatches) {
+		std::printf("%u kernels differ from the generic path\n", runner.mismatches);
+	}
+
+	auto ok = writeJson(opts, "convert", runner.records);
+	return (ok && !runner.mismatches) ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+#include "perf.hpp"
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif // __linux__
+
+namespace imgio::bench {
+
+const char* name(Counter counter) {
+	switch(counter) {
+		case Counter::cycles: return "cycles";
+		case Counter::instructions: return "instructions";
+		case Counter::cacheMisses: return "cacheMisses";
+		case Counter::branchMisses: return "branchMisses";
+		default: return "?";
+	}
+}
+
+CounterValues& CounterValues::operator+=(const CounterValues& other) {
+	for(auto i = 0u; i < numCounters; ++i) {
+		values[i] += other.values[i];
+		valid[i] = valid[i] && other.valid[i];
+	}
+
+	return *this;
+}
+
+#ifdef __linux__
+
+namespace {
+
+int openCounter(Counter counter) {
+	perf_event_attr attr {};
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	// Also count threads created after opening, e.g. the imgio thread pool.
+	// Their values are included when reading the counter.
+	attr.inherit = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	switch(counter) {
+		case Counter::cycles: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+		case Counter::instructions: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+		case Counter::cacheMisses: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+		case Counter::branchMisses: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+	}
+
+	// no glibc wrapper
+	return int(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+} // anon namespace
+
+PerfCounters::PerfCounters() {
+	for(auto i = 0u; i < numCounters; ++i) {
+		fds_[i] = openCounter(Counter(i));
+		if(fds_[i] < 0 && error_.empty()) {
+			auto err = errno;
+			error_ = std::string("perf_event_open(") + name(Counter(i)) +
+				"): " + std::strerror(err);
+			if(err == EACCES || err == EPERM) {
+				error_ += " (see /proc/sys/kernel/perf_event_paranoid, "
+					"containers usually need CAP_PERFMON)";
+			} else if(err == ENOENT || err == EOPNOTSUPP) {
+				error_ += " (no hardware counters, e.g. VM without virtual PMU)";
+			} else if(err == ENOSYS) {
+				error_ += " (blocked by seccomp or not supported by the kernel)";
+			}
+		}
+	}
+}
+
+PerfCounters::~PerfCounters() {
+	for(auto fd : fds_) {
+		if(fd >= 0) {
+			::close(fd);
+		}
+	}
+}
+
+bool PerfCounters::available() const {
+	for(auto fd : fds_) {
+		if(fd >= 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void PerfCounters::start() {
+	for(auto fd : fds_) {
+		if(fd >= 0) {
+			::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+CounterValues PerfCounters::stop() {
+	for(auto fd : fds_) {
+		if(fd >= 0) {
+			::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+
+	CounterValues ret;
+	for(auto i = 0u; i < numCounters; ++i) {
+		if(fds_[i] < 0) {
+			continue;
+		}
+
+		u64 data[3] {}; // value, time enabled, time running
+		if(::read(fds_[i], data, sizeof(data)) != sizeof(data) || data[2] == 0u) {
+			continue;
+		}
+
+		auto scale = double(data[1]) / double(data[2]);
+		ret.values[i] = u64(double(data[0]) * scale);
+		ret.valid[i] = true;
+	}
+
+	return ret;
+}
+
+#else // __linux__
+
+PerfCounters::PerfCounters() {
+	fds_.fill(-1);
+	error_ = "hardware counters are only supported on linux";
+}
+
+PerfCounters::~PerfCounters() = default;
+
+bool PerfCounters::available() const {
+	return false;
+}
+
+void PerfCounters::start() {
+}
+
+CounterValues PerfCounters::stop() {
+	return {};
+}
+
+#endif // __linux__
+
+} // namespace imgio::bench
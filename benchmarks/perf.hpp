@@ -0,0 +1,65 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <array>
+#include <string>
+
+// Hardware performance counters via perf_event_open (linux only).
+// Counters count user space events of the calling thread and of all
+// threads it creates after the counters were opened. Threads that already
+// exist when opening them are not counted.
+
+namespace imgio::bench {
+
+enum class Counter {
+	cycles,
+	instructions,
+	cacheMisses, // last level cache
+	branchMisses,
+};
+
+constexpr auto numCounters = 4u;
+const char* name(Counter);
+
+struct CounterValues {
+	std::array<u64, numCounters> values {};
+	std::array<bool, numCounters> valid {}; // whether the counter was available
+
+	u64 operator[](Counter c) const { return values[unsigned(c)]; }
+	bool has(Counter c) const { return valid[unsigned(c)]; }
+
+	// Adds the values, a counter stays valid only if valid in both.
+	CounterValues& operator+=(const CounterValues&);
+};
+
+class PerfCounters {
+public:
+	// Opens all counters. Counters that can't be opened (e.g. in
+	// containers, with a restrictive perf_event_paranoid setting or
+	// in VMs without a virtual PMU) are just not valid in the results,
+	// see available() and error().
+	PerfCounters();
+	~PerfCounters();
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	// Whether at least one counter is available.
+	bool available() const;
+
+	// Description why counters are not available, empty if all of them are.
+	const std::string& error() const { return error_; }
+
+	// Resets and starts the counters.
+	void start();
+
+	// Stops the counters and returns their values since start.
+	// Values are scaled up when counters were multiplexed.
+	CounterValues stop();
+
+private:
+	std::array<int, numCounters> fds_;
+	std::string error_;
+};
+
+} // namespace imgio::bench
@@ -0,0 +1,548 @@
+#include "common.hpp"
+#include "perf.hpp"
+#include <imgio/image.hpp>
+#include <imgio/stream.hpp>
+#include <imgio/file.hpp>
+#include <imgio/format.hpp>
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Profiles a single loader, writer or conversion with hardware
+// performance counters (cycles, instructions, last level cache misses,
+// branch misses) per phase:
+// - io: reading the file into memory, or writing the encoded file
+// - decode/encode: the codec itself, working on memory. For loaders
+//   this includes reading the first mip of all layers.
+// - convert: imgio::convertTexels from/to the format given via --to
+//   (read) or --format (write, when the input has another format).
+// Counters are normalized per texel or per MB (--per) of uncompressed
+// image data. Counters include the worker threads of imgio.
+// When perf events aren't available (containers, VMs,
+// perf_event_paranoid, non-linux) only the wall time is reported.
+
+using namespace imgio;
+using namespace imgio::bench;
+
+namespace {
+
+void printUsage(const char* program) {
+	std::fprintf(stderr,
+		"usage: %s read <codec|auto> [options]\n"
+		"       %s write <codec> [options]\n"
+		"       %s convert <format> [options]\n"
+		"options:\n"
+		"  --input <path>: source image, synthetic image otherwise.\n"
+		"      For read, the file that is loaded. For write and convert,\n"
+		"      the first mip and layer are used.\n"
+		"  --size <n>: edge length of the synthetic image (2048)\n"
+		"  --pattern <noise|gradient>: synthetic image content (noise)\n"
+		"  --format <format>: format of the synthetic image, for write also\n"
+		"      the format that is written (r8g8b8a8Srgb)\n"
+		"  --to <format>: read only, convert the loaded image\n"
+		"  --repeat <n>: number of profiled runs (5)\n"
+		"  --cold: read only, evict the file from the page cache before each run\n"
+		"  --per <texel|mb>: normalization of the printed counters (texel)\n"
+		"  --json <path>: write the results as JSON\n"
+		"codecs:", program, program, program);
+	for(auto& codec : codecs()) {
+		std::fprintf(stderr, " %s", codec.name);
+	}
+
+	std::fprintf(stderr, "\n");
+}
+
+enum class Mode {
+	read,
+	write,
+	convert,
+};
+
+struct Args {
+	Mode mode {};
+	std::string target; // codec or format name
+	std::string input;
+	unsigned size {2048u};
+	Pattern pattern {Pattern::noise};
+	Format format {Format::r8g8b8a8Srgb};
+	Format to {Format::undefined};
+	unsigned repeat {5u};
+	bool cold {};
+	bool perMB {};
+	std::string json;
+};
+
+bool parseArgs(int argc, const char** argv, Args& args) {
+	if(argc < 3) {
+		return false;
+	}
+
+	std::string_view mode = argv[1];
+	if(mode == "read") {
+		args.mode = Mode::read;
+	} else if(mode == "write") {
+		args.mode = Mode::write;
+	} else if(mode == "convert") {
+		args.mode = Mode::convert;
+	} else {
+		return false;
+	}
+
+	args.target = argv[2];
+	for(auto i = 3; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if(arg == "--cold") {
+			args.cold = true;
+			continue;
+		}
+
+		if(i + 1 >= argc) {
+			std::fprintf(stderr, "missing value for '%s'\n", argv[i]);
+			return false;
+		}
+
+		std::string_view value = argv[++i];
+		auto ok = true;
+		if(arg == "--input") {
+			args.input = value;
+		} else if(arg == "--size" || arg == "--repeat") {
+			auto& out = (arg == "--size") ? args.size : args.repeat;
+			auto end = value.data() + value.size();
+			auto res = std::from_chars(value.data(), end, out);
+			ok = res.ec == std::errc{} && res.ptr == end && out > 0u;
+		} else if(arg == "--pattern") {
+			ok = value == "noise" || value == "gradient";
+			args.pattern = value == "noise" ? Pattern::noise : Pattern::gradient;
+		} else if(arg == "--format") {
+			ok = parseFormat(value, args.format);
+		} else if(arg == "--to") {
+			ok = parseFormat(value, args.to);
+		} else if(arg == "--per") {
+			ok = value == "texel" || value == "mb";
+			args.perMB = value == "mb";
+		} else if(arg == "--json") {
+			args.json = value;
+		} else {
+			std::fprintf(stderr, "unknown argument '%s'\n", argv[i - 1]);
+			return false;
+		}
+
+		if(!ok) {
+			std::fprintf(stderr, "invalid value '%s' for %s\n", argv[i], argv[i - 1]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+struct Phase {
+	std::string name;
+	std::vector<double> ms;
+	CounterValues counters; // sum over all runs
+};
+
+class Profiler {
+public:
+	PerfCounters perf;
+	std::vector<Phase> phases;
+
+	// Runs 'func' as part of the given phase. Phases are created
+	// in the order they are first used.
+	template<typename F>
+	void run(const char* phaseName, F&& func) {
+		perf.start();
+		auto start = Clock::now();
+		func();
+		auto ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+		auto counters = perf.stop();
+
+		auto& phase = get(phaseName);
+		if(phase.ms.empty()) {
+			phase.counters = counters;
+		} else {
+			phase.counters += counters;
+		}
+
+		phase.ms.push_back(ms);
+	}
+
+private:
+	Phase& get(const char* name) {
+		for(auto& phase : phases) {
+			if(phase.name == name) {
+				return phase;
+			}
+		}
+
+		return phases.emplace_back(Phase{name, {}, {}});
+	}
+};
+
+// What the counters are normalized by.
+struct Workload {
+	std::string image;
+	Vec3ui size {};
+	unsigned layers {1u};
+	Format format {};
+
+	u64 texels() const { return u64(size.x) * size.y * size.z * layers; }
+	u64 bytes() const { return sizeBytes(size, 0u, format) * layers; }
+};
+
+std::vector<std::byte> readFile(const std::string& path) {
+	auto file = FileHandle(path.c_str(), "rb");
+	if(!file || std::fseek(file.get(), 0, SEEK_END) != 0) {
+		throw std::runtime_error("can't open " + path);
+	}
+
+	auto size = std::ftell(file.get());
+	std::rewind(file.get());
+
+	std::vector<std::byte> ret(size < 0 ? 0u : std::size_t(size));
+	if(std::fread(ret.data(), 1u, ret.size(), file.get()) != ret.size()) {
+		throw std::runtime_error("can't read " + path);
+	}
+
+	return ret;
+}
+
+void writeFile(const std::string& path, span<const std::byte> data) {
+	auto file = FileHandle(path.c_str(), "wb");
+	if(!file || std::fwrite(data.data(), 1u, data.size(), file.get()) != data.size() ||
+			std::fflush(file.get()) != 0) {
+		throw std::runtime_error("can't write " + path);
+	}
+}
+
+std::string extension(const std::string& path) {
+	auto dot = path.find_last_of('.');
+	return dot == std::string::npos ? std::string() : path.substr(dot);
+}
+
+// The source image for write and convert, in its own format.
+ImageData sourceImage(const Args& args, std::string& name) {
+	if(args.input.empty()) {
+		name = bench::name(args.pattern);
+		return makeImage(args.pattern, {args.size, args.size}, args.format);
+	}
+
+	name = args.input.substr(args.input.find_last_of("/\\") + 1);
+	auto provider = loadImage(args.input.c_str());
+	if(!provider) {
+		throw std::runtime_error("can't load " + args.input);
+	}
+
+	return readImageData(*provider);
+}
+
+bool convertible(Format format) {
+	return blockSize(format) == Vec3ui{1u, 1u, 1u};
+}
+
+Workload profileRead(const Args& args, Profiler& prof) {
+	const Codec* codec {};
+	if(args.target != "auto") {
+		codec = findCodec(args.target);
+		if(!codec) {
+			throw std::runtime_error("unknown codec " + args.target);
+		}
+	}
+
+	// Synthetic images are encoded first, we need a file for the io phase
+	auto path = args.input;
+	if(path.empty()) {
+		if(!codec) {
+			throw std::runtime_error("'auto' needs an --input file");
+		}
+
+		if(!codec->supports(args.format)) {
+			throw std::runtime_error(std::string(codec->name) +
+				" can't write " + formatName(args.format));
+		}
+
+		auto img = makeImage(args.pattern, {args.size, args.size}, args.format);
+		auto provider = wrapImage(img.size, img.format, {img.data.get(), imageBytes(img)});
+
+		MemoryWrite encoded;
+		if(codec->encode(encoded, *provider) != WriteError::none) {
+			throw std::runtime_error("encoding the synthetic image failed");
+		}
+
+		path = std::string("imgio-prof") + codec->ext;
+		writeFile(path, encoded.buffer());
+	}
+
+	Workload work;
+	work.image = args.input.empty() ?
+		std::string(name(args.pattern)) :
+		path.substr(path.find_last_of("/\\") + 1);
+
+	std::vector<std::byte> file;
+	std::vector<std::byte> decoded;
+	std::vector<std::byte> converted;
+	for(auto i = 0u; i < args.repeat; ++i) {
+		if(args.cold && !dropFileCache(path)) {
+			throw std::runtime_error("--cold isn't supported on this platform");
+		}
+
+		prof.run("io", [&]{ file = readFile(path); });
+
+		std::unique_ptr<ImageProvider> provider;
+		prof.run("decode", [&]{
+			auto stream = std::make_unique<MemoryRead>(file);
+			if(codec) {
+				if(codec->load(std::move(stream), provider) != ReadError::none) {
+					provider = {};
+				}
+			} else {
+				provider = loadImage(std::move(stream), extension(path));
+			}
+
+			if(!provider) {
+				return;
+			}
+
+			auto layerSize = sizeBytes(provider->size(), 0u, provider->format());
+			decoded.resize(layerSize * provider->layers());
+			for(auto l = 0u; l < provider->layers(); ++l) {
+				auto dst = decoded.data() + l * layerSize;
+				provider->read({dst, std::size_t(layerSize)}, 0u, l);
+			}
+		});
+
+		if(!provider) {
+			throw std::runtime_error("loading " + path + " failed");
+		}
+
+		work.size = provider->size();
+		work.layers = provider->layers();
+		work.format = provider->format();
+
+		if(args.to != Format::undefined) {
+			if(!convertible(work.format) || !convertible(args.to)) {
+				throw std::runtime_error("can't convert block-compressed formats");
+			}
+
+			converted.resize(work.texels() * formatElementSize(args.to));
+			prof.run("convert", [&]{
+				convertTexels(args.to, converted, work.format, decoded, work.texels());
+			});
+		}
+	}
+
+	if(args.input.empty()) {
+		std::remove(path.c_str());
+	}
+
+	return work;
+}
+
+Workload profileWrite(const Args& args, Profiler& prof) {
+	auto codec = findCodec(args.target);
+	if(!codec) {
+		throw std::runtime_error("unknown codec " + args.target);
+	}
+
+	if(!codec->supports(args.format)) {
+		throw std::runtime_error(std::string(codec->name) + " can't write " +
+			formatName(args.format));
+	}
+
+	Workload work;
+	auto src = sourceImage(args, work.image);
+	work.size = src.size;
+	work.size.z = 1u;
+	work.format = args.format;
+
+	auto needsConvert = src.format != args.format;
+	if(needsConvert && !convertible(src.format)) {
+		throw std::runtime_error("can't convert block-compressed formats");
+	}
+
+	std::vector<std::byte> converted(work.bytes());
+	auto path = std::string("imgio-prof") + codec->ext;
+	for(auto i = 0u; i < args.repeat; ++i) {
+		auto data = span<const std::byte>(src.data.get(), imageBytes(src));
+		if(needsConvert) {
+			prof.run("convert", [&]{
+				convertTexels(args.format, converted, src.format, data, work.texels());
+			});
+			data = converted;
+		}
+
+		auto provider = wrapImage(work.size, work.format, data);
+		MemoryWrite encoded;
+		prof.run("encode", [&]{
+			if(codec->encode(encoded, *provider) != WriteError::none) {
+				throw std::runtime_error("writing failed");
+			}
+		});
+
+		prof.run("io", [&]{ writeFile(path, encoded.buffer()); });
+	}
+
+	std::remove(path.c_str());
+	return work;
+}
+
+Workload profileConvert(const Args& args, Profiler& prof) {
+	Format dstFormat;
+	if(!parseFormat(args.target, dstFormat)) {
+		throw std::runtime_error("unknown format " + args.target);
+	}
+
+	Workload work;
+	auto src = sourceImage(args, work.image);
+	work.size = src.size;
+	work.size.z = 1u;
+	work.format = src.format;
+	if(!convertible(src.format) || !convertible(dstFormat)) {
+		throw std::runtime_error("can't convert block-compressed formats");
+	}
+
+	std::vector<std::byte> converted(work.texels() * formatElementSize(dstFormat));
+	auto data = span<const std::byte>(src.data.get(), imageBytes(src));
+	for(auto i = 0u; i < args.repeat; ++i) {
+		prof.run("convert", [&]{
+			convertTexels(dstFormat, converted, src.format, data, work.texels());
+		});
+	}
+
+	return work;
+}
+
+const char* name(Mode mode) {
+	switch(mode) {
+		case Mode::read: return "read";
+		case Mode::write: return "write";
+		case Mode::convert: return "convert";
+		default: return "?";
+	}
+}
+
+void printResults(const Args& args, const Profiler& prof, const Workload& work) {
+	std::printf("%s %s: %s %ux%u", name(args.mode), args.target.c_str(),
+		work.image.c_str(), work.size.x, work.size.y);
+	if(work.layers > 1u) {
+		std::printf(" (%u layers)", work.layers);
+	}
+
+	std::printf(" %s, %.2f MB, %u runs\n", formatName(work.format),
+		work.bytes() / 1e6, args.repeat);
+	if(!prof.perf.error().empty()) {
+		std::printf("note: %s\n", prof.perf.error().c_str());
+	}
+
+	if(!prof.perf.available()) {
+		std::printf("no performance counters available, only reporting wall time\n");
+	}
+
+	auto unit = args.perMB ? "MB" : "texel";
+	auto norm = args.perMB ? work.bytes() / 1e6 : double(work.texels());
+	std::printf("\n%-8s %10s %10s", "phase", "ms", "MB/s");
+	for(auto i = 0u; i < numCounters; ++i) {
+		auto header = std::string(name(Counter(i))) + "/" + unit;
+		std::printf(" %20s", header.c_str());
+	}
+	std::printf(" %6s\n", "IPC");
+
+	for(auto& phase : prof.phases) {
+		auto ms = phase.ms;
+		std::sort(ms.begin(), ms.end());
+		auto median = ms[ms.size() / 2];
+		std::printf("%-8s %10.3f %10.1f", phase.name.c_str(), median,
+			(work.bytes() / 1e6) / (median / 1e3));
+
+		auto runs = double(phase.ms.size());
+		for(auto i = 0u; i < numCounters; ++i) {
+			if(phase.counters.has(Counter(i))) {
+				std::printf(" %20.3f", phase.counters[Counter(i)] / runs / norm);
+			} else {
+				std::printf(" %20s", "n/a");
+			}
+		}
+
+		auto& cs = phase.counters;
+		if(cs.has(Counter::cycles) && cs.has(Counter::instructions) &&
+				cs[Counter::cycles] > 0u) {
+			std::printf(" %6.2f\n", double(cs[Counter::instructions]) / cs[Counter::cycles]);
+		} else {
+			std::printf(" %6s\n", "n/a");
+		}
+	}
+}
+
+bool writeResults(const Args& args, const Profiler& prof, const Workload& work) {
+	std::vector<Record> records;
+	for(auto& phase : prof.phases) {
+		auto ms = phase.ms;
+		std::sort(ms.begin(), ms.end());
+		auto runs = double(phase.ms.size());
+
+		Record rec;
+		rec.set("mode", name(args.mode));
+		rec.set("target", args.target);
+		rec.set("image", work.image);
+		rec.set("width", double(work.size.x));
+		rec.set("height", double(work.size.y));
+		rec.set("layers", double(work.layers));
+		rec.set("format", formatName(work.format));
+		rec.set("texels", double(work.texels()));
+		rec.set("bytes", double(work.bytes()));
+		rec.set("phase", phase.name);
+		rec.set("runs", runs);
+		rec.set("msMin", ms.front());
+		rec.set("msMedian", ms[ms.size() / 2]);
+
+		for(auto i = 0u; i < numCounters; ++i) {
+			if(!phase.counters.has(Counter(i))) {
+				continue;
+			}
+
+			auto key = std::string(name(Counter(i)));
+			auto perRun = phase.counters[Counter(i)] / runs;
+			rec.set(key, perRun);
+			rec.set(key + "PerTexel", perRun / work.texels());
+			rec.set(key + "PerMB", perRun / (work.bytes() / 1e6));
+		}
+
+		records.push_back(std::move(rec));
+	}
+
+	Options opts;
+	opts.json = args.json;
+	return writeJson(opts, "prof", records);
+}
+
+} // anon namespace
+
+int main(int argc, const char** argv) {
+	Args args;
+	if(!parseArgs(argc, argv, args)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	// Open the counters before calling into imgio: the library creates
+	// its worker threads on first use, they only inherit the counters
+	// when created afterwards.
+	Profiler prof;
+	Workload work;
+	try {
+		switch(args.mode) {
+			case Mode::read: work = profileRead(args, prof); break;
+			case Mode::write: work = profileWrite(args, prof); break;
+			case Mode::convert: work = profileConvert(args, prof); break;
+		}
+	} catch(const std::exception& err) {
+		std::fprintf(stderr, "error: %s\n", err.what());
+		return 1;
+	}
+
+	printResults(args, prof, work);
+	return writeResults(args, prof, work) ? 0 : 1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <imgio/image.hpp>
+#include <memory>
+
+namespace imgio {
+
+/// ImageProvider for DDS files (legacy DX9 and DX10 headers), as created
+/// by loadDds. Can be obtained via dynamic_cast from providers returned
+/// by loadImage.
+/// Layers are array elements, for cubemaps six faces per element.
+/// When the source stream can be mapped into memory (memory streams and
+/// files on linux), read(mip, layer) returns a span directly into the
+/// mapping without copying and reads may happen concurrently. Otherwise
+/// every read seeks the stream to the subresource.
+class DdsReader : public ImageProvider {
+public:
+	/// Returns the absolute stream address of the given subresource.
+	virtual u64 dataOffset(unsigned mip, unsigned layer) const = 0;
+
+	/// Whether the file is mapped into memory, see above.
+	virtual bool mapped() const = 0;
+
+	/// Returns the DXGI_FORMAT value the file was written with or
+	/// zero (DXGI_FORMAT_UNKNOWN) for files with a legacy header.
+	virtual unsigned dxgiFormat() const = 0;
+};
+
+} // namespace imgio
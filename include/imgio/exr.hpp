@@ -0,0 +1,97 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <imgio/image.hpp>
+#include <nytl/vec.hpp>
+#include <nytl/stringParam.hpp>
+#include <string_view>
+#include <string>
+#include <vector>
+#include <memory>
+
+namespace imgio {
+
+/// Options for loading EXR images.
+struct ExrReadOptions {
+	/// Whether to always return four channels, filling missing
+	/// channels with one.
+	bool forceRGBA {true};
+	/// Whether to convert 16-bit half float channels to 32-bit float
+	/// while decoding. Saves a separate conversion pass when the
+	/// application needs float data anyways.
+	bool halfToFloat {false};
+	/// Names of the channels to load, e.g. {"Z"} or
+	/// {"diffuse.R", "diffuse.G", "diffuse.B"}. When not empty, the image
+	/// has a single layer (one per part for multipart files, where names
+	/// may be prefixed with the part name) with exactly these channels as
+	/// components, in the given order. All other channels are skipped
+	/// while decoding. The channels must have the same pixel type and
+	/// forceRGBA is ignored.
+	std::vector<std::string> channels {};
+	/// Number of components of the output format when channels are given,
+	/// zero to use channels.size(). Additional components are filled with
+	/// one. At most four.
+	unsigned numComponents {0u};
+};
+
+/// Loads the EXR image from the given stream with the given options.
+/// See loadExr in image.hpp.
+ReadError loadExr(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&,
+	const ExrReadOptions& options);
+
+/// Compression methods for writing EXR files.
+/// The lossy PXR24 and B44 methods are not supported.
+enum class ExrCompression {
+	none,
+	rle, // fast, only effective for flat areas
+	zips, // zlib, one scanline per chunk
+	zip, // zlib, 16 scanlines per chunk
+	piz, // wavelet, 32 scanlines per chunk. Usually best for noisy images
+};
+
+/// Options for writing EXR files.
+struct ExrWriteOptions {
+	ExrCompression compression {ExrCompression::zip};
+	/// Whether to write a tiled file. Images with multiple mip levels
+	/// are always written as tiled mipmap files. EXR mipmaps always
+	/// contain the full chain, missing levels are generated by point
+	/// sampling.
+	bool tiled {false};
+	Vec2ui tileSize {64u, 64u};
+};
+
+/// Writes the given image as EXR file. Images with multiple layers are
+/// written as multipart files, one part per layer. Chunks are compressed
+/// in parallel. Non-seekable streams (e.g. pipes) are supported but
+/// require the whole compressed file to be kept in memory.
+WriteError writeExr(Write&, const ImageProvider&, const ExrWriteOptions&);
+WriteError writeExr(StringParam path, const ImageProvider&, const ExrWriteOptions&);
+
+/// ImageProvider for EXR files, as created by loadExr. Can be obtained
+/// via dynamic_cast from providers returned by loadImage.
+/// Only the header and the chunk offset table are parsed on load. The
+/// file is kept mapped in memory (see ReadStreamMemoryMap) and the chunks
+/// of a level are only decoded when it is read, distributed over multiple
+/// threads. Full reads are not cached, every read decodes the chunks of
+/// the requested level again.
+/// Region reads (see ImageProvider::readRegion) only decode the chunks
+/// (tiles or scanline blocks) overlapping the region and keep them in
+/// a small cache of recently used chunks, e.g. for panning over huge
+/// tiled images. Regions must be 2D.
+/// Layers correspond to the EXR channel layers (e.g. the channels
+/// 'diffuse.R', 'diffuse.G' form the 'diffuse' layer) that can be
+/// represented with the same format. For multipart files, every part
+/// contributes its channel layers, named '<part>' or '<part>.<layer>'.
+/// Parts are decoded lazily like single part files, parts with a
+/// different size, format or mip chain (and deep parts) are skipped.
+class ExrReader : public ImageProvider {
+public:
+	/// Returns the name of the given layer, empty for the default layer.
+	virtual std::string_view layerName(unsigned layer) const = 0;
+
+	/// Sets the maximum size in bytes of the cache for decoded chunks
+	/// used by region reads. Defaults to 64MB. Zero disables caching.
+	virtual void setCacheSize(u64 maxBytes) = 0;
+};
+
+} // namespace imgio
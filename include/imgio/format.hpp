@@ -326,6 +326,22 @@ void write(Format dstFormat, span<std::byte>& dst, const Vec4d& color);
 void convert(Format dstFormat, span<std::byte>& dst,
 		Format srcFormat, span<const std::byte>& src);
 
+/// Converts 'count' tightly packed texels from srcFormat to dstFormat.
+/// Gives the same results as calling convert for every texel but common
+/// format pairs (see hasConvertKernel) are handled by specialized loops
+/// instead of going through a Vec4d per texel. Identical formats are
+/// just copied, which is exact even where the per-texel path rounds.
+/// 'dst' and 'src' must be large enough for 'count' texels.
+void convertTexels(Format dstFormat, span<std::byte> dst,
+	Format srcFormat, span<const std::byte> src, u64 count);
+
+/// Returns whether convertTexels uses a specialized kernel when converting
+/// 'count' texels between the given formats. Kernels that need setup
+/// (lookup tables) are not used for very small counts, the per-texel
+/// path is faster there.
+[[nodiscard]] bool hasConvertKernel(Format dstFormat, Format srcFormat,
+	u64 count);
+
 // does the correct conversion, no pow(2.2) approximation
 double linearToSRGB(double linear);
 double srgbToLinear(double srgb);
@@ -22,6 +22,7 @@ class Read;
 class Write;
 class ImageProvider;
 class FileHandle;
+struct FileWrite;
 struct ImageData;
 
 } // namespace imgio
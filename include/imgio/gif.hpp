@@ -0,0 +1,24 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <imgio/image.hpp>
+#include <memory>
+
+namespace imgio {
+
+/// ImageProvider for (animated) GIF files, as created by loadGif. Can be
+/// obtained via dynamic_cast from providers returned by loadImage.
+/// Every frame of the animation is a layer, composed over the previous
+/// frames as it would be displayed, in r8g8b8a8Srgb format.
+/// Only the block structure of the file is parsed on load. Frames are
+/// decoded lazily when they are read, and only the last two composed frames
+/// are kept in memory. Reading the frames in order is therefore cheap while
+/// reading an earlier frame decodes the animation from the start again.
+class GifReader : public ImageProvider {
+public:
+	/// Returns how long the given frame should be shown, in milliseconds.
+	/// Zero when the file doesn't specify it.
+	virtual unsigned frameDelay(unsigned frame) const = 0;
+};
+
+} // namespace imgio
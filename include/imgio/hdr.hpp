@@ -0,0 +1,25 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <imgio/image.hpp>
+#include <imgio/format.hpp>
+#include <memory>
+
+namespace imgio {
+
+/// Options for loading Radiance HDR (RGBE) images.
+struct HdrReadOptions {
+	/// Format of the returned image. Must be e5b9g9r9UfloatPack32,
+	/// r16g16b16a16Sfloat or r32g32b32a32Sfloat. The default has the
+	/// same size as the RGBE data in the file and is converted without
+	/// floating point math. Alpha is always one.
+	Format format {Format::e5b9g9r9UfloatPack32};
+};
+
+/// Loads the Radiance HDR image from the given stream with the given
+/// options. The whole image is decoded on load, in a single pass over
+/// the (mapped) file. See loadHdr in image.hpp.
+ReadError loadHdr(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&,
+	const HdrReadOptions& options);
+
+} // namespace imgio
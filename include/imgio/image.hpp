@@ -66,6 +66,21 @@ public:
 	/// Throws on error. Returns the number of written bytes.
 	virtual u64 read(span<std::byte> data,
 		unsigned mip = 0, unsigned layer = 0) const = 0;
+
+	/// Whether both 'read' overloads may be called from multiple threads
+	/// at the same time. Writers use this to fill output in parallel.
+	virtual bool concurrentRead() const noexcept { return false; }
+
+	/// Copies the given region of the given mip, layer into the provided
+	/// data buffer, tightly packed. offset + size must be inside the
+	/// mip level. For block-compressed formats, the region must start
+	/// at a block boundary.
+	/// The default implementation reads the whole subresource. Providers
+	/// that can load parts of an image (e.g. tiled EXR files) override it
+	/// to only load what is needed.
+	/// Throws on error. Returns the number of written bytes.
+	virtual u64 readRegion(span<std::byte> data, Vec3ui offset, Vec3ui size,
+		unsigned mip = 0, unsigned layer = 0) const;
 };
 
 /// Transforms the given image information into an image provider
@@ -115,20 +130,64 @@ enum class ReadError {
 /// They will move from the given stream only on success.
 ReadError loadKtx(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
 ReadError loadKtx2(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
-// ReadError loadJpeg(std::unique_ptr<Stream>&&, std::unique_ptr<ImageProvider>&);
+
+/// Only available when imgio was built with libjpeg (IMGIO_WITH_JPEG is
+/// defined then). Exposes the scaled images libjpeg can decode directly
+/// as mip levels, see JpegReader in jpeg.hpp.
+ReadError loadJpeg(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
+
+/// Only available when imgio was built with libwebp (IMGIO_WITH_WEBP is
+/// defined then). Animations are returned as layers when libwebpdemux was
+/// available, see WebpReader in webp.hpp.
+ReadError loadWebp(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
+
+/// 16-bit images are returned in native byte order, like all other
+/// formats. Before, their texels were in the big endian order of the file.
 ReadError loadPng(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
+
 ReadError loadExr(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&,
 	bool forceRGBA = true);
 
+/// Native Radiance HDR (RGBE) loader. Returns e5b9g9r9UfloatPack32 images,
+/// see hdr.hpp for other output formats.
+ReadError loadHdr(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
+
+/// GIF loader that exposes all animation frames as layers, decoded
+/// lazily. See GifReader in gif.hpp.
+ReadError loadGif(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
+
+/// Loads QOI images, as r8g8b8(a8) Srgb or Unorm, depending on the
+/// colorspace in the header. Only the header is read on load, the texels
+/// are decoded from the stream on every read (or on load, if the stream
+/// isn't seekable).
+ReadError loadQoi(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
+
+/// Supports DX9 and DX10 headers, see DdsReader in dds.hpp.
+ReadError loadDds(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
+
+/// Options for the STB fallback loader.
+struct StbReadOptions {
+	/// Number of channels (1 to 4) to convert the image to. Zero keeps
+	/// the channel count of the file, e.g. r8Unorm for grayscale images.
+	unsigned channels {0u};
+};
+
 /// STB babckend is a fallback since it supports additional formats.
+/// Returns 8-bit or 16-bit unorm images, depending on the bit depth of
+/// the file. Radiance hdr files are loaded as 32-bit float when passed
+/// here directly, loadImage uses loadHdr for them.
 ReadError loadStb(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&);
+ReadError loadStb(std::unique_ptr<Read>&&, std::unique_ptr<ImageProvider>&,
+	const StbReadOptions&);
 
 /// Tries to find the matching backend/loader for the image file at the
 /// given path. If no format/backend succeeds, the returned unique ptr will be
 /// empty.
+/// For seekable streams, formats with fixed magic bytes (all but the
+/// stb fallback formats) are detected by their first bytes.
 /// 'ext' can contain a file extension (e.g. the full filename or just
 /// something like ".png") to give a hint about the file type. The loader
-/// will always try all image formats if the preferred one fails.
+/// will always try all remaining image formats if the preferred one fails.
 std::unique_ptr<ImageProvider> loadImage(std::unique_ptr<Read>&&, std::string_view ext = "");
 std::unique_ptr<ImageProvider> loadImage(StringParam filename);
 std::unique_ptr<ImageProvider> loadImage(FileHandle&& file);
@@ -163,9 +222,27 @@ WriteError writeKtx(StringParam path, const ImageProvider&);
 WriteError writePng(StringParam path, const ImageProvider&);
 WriteError writePng(Write& write, const ImageProvider&);
 
-// TODO: untested
-/// Can write 2D hdr images.
+/// Can write 2D hdr images, see exr.hpp for more options.
 WriteError writeExr(StringParam path, const ImageProvider&);
+WriteError writeExr(Write& write, const ImageProvider&);
+
+/// Writes the first layer and mip of 2D float, half or e5b9g9r9 images
+/// as Radiance HDR (RGBE) file with run-length encoded scanlines.
+WriteError writeHdr(StringParam path, const ImageProvider&);
+WriteError writeHdr(Write& write, const ImageProvider&);
+
+/// Writes the first layer and mip of 2D r8g8b8(a8) Srgb or Unorm images
+/// as QOI file. Lossless and a lot faster than PNG, useful for
+/// intermediate files.
+WriteError writeQoi(StringParam path, const ImageProvider&);
+WriteError writeQoi(Write& write, const ImageProvider&);
+
+/// Writes all mips and layers of 2D, 3D, array or cubemap images
+/// as DDS file. The data is stored as returned by the provider, block
+/// compressed data is never re-encoded. Uses the legacy header where it
+/// can describe the image and the DX10 header otherwise.
+WriteError writeDds(StringParam path, const ImageProvider&);
+WriteError writeDds(Write& write, const ImageProvider&);
 
 WriteError writeKtx2(Write& write, const ImageProvider&, bool zlib = false);
 WriteError writeKtx2(StringParam path, const ImageProvider&, bool zlib = false);
@@ -183,7 +260,8 @@ struct ImageData {
 /// from the ImageProvider.
 ImageData readImageData(const ImageProvider&, unsigned mip = 0, unsigned layer = 0);
 ImageData readImageData(std::unique_ptr<Read>&& stream, unsigned mip = 0, unsigned layer = 0);
-ImageData readImageDataStb(std::unique_ptr<Read>&& stream);
+ImageData readImageDataStb(std::unique_ptr<Read>&& stream,
+	const StbReadOptions& options = {});
 
 /// Transforms the given image into an image provider implementation.
 /// The provider will take ownership of the image.
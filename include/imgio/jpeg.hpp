@@ -0,0 +1,55 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <imgio/image.hpp>
+#include <nytl/stringParam.hpp>
+#include <memory>
+
+// Only available when imgio was built with libjpeg(-turbo), then
+// IMGIO_WITH_JPEG is defined.
+
+namespace imgio {
+
+/// ImageProvider for JPEG files, as created by loadJpeg. Can be obtained
+/// via dynamic_cast from providers returned by loadImage.
+/// Only the header is parsed on load, the file is kept mapped in memory
+/// (see ReadStreamMemoryMap) and decoded on every read. Reads are
+/// independent of each other and may happen concurrently.
+/// Grayscale images are returned as r8Srgb, all others as r8g8b8Srgb
+/// (CMYK is converted).
+/// The mip levels are the scaled versions libjpeg can produce directly
+/// while decoding (1/2, 1/4, 1/8 of the size), which is much cheaper than
+/// decoding the full image. Mip sizes are rounded down, like for all
+/// ImageProviders.
+class JpegReader : public ImageProvider {
+public:
+	/// Decodes the given mip level into the given buffer, where rows
+	/// start 'rowPitch' bytes apart. rowPitch must be at least the size
+	/// of a tightly packed row. Allows to decode e.g. directly into a
+	/// mapped texture or a region of a larger image.
+	/// Throws on error. Returns the number of bytes between the start
+	/// of the first and the end of the last row.
+	virtual u64 readPitched(span<std::byte> data, u64 rowPitch,
+		unsigned mip = 0) const = 0;
+};
+
+/// Chroma subsampling for writing JPEG files.
+enum class JpegSubsampling {
+	s444, // full chroma resolution
+	s422, // half horizontal chroma resolution
+	s420, // half horizontal and vertical chroma resolution
+};
+
+/// Writes the first layer and mip of the given 2D image as baseline JPEG
+/// file with the given quality (1 to 100). r8 images are written as
+/// grayscale, rgb8 and rgba8 (alpha is discarded) images directly as color
+/// images. Other formats are converted to r8g8b8Srgb first (see convert in
+/// format.hpp), block-compressed formats are not supported.
+/// For quality below 90, libjpeg's fast integer DCT is used, at higher
+/// quality its inaccuracy would be visible.
+WriteError writeJpeg(Write&, const ImageProvider&, unsigned quality = 90u,
+	JpegSubsampling subsampling = JpegSubsampling::s420);
+WriteError writeJpeg(StringParam path, const ImageProvider&,
+	unsigned quality = 90u, JpegSubsampling subsampling = JpegSubsampling::s420);
+
+} // namespace imgio
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <imgio/image.hpp>
+#include <imgio/format.hpp>
+#include <nytl/span.hpp>
+#include <nytl/vec.hpp>
+#include <nytl/stringParam.hpp>
+#include <string_view>
+#include <optional>
+#include <memory>
+#include <vector>
+#include <mutex>
+
+namespace imgio {
+
+/// Key/value pair from the metadata of a KTX or KTX2 file.
+/// The value is returned as raw bytes, string values therefore
+/// include their null terminator (as required by the spec).
+struct KtxKeyValue {
+	std::string_view key;
+	std::string_view value;
+};
+
+/// ImageProvider implementation for KTX and KTX2 files, as created by
+/// loadKtx and loadKtx2. Can be obtained via dynamic_cast from providers
+/// returned by loadImage.
+class KtxProvider : public ImageProvider {
+public:
+	/// Returns all key/value pairs of the file, in file order.
+	/// They reference a single buffer that was read once on load (or the
+	/// source buffer directly for memory streams) and stay valid as long
+	/// as the provider.
+	span<const KtxKeyValue> metadata() const { return metadata_; }
+
+	/// Returns the value for the given key or std::nullopt if the file
+	/// doesn't contain it.
+	std::optional<std::string_view> findMetadata(std::string_view key) const;
+
+	/// Returns the absolute stream address of the given subresource or
+	/// std::nullopt if the data isn't stored uncompressed in the file,
+	/// e.g. for supercompressed KTX2 files.
+	virtual std::optional<u64> dataOffset(unsigned mip, unsigned layer) const = 0;
+
+	/// Returns the stream the file is read from.
+	virtual const Read& stream() const = 0;
+
+protected:
+	// Reads the key/value data block of the given size at the current
+	// stream address and parses it into metadata_.
+	ReadError readMetadata(Read& stream, u64 size);
+
+protected:
+	std::unique_ptr<std::byte[]> metadataData_; // unset for memory streams
+	std::vector<KtxKeyValue> metadata_;
+};
+
+/// Parses a KTX/KTX2 key/value data block. The returned pairs reference
+/// the given data. Returns false for malformed data.
+bool parseKtxMetadata(span<const std::byte> data, std::vector<KtxKeyValue>& out);
+
+/// Updates single subresources of an existing, uncompressed KTX or KTX2
+/// file in place. Only the given data is written, via positional writes,
+/// the rest of the file is left untouched. The layout of the file
+/// (size, format, levels, layers) can't be changed.
+class KtxUpdater {
+public:
+	KtxUpdater() = default;
+	~KtxUpdater();
+
+	KtxUpdater(KtxUpdater&&);
+	KtxUpdater& operator=(KtxUpdater&&);
+
+	/// Opens the KTX or KTX2 file at the given path for updating.
+	/// Returns ReadError::unsupportedFormat for supercompressed files.
+	ReadError open(StringParam path);
+
+	/// Overwrites the given subresource with the given, tightly packed
+	/// data. data.size() must match the size of the subresource.
+	WriteError writeSubresource(unsigned mip, unsigned layer,
+		span<const std::byte> data);
+
+	/// Overwrites the given subresource with the data of the same
+	/// subresource in the given image. The image must have the same
+	/// size and format as the file.
+	WriteError writeSubresource(const ImageProvider& src,
+		unsigned mip, unsigned layer);
+
+	/// Flushes all written data to the file. When 'sync' is true,
+	/// additionally waits until it was written to the storage device.
+	/// Automatically called (without sync) on destruction.
+	WriteError flush(bool sync = false);
+
+	Vec3ui size() const;
+	Format format() const;
+	unsigned mipLevels() const;
+	unsigned layers() const;
+	bool cubemap() const;
+
+protected:
+	std::unique_ptr<ImageProvider> provider_; // the parsed file, for layout
+	const KtxProvider* ktx_ {};
+	std::unique_ptr<FileWrite> write_;
+};
+
+/// Shared implementation of the push-style KTX and KTX2 writers.
+/// In contrast to writeKtx/writeKtx2, the data does not have to be
+/// available via an ImageProvider. The file layout is computed up front
+/// in 'begin' (see KtxWriter, Ktx2Writer) so that every subresource
+/// can be written directly to its final position via Write::writeAt,
+/// in any order.
+/// When the stream supports concurrent positional writes (see
+/// Write::concurrentWriteAt), 'writeSubresource' may be called from
+/// multiple threads at the same time, otherwise calls are serialized.
+/// The Write must stay valid until 'finish' was called.
+class KtxWriterBase {
+public:
+	KtxWriterBase(Write& write) : write_(&write) {}
+
+	/// Writes one full, tightly packed 2D image to the given mip, layer.
+	/// data.size() must match the size of the subresource. Layers
+	/// include cubemap faces, like in ImageProvider.
+	/// Must only be called between 'begin' and 'finish'.
+	WriteError writeSubresource(unsigned mip, unsigned layer,
+		span<const std::byte> data);
+
+	/// Writes all subresources from the given image, which must match
+	/// the parameters given to 'begin'. When the stream is a
+	/// MappedFileWrite, the image is read directly into the mapping.
+	/// Subresources are written in parallel when both the stream
+	/// and the image support it (see Write::concurrentWriteAt,
+	/// ImageProvider::concurrentRead). When the image is a file-backed,
+	/// uncompressed KtxProvider and the stream a FileWrite, the data
+	/// is copied between the files without going through user space
+	/// where possible (see copyFileRange).
+	WriteError writeSubresources(const ImageProvider& image);
+
+	/// Whether the data of the given image can be copied directly between
+	/// files, i.e. it's a file-backed, uncompressed KtxProvider.
+	static bool fileCopyable(const ImageProvider& image);
+
+	/// Checks that all subresources were written. Does not close
+	/// the underlying stream.
+	WriteError finish();
+
+	/// Returns the absolute stream address of the given subresource.
+	/// Only valid after 'begin'.
+	u64 offset(unsigned mip, unsigned layer) const;
+
+	/// Returns the stream address one past the last byte of the file.
+	/// Only valid after 'begin'.
+	u64 endAddress() const { return end_; }
+
+	Vec3ui size() const { return size_; }
+	Format format() const { return format_; }
+	unsigned mipLevels() const { return mips_; }
+	unsigned layers() const { return layers_; }
+
+protected:
+	void initLayout(Vec3ui size, Format format, unsigned mips,
+		unsigned layers, u32 faceAlign);
+
+	// Copies the subresources from a file-backed, uncompressed
+	// KtxProvider into a FileWrite via copyFileRange. Returns false
+	// if that isn't possible. Throws on error.
+	bool copySubresources(const ImageProvider& image);
+
+protected:
+	Write* write_ {};
+	Vec3ui size_ {};
+	Format format_ {};
+	unsigned mips_ {};
+	unsigned layers_ {};
+	u32 faceAlign_ {1u}; // padding after each subresource
+	u64 end_ {};
+	std::vector<u64> offsets_; // subresource addresses, [mip * layers + layer]
+	std::vector<u8> written_; // whether subresource was written
+	std::mutex mutex_; // for streams without concurrent positional writes
+};
+
+/// Push-style KTX writer, see KtxWriterBase.
+class KtxWriter : public KtxWriterBase {
+public:
+	using KtxWriterBase::KtxWriterBase;
+
+	/// Writes the header and computes the file layout, starting at
+	/// the current address of the stream.
+	/// 'layers' includes cubemap faces, i.e. must be a multiple of
+	/// 6 for cubemaps.
+	WriteError begin(Vec3ui size, Format format, unsigned mips = 1u,
+		unsigned layers = 1u, bool cubemap = false);
+
+	/// Returns the size in bytes of a file written with the given
+	/// parameters.
+	static u64 fileSize(Vec3ui size, Format format, unsigned mips = 1u,
+		unsigned layers = 1u);
+};
+
+/// Push-style KTX2 writer, see KtxWriterBase.
+/// Only supports output without supercompression since otherwise the
+/// layout can't be known up front.
+class Ktx2Writer : public KtxWriterBase {
+public:
+	using KtxWriterBase::KtxWriterBase;
+
+	/// Writes the header and level index and computes the file layout,
+	/// starting at the current address of the stream.
+	/// 'layers' includes cubemap faces, i.e. must be a multiple of
+	/// 6 for cubemaps.
+	WriteError begin(Vec3ui size, Format format, unsigned mips = 1u,
+		unsigned layers = 1u, bool cubemap = false);
+
+	/// Returns the size in bytes of a file written with the given
+	/// parameters.
+	static u64 fileSize(Vec3ui size, Format format, unsigned mips = 1u,
+		unsigned layers = 1u);
+};
+
+} // namespace imgio
@@ -8,6 +8,7 @@
 #include <stb_image.h>
 #include <cstring>
 #include <stdexcept>
+#include <vector>
 #include <type_traits>
 
 namespace imgio {
@@ -33,6 +34,11 @@ public:
 
 	// Returns the current absolute address in the stream.
 	virtual u64 address() const = 0;
+
+	// Returns whether the stream supports seek and address.
+	// Streams like pipes or sockets can't seek, users may choose
+	// a sequential code path for them.
+	virtual bool seekable() const { return true; }
 };
 
 // Simple abstract readable stream interface.
@@ -118,6 +124,21 @@ public:
 	void write(const T& val) {
 		write(nytl::bytes(val));
 	}
+
+	// Writes the given buffer at the given absolute address.
+	// The default implementation seeks to the address and back, it
+	// can therefore not be called concurrently. Throws on error.
+	virtual void writeAt(u64 address, span<const std::byte> buf) {
+		auto saved = this->address();
+		seek(address);
+		write(buf);
+		seek(saved);
+	}
+
+	// Whether 'writeAt' may be called from multiple threads at the same
+	// time (for non-overlapping ranges). Implementations returning true
+	// must not change the current address in 'writeAt'.
+	virtual bool concurrentWriteAt() const { return false; }
 };
 
 const stbi_io_callbacks& streamStbiCallbacks();
@@ -131,6 +152,7 @@ public:
 	void seek(i64 offset, Seek::Origin so) override;
 	u64 address() const override;
 	bool eof() const override;
+	bool seekable() const override;
 
 	std::FILE* file() const { return file_.get(); }
 
@@ -146,6 +168,16 @@ public:
 	i64 writePartial(const std::byte*, u64 size) override;
 	void seek(i64 offset, Seek::Origin so) override;
 	u64 address() const override;
+	bool seekable() const override;
+
+	// On linux, uses pwrite. Flushes the buffered data first.
+	void writeAt(u64 address, span<const std::byte> buf) override;
+	bool concurrentWriteAt() const override;
+
+	// Flushes buffered data to the file. When 'sync' is true, additionally
+	// waits until the data was written to the storage device (fsync).
+	// Throws on error.
+	void flush(bool sync = false);
 
 	std::FILE* file() const { return file_.get(); }
 
@@ -153,6 +185,50 @@ protected:
 	FileHandle file_;
 };
 
+// Copies 'size' bytes from 'src' at 'srcOffset' to 'dst' at 'dstOffset'
+// without moving the data through user space (copy_file_range with
+// sendfile as fallback, linux only). The current addresses of both
+// streams are left unchanged. Returns false if this isn't supported
+// for the given files, nothing was copied then and the caller has to
+// fall back to reading and writing. Throws on other errors.
+bool copyFileRange(const FileRead& src, u64 srcOffset,
+	FileWrite& dst, u64 dstOffset, u64 size);
+
+// Writes into a memory mapped file of fixed size, linux only.
+// On construction, the file is resized (preallocated where supported)
+// to the given size and mapped. Writes past the end throw.
+// Positional writes are plain copies into the mapping and can therefore
+// be done concurrently. Throws on error, e.g. if mapping isn't supported.
+class MappedFileWrite : public Write {
+public:
+	MappedFileWrite(FileHandle&& file, u64 size);
+	~MappedFileWrite();
+
+	MappedFileWrite(const MappedFileWrite&) = delete;
+	MappedFileWrite& operator=(const MappedFileWrite&) = delete;
+
+	i64 writePartial(const std::byte*, u64 size) override;
+	void seek(i64 offset, Seek::Origin so) override;
+	u64 address() const override { return at_; }
+
+	void writeAt(u64 address, span<const std::byte> buf) override;
+	bool concurrentWriteAt() const override { return true; }
+
+	// Writes all modified pages back to the file. When 'sync' is true,
+	// waits until that is done. Throws on error.
+	void flush(bool sync = false);
+
+	// Direct access to the mapped file contents.
+	span<std::byte> data() const { return {data_, std::size_t(size_)}; }
+	std::FILE* file() const { return file_.get(); }
+
+protected:
+	FileHandle file_;
+	std::byte* data_ {};
+	u64 size_ {};
+	u64 at_ {};
+};
+
 class MemoryRead : public Read {
 public:
 	MemoryRead() = default;
@@ -184,6 +260,48 @@ protected:
 	u64 at_ {0};
 };
 
+// Writes into an owned, growing memory buffer.
+// Seeking past the end and writing there fills the gap with zeros.
+class MemoryWrite : public Write {
+public:
+	MemoryWrite() = default;
+
+	inline i64 writePartial(const std::byte* buf, u64 size) override {
+		if(at_ + size > buf_.size()) {
+			buf_.resize(at_ + size);
+		}
+
+		std::memcpy(buf_.data() + at_, buf, size);
+		at_ += size;
+		return size;
+	}
+
+	inline void seek(i64 offset, Seek::Origin origin) override {
+		switch(origin) {
+			case Seek::Origin::set: at_ = offset; break;
+			case Seek::Origin::curr: at_ += offset; break;
+			case Seek::Origin::end: at_ = buf_.size() + offset; break;
+			default: throw std::logic_error("Invalid Stream::SeekOrigin");
+		}
+	}
+
+	inline u64 address() const override { return at_; }
+
+	inline span<const std::byte> buffer() const { return buf_; }
+
+	// Returns the written data, resets the stream.
+	inline std::vector<std::byte> release() {
+		auto ret = std::move(buf_);
+		buf_ = {};
+		at_ = 0u;
+		return ret;
+	}
+
+protected:
+	std::vector<std::byte> buf_;
+	u64 at_ {0};
+};
+
 // Completely maps the data of a stream into memory.
 // This is done as efficiently as possible: if the stream is a memory
 // stream, simply returns the arleady in-memory buffer. Otherwise,
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <imgio/image.hpp>
+#include <memory>
+
+// Only available when imgio was built with libwebp, then
+// IMGIO_WITH_WEBP is defined. Animations additionally need
+// libwebpdemux (IMGIO_WITH_WEBP_DEMUX).
+
+namespace imgio {
+
+/// ImageProvider for WebP files, as created by loadWebp. Can be obtained
+/// via dynamic_cast from providers returned by loadImage.
+/// Only the header is parsed on load, the file is kept mapped in memory
+/// (see ReadStreamMemoryMap) and decoded directly into the buffer
+/// given to read. Images are always returned as r8g8b8a8Srgb.
+/// Every frame of an animation is a layer, composed over the previous
+/// frames on the canvas. Like for GifReader, frames are decoded lazily
+/// and reading them in order is cheap while reading an earlier frame
+/// decodes the animation from the start again. Reads of still images
+/// may happen concurrently.
+class WebpReader : public ImageProvider {
+public:
+	/// Returns how long the given frame should be shown, in milliseconds.
+	/// Zero for still images.
+	virtual unsigned frameDelay(unsigned frame) const = 0;
+};
+
+} // namespace imgio
@@ -0,0 +1,679 @@
+#include <imgio/dds.hpp>
+#include <imgio/image.hpp>
+#include <imgio/stream.hpp>
+#include <imgio/file.hpp>
+#include <imgio/format.hpp>
+#include <imgio/allocation.hpp>
+#include <dlg/dlg.hpp>
+#include <algorithm>
+#include <vector>
+#include <optional>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+
+// DirectDraw Surface files, see
+//   https://learn.microsoft.com/en-us/windows/win32/direct3ddds/dx-graphics-dds-pguide
+// After the magic and a 124-byte header follows an optional DX10 header
+// (when the pixel format FourCC is "DX10") and then the data, tightly
+// packed without any padding. In contrast to KTX, the data is ordered
+// by array element (or cubemap face) first, i.e. all mip levels
+// of layer 0 come before those of layer 1.
+
+namespace imgio {
+
+constexpr u32 ddsFourCC(const char (&str)[5]) {
+	return u32(u8(str[0])) | (u32(u8(str[1])) << 8u) |
+		(u32(u8(str[2])) << 16u) | (u32(u8(str[3])) << 24u);
+}
+
+constexpr u32 ddsMagic = ddsFourCC("DDS ");
+constexpr u32 ddsFourCCDX10 = ddsFourCC("DX10");
+
+// DDS_HEADER.flags
+constexpr u32 ddsdCaps = 0x1u;
+constexpr u32 ddsdHeight = 0x2u;
+constexpr u32 ddsdWidth = 0x4u;
+constexpr u32 ddsdPitch = 0x8u;
+constexpr u32 ddsdPixelFormat = 0x1000u;
+constexpr u32 ddsdMipMapCount = 0x20000u;
+constexpr u32 ddsdLinearSize = 0x80000u;
+constexpr u32 ddsdDepth = 0x800000u;
+
+// DDS_PIXELFORMAT.flags
+constexpr u32 ddpfAlphaPixels = 0x1u;
+constexpr u32 ddpfAlpha = 0x2u;
+constexpr u32 ddpfFourCC = 0x4u;
+constexpr u32 ddpfRGB = 0x40u;
+constexpr u32 ddpfLuminance = 0x20000u;
+
+// DDS_HEADER.caps, caps2
+constexpr u32 ddsCapsComplex = 0x8u;
+constexpr u32 ddsCapsTexture = 0x1000u;
+constexpr u32 ddsCapsMipMap = 0x400000u;
+constexpr u32 ddsCaps2Cubemap = 0x200u;
+constexpr u32 ddsCaps2CubemapAllFaces = 0xFC00u;
+constexpr u32 ddsCaps2Volume = 0x200000u;
+
+// DDS_HEADER_DXT10.resourceDimension, miscFlag
+constexpr u32 ddsDimensionTexture1D = 2u;
+constexpr u32 ddsDimensionTexture2D = 3u;
+constexpr u32 ddsDimensionTexture3D = 4u;
+constexpr u32 ddsMiscTextureCube = 0x4u;
+
+struct DdsPixelFormat {
+	u32 size;
+	u32 flags;
+	u32 fourCC;
+	u32 rgbBitCount;
+	u32 rBitMask;
+	u32 gBitMask;
+	u32 bBitMask;
+	u32 aBitMask;
+};
+
+struct DdsHeader {
+	u32 size;
+	u32 flags;
+	u32 height;
+	u32 width;
+	u32 pitchOrLinearSize;
+	u32 depth;
+	u32 mipMapCount;
+	u32 reserved1[11];
+	DdsPixelFormat pixelFormat;
+	u32 caps;
+	u32 caps2;
+	u32 caps3;
+	u32 caps4;
+	u32 reserved2;
+};
+
+struct DdsHeaderDX10 {
+	u32 dxgiFormat;
+	u32 resourceDimension;
+	u32 miscFlag;
+	u32 arraySize;
+	u32 miscFlags2;
+};
+
+static_assert(sizeof(DdsPixelFormat) == 32u);
+static_assert(sizeof(DdsHeader) == 124u);
+static_assert(sizeof(DdsHeaderDX10) == 20u);
+
+// When multiple entries map to the same format, the first one is
+// used for writing.
+struct DdsDxgiFormat {
+	u32 dxgi;
+	Format format;
+};
+
+constexpr DdsDxgiFormat ddsDxgiFormats[] = {
+	{2, Format::r32g32b32a32Sfloat},
+	{3, Format::r32g32b32a32Uint},
+	{4, Format::r32g32b32a32Sint},
+	{6, Format::r32g32b32Sfloat},
+	{7, Format::r32g32b32Uint},
+	{8, Format::r32g32b32Sint},
+	{10, Format::r16g16b16a16Sfloat},
+	{11, Format::r16g16b16a16Unorm},
+	{12, Format::r16g16b16a16Uint},
+	{13, Format::r16g16b16a16Snorm},
+	{14, Format::r16g16b16a16Sint},
+	{16, Format::r32g32Sfloat},
+	{17, Format::r32g32Uint},
+	{18, Format::r32g32Sint},
+	{24, Format::a2b10g10r10UnormPack32},
+	{25, Format::a2b10g10r10UintPack32},
+	{26, Format::b10g11r11UfloatPack32},
+	{28, Format::r8g8b8a8Unorm},
+	{29, Format::r8g8b8a8Srgb},
+	{30, Format::r8g8b8a8Uint},
+	{31, Format::r8g8b8a8Snorm},
+	{32, Format::r8g8b8a8Sint},
+	{34, Format::r16g16Sfloat},
+	{35, Format::r16g16Unorm},
+	{36, Format::r16g16Uint},
+	{37, Format::r16g16Snorm},
+	{38, Format::r16g16Sint},
+	{40, Format::d32Sfloat},
+	{41, Format::r32Sfloat},
+	{42, Format::r32Uint},
+	{43, Format::r32Sint},
+	{45, Format::d24UnormS8Uint},
+	{49, Format::r8g8Unorm},
+	{50, Format::r8g8Uint},
+	{51, Format::r8g8Snorm},
+	{52, Format::r8g8Sint},
+	{54, Format::r16Sfloat},
+	{55, Format::d16Unorm},
+	{56, Format::r16Unorm},
+	{57, Format::r16Uint},
+	{58, Format::r16Snorm},
+	{59, Format::r16Sint},
+	{61, Format::r8Unorm},
+	{62, Format::r8Uint},
+	{63, Format::r8Snorm},
+	{64, Format::r8Sint},
+	{67, Format::e5b9g9r9UfloatPack32},
+	{71, Format::bc1RgbaUnormBlock},
+	{72, Format::bc1RgbaSrgbBlock},
+	{74, Format::bc2UnormBlock},
+	{75, Format::bc2SrgbBlock},
+	{77, Format::bc3UnormBlock},
+	{78, Format::bc3SrgbBlock},
+	{80, Format::bc4UnormBlock},
+	{81, Format::bc4SnormBlock},
+	{83, Format::bc5UnormBlock},
+	{84, Format::bc5SnormBlock},
+	// DXGI and vulkan name packed formats in opposite bit order
+	{85, Format::r5g6b5UnormPack16}, // B5G6R5_UNORM
+	{86, Format::a1r5g5b5UnormPack16}, // B5G5R5A1_UNORM
+	{87, Format::b8g8r8a8Unorm},
+	{91, Format::b8g8r8a8Srgb},
+	{95, Format::bc6hUfloatBlock},
+	{96, Format::bc6hSfloatBlock},
+	{98, Format::bc7UnormBlock},
+	{99, Format::bc7SrgbBlock},
+
+	// aliases, only relevant for reading. BC1 has no separate
+	// format without alpha. The content of the X channel of the
+	// *X8_UNORM formats is undefined, we still expose it as alpha.
+	{71, Format::bc1RgbUnormBlock},
+	{72, Format::bc1RgbSrgbBlock},
+	{88, Format::b8g8r8a8Unorm}, // B8G8R8X8_UNORM
+	{93, Format::b8g8r8a8Srgb}, // B8G8R8X8_UNORM_SRGB
+	// typeless formats, interpreted as unorm
+	{27, Format::r8g8b8a8Unorm},
+	{70, Format::bc1RgbaUnormBlock},
+	{73, Format::bc2UnormBlock},
+	{76, Format::bc3UnormBlock},
+	{79, Format::bc4UnormBlock},
+	{82, Format::bc5UnormBlock},
+	{90, Format::b8g8r8a8Unorm},
+	{92, Format::b8g8r8a8Unorm},
+	{94, Format::bc6hUfloatBlock},
+	{97, Format::bc7UnormBlock},
+};
+
+// Legacy headers: FourCC codes and the numeric D3DFORMAT values
+// some writers put there.
+struct DdsFourCCFormat {
+	u32 fourCC;
+	Format format;
+};
+
+constexpr DdsFourCCFormat ddsFourCCFormats[] = {
+	{ddsFourCC("DXT1"), Format::bc1RgbaUnormBlock},
+	{ddsFourCC("DXT3"), Format::bc2UnormBlock},
+	{ddsFourCC("DXT5"), Format::bc3UnormBlock},
+	{ddsFourCC("ATI1"), Format::bc4UnormBlock},
+	{ddsFourCC("BC4S"), Format::bc4SnormBlock},
+	{ddsFourCC("ATI2"), Format::bc5UnormBlock},
+	{ddsFourCC("BC5S"), Format::bc5SnormBlock},
+	{36, Format::r16g16b16a16Unorm},
+	{110, Format::r16g16b16a16Snorm},
+	{111, Format::r16Sfloat},
+	{112, Format::r16g16Sfloat},
+	{113, Format::r16g16b16a16Sfloat},
+	{114, Format::r32Sfloat},
+	{115, Format::r32g32Sfloat},
+	{116, Format::r32g32b32a32Sfloat},
+
+	// aliases. DXT2 and DXT4 only signal premultiplied alpha
+	{ddsFourCC("DXT1"), Format::bc1RgbUnormBlock},
+	{ddsFourCC("DXT2"), Format::bc2UnormBlock},
+	{ddsFourCC("DXT4"), Format::bc3UnormBlock},
+	{ddsFourCC("BC4U"), Format::bc4UnormBlock},
+	{ddsFourCC("BC5U"), Format::bc5UnormBlock},
+};
+
+// Legacy headers: uncompressed formats described via bit masks.
+// Luminance formats only use the red mask.
+struct DdsMaskFormat {
+	u32 bitCount;
+	u32 r, g, b, a;
+	Format format;
+};
+
+constexpr DdsMaskFormat ddsMaskFormats[] = {
+	{32, 0xFFu, 0xFF00u, 0xFF0000u, 0xFF000000u, Format::r8g8b8a8Unorm},
+	{32, 0xFF0000u, 0xFF00u, 0xFFu, 0xFF000000u, Format::b8g8r8a8Unorm},
+	{32, 0x3FFu, 0xFFC00u, 0x3FF00000u, 0xC0000000u, Format::a2b10g10r10UnormPack32},
+	{32, 0x3FF00000u, 0xFFC00u, 0x3FFu, 0xC0000000u, Format::a2r10g10b10UnormPack32},
+	{32, 0xFFFFu, 0xFFFF0000u, 0u, 0u, Format::r16g16Unorm},
+	{24, 0xFF0000u, 0xFF00u, 0xFFu, 0u, Format::b8g8r8Unorm},
+	{24, 0xFFu, 0xFF00u, 0xFF0000u, 0u, Format::r8g8b8Unorm},
+	{16, 0xF800u, 0x7E0u, 0x1Fu, 0u, Format::r5g6b5UnormPack16},
+	{16, 0x7C00u, 0x3E0u, 0x1Fu, 0x8000u, Format::a1r5g5b5UnormPack16},
+	{16, 0xFFu, 0u, 0u, 0xFF00u, Format::r8g8Unorm}, // L8A8
+	{16, 0xFFFFu, 0u, 0u, 0u, Format::r16Unorm}, // L16
+	{8, 0xFFu, 0u, 0u, 0u, Format::r8Unorm}, // L8
+
+	// aliases, X8 formats. See the DXGI aliases above
+	{32, 0xFFu, 0xFF00u, 0xFF0000u, 0u, Format::r8g8b8a8Unorm},
+	{32, 0xFF0000u, 0xFF00u, 0xFFu, 0u, Format::b8g8r8a8Unorm},
+};
+
+Format ddsFormatFromDxgi(u32 dxgi) {
+	for(auto& entry : ddsDxgiFormats) {
+		if(entry.dxgi == dxgi) {
+			return entry.format;
+		}
+	}
+
+	return Format::undefined;
+}
+
+Format ddsFormatFromLegacy(const DdsPixelFormat& pf) {
+	if(pf.flags & ddpfFourCC) {
+		for(auto& entry : ddsFourCCFormats) {
+			if(entry.fourCC == pf.fourCC) {
+				return entry.format;
+			}
+		}
+
+		return Format::undefined;
+	}
+
+	if(!(pf.flags & (ddpfRGB | ddpfLuminance | ddpfAlpha))) {
+		return Format::undefined;
+	}
+
+	// the alpha mask is only valid with the alpha flag
+	auto a = (pf.flags & (ddpfAlphaPixels | ddpfAlpha)) ? pf.aBitMask : 0u;
+	for(auto& entry : ddsMaskFormats) {
+		if(entry.bitCount == pf.rgbBitCount && entry.r == pf.rBitMask &&
+				entry.g == pf.gBitMask && entry.b == pf.bBitMask &&
+				entry.a == a) {
+			return entry.format;
+		}
+	}
+
+	return Format::undefined;
+}
+
+class DdsReaderImpl : public DdsReader {
+public:
+	Format format_ {};
+	Vec3ui size_ {};
+	unsigned mips_ {};
+	unsigned layers_ {};
+	bool cubemap_ {};
+	u32 dxgiFormat_ {};
+	u64 dataBegin_ {};
+	u64 layerSize_ {}; // size of all mips of one layer
+
+	ReadStreamMemoryMap mmap_; // empty if the stream can't be mapped
+	mutable std::unique_ptr<Read> stream_; // only set when not mapped
+	mutable std::vector<std::byte> tmpData_;
+
+public:
+	ReadError load(Read& stream);
+
+	// Returns the offset of the given mip relative to the beginning
+	// of its layer.
+	u64 mipOffset(unsigned mip) const {
+		u64 off = 0u;
+		for(auto i = 0u; i < mip; ++i) {
+			off += sizeBytes(size_, i, format_);
+		}
+
+		return off;
+	}
+
+	Vec3ui size() const noexcept override { return size_; }
+	Format format() const noexcept override { return format_; }
+	unsigned mipLevels() const noexcept override { return mips_; }
+	unsigned layers() const noexcept override { return layers_; }
+	bool cubemap() const noexcept override { return cubemap_; }
+	bool concurrentRead() const noexcept override { return mapped(); }
+
+	bool mapped() const override { return mmap_.data() != nullptr; }
+	unsigned dxgiFormat() const override { return dxgiFormat_; }
+
+	u64 dataOffset(unsigned mip, unsigned layer) const override {
+		dlg_assert(mip < mips_);
+		dlg_assert(layer < layers_);
+		return dataBegin_ + layer * layerSize_ + mipOffset(mip);
+	}
+
+	span<const std::byte> read(unsigned mip, unsigned layer) const override {
+		auto byteSize = sizeBytes(size_, mip, format_);
+		if(mapped()) {
+			return mmap_.span().subspan(dataOffset(mip, layer), byteSize);
+		}
+
+		tmpData_.resize(byteSize);
+		read(tmpData_, mip, layer);
+		return tmpData_;
+	}
+
+	u64 read(span<std::byte> data, unsigned mip, unsigned layer) const override {
+		auto byteSize = sizeBytes(size_, mip, format_);
+		dlg_assert(u64(data.size()) >= byteSize);
+
+		auto address = dataOffset(mip, layer);
+		if(mapped()) {
+			std::memcpy(data.data(), mmap_.data() + address, byteSize);
+		} else {
+			stream_->seek(address);
+			stream_->read(data.data(), byteSize);
+		}
+
+		return byteSize;
+	}
+};
+
+ReadError DdsReaderImpl::load(Read& stream) {
+	u32 magic;
+	if(!stream.readPartial(magic)) {
+		dlg_debug("DDS can't read magic");
+		return ReadError::unexpectedEnd;
+	}
+
+	if(magic != ddsMagic) {
+		return ReadError::invalidType;
+	}
+
+	DdsHeader header;
+	if(!stream.readPartial(header)) {
+		dlg_debug("DDS can't read header");
+		return ReadError::unexpectedEnd;
+	}
+
+	if(header.size != sizeof(DdsHeader) ||
+			header.pixelFormat.size != sizeof(DdsPixelFormat)) {
+		dlg_debug("DDS invalid header size: {}, {}", header.size,
+			header.pixelFormat.size);
+		return ReadError::invalidType;
+	}
+
+	if(header.width == 0u) {
+		dlg_debug("DDS width == 0");
+		return ReadError::empty;
+	}
+
+	size_ = {header.width, std::max(header.height, 1u), 1u};
+	mips_ = std::max(header.mipMapCount, 1u);
+	layers_ = 1u;
+
+	auto& pf = header.pixelFormat;
+	if((pf.flags & ddpfFourCC) && pf.fourCC == ddsFourCCDX10) {
+		DdsHeaderDX10 dx10;
+		if(!stream.readPartial(dx10)) {
+			dlg_debug("DDS can't read DX10 header");
+			return ReadError::unexpectedEnd;
+		}
+
+		dxgiFormat_ = dx10.dxgiFormat;
+		format_ = ddsFormatFromDxgi(dx10.dxgiFormat);
+		if(format_ == Format::undefined) {
+			dlg_warn("unsupported DDS DXGI format: {}", dx10.dxgiFormat);
+			return ReadError::unsupportedFormat;
+		}
+
+		if(dx10.arraySize == 0u) {
+			dlg_debug("DDS arraySize == 0");
+			return ReadError::empty;
+		}
+
+		switch(dx10.resourceDimension) {
+			case ddsDimensionTexture1D:
+				size_.y = 1u;
+				break;
+			case ddsDimensionTexture2D:
+				cubemap_ = (dx10.miscFlag & ddsMiscTextureCube);
+				break;
+			case ddsDimensionTexture3D:
+				size_.z = std::max(header.depth, 1u);
+				break;
+			default:
+				dlg_warn("invalid DDS resource dimension {}",
+					dx10.resourceDimension);
+				return ReadError::invalidType;
+		}
+
+		if(size_.z > 1u && dx10.arraySize > 1u) {
+			dlg_warn("DDS 3D image with layers unsupported");
+			return ReadError::cantRepresent;
+		}
+
+		// checked against the file size below
+		if(dx10.arraySize > 0xFFFFu) {
+			dlg_warn("DDS arraySize {} too large", dx10.arraySize);
+			return ReadError::cantRepresent;
+		}
+
+		layers_ = dx10.arraySize * (cubemap_ ? 6u : 1u);
+	} else {
+		format_ = ddsFormatFromLegacy(pf);
+		if(format_ == Format::undefined) {
+			dlg_warn("unsupported DDS pixel format: flags {}{}, fourCC {}, "
+				"bits {}, masks {} {} {} {}", std::hex, pf.flags, pf.fourCC,
+				pf.rgbBitCount, pf.rBitMask, pf.gBitMask, pf.bBitMask,
+				pf.aBitMask);
+			return ReadError::unsupportedFormat;
+		}
+
+		if(header.caps2 & ddsCaps2Cubemap) {
+			// DX9 allowed cubemaps with only some of the faces
+			if((header.caps2 & ddsCaps2CubemapAllFaces) != ddsCaps2CubemapAllFaces) {
+				dlg_warn("DDS cubemap with missing faces unsupported");
+				return ReadError::cantRepresent;
+			}
+
+			cubemap_ = true;
+			layers_ = 6u;
+		} else if(header.caps2 & ddsCaps2Volume) {
+			size_.z = std::max(header.depth, 1u);
+		}
+	}
+
+	if(cubemap_ && size_.x != size_.y) {
+		dlg_warn("DDS cubemap with non-square faces: {}x{}", size_.x, size_.y);
+		return ReadError::invalidType;
+	}
+
+	if(mips_ > numMipLevels(size_)) {
+		dlg_warn("DDS: invalid number of mip levels {} for size {}x{}x{}",
+			mips_, size_.x, size_.y, size_.z);
+		return ReadError::invalidType;
+	}
+
+	dataBegin_ = stream.address();
+
+	// Check the first level against the file size before computing
+	// the exact sizes since those may overflow for malformed files.
+	stream.seek(0, Seek::Origin::end);
+	auto fileSize = stream.address();
+	auto [bx, by, bz] = blockSize(format_);
+	auto blocks = [](u32 texels, u32 block) {
+		return double((u64(texels) + block - 1u) / block);
+	};
+	auto mipSize = blocks(size_.x, bx) * blocks(size_.y, by) *
+		blocks(size_.z, bz) * formatElementSize(format_);
+	if(dataBegin_ + mipSize * layers_ > double(fileSize)) {
+		dlg_debug("DDS file too small for {} layers of size {}x{}x{}",
+			layers_, size_.x, size_.y, size_.z);
+		return ReadError::unexpectedEnd;
+	}
+
+	layerSize_ = mipOffset(mips_);
+	if(dataBegin_ + layers_ * layerSize_ > fileSize) {
+		dlg_debug("DDS file too small: {}, expected {}", fileSize,
+			dataBegin_ + layers_ * layerSize_);
+		return ReadError::unexpectedEnd;
+	}
+
+	return ReadError::none;
+}
+
+ReadError loadDds(std::unique_ptr<Read>&& stream,
+		std::unique_ptr<ImageProvider>& provider) {
+	auto reader = std::make_unique<DdsReaderImpl>();
+	auto res = reader->load(*stream);
+	if(res != ReadError::none) {
+		return res;
+	}
+
+	// Only takes ownership of the stream if it can be mapped
+	// without copying.
+	reader->mmap_ = ReadStreamMemoryMap(std::move(stream), true);
+	if(!reader->mapped()) {
+		reader->stream_ = std::move(stream);
+	}
+
+	provider = std::move(reader);
+	return ReadError::none;
+}
+
+// save
+WriteError writeDdsThrow(Write& write, const ImageProvider& image) {
+	auto fmt = image.format();
+	auto size = image.size();
+	auto mips = std::max(image.mipLevels(), 1u);
+	auto layers = std::max(image.layers(), 1u);
+	auto cubemap = image.cubemap();
+
+	if(size.z > 1u && layers > 1u) {
+		dlg_error("writeDds: 3D images with layers can't be represented");
+		return WriteError::unsupportedFormat;
+	}
+
+	if(cubemap && layers % 6u != 0u) {
+		dlg_error("writeDds: cubemap with {} layers", layers);
+		return WriteError::unsupportedFormat;
+	}
+
+	auto arraySize = cubemap ? layers / 6u : layers;
+
+	DdsHeader header {};
+	header.size = sizeof(DdsHeader);
+	header.flags = ddsdCaps | ddsdHeight | ddsdWidth | ddsdPixelFormat;
+	header.width = size.x;
+	header.height = size.y;
+	header.caps = ddsCapsTexture;
+	header.pixelFormat.size = sizeof(DdsPixelFormat);
+
+	if(mips > 1u) {
+		header.flags |= ddsdMipMapCount;
+		header.mipMapCount = mips;
+		header.caps |= ddsCapsComplex | ddsCapsMipMap;
+	}
+
+	if(size.z > 1u) {
+		header.flags |= ddsdDepth;
+		header.depth = size.z;
+		header.caps |= ddsCapsComplex;
+		header.caps2 |= ddsCaps2Volume;
+	}
+
+	if(cubemap) {
+		header.caps |= ddsCapsComplex;
+		header.caps2 |= ddsCaps2Cubemap | ddsCaps2CubemapAllFaces;
+	}
+
+	auto [bx, by, bz] = blockSize(fmt);
+	auto rowSize = u64(ceilDivide(size.x, bx)) * formatElementSize(fmt);
+	if(bx > 1u || by > 1u) {
+		header.flags |= ddsdLinearSize;
+		header.pitchOrLinearSize = sizeBytes(size, 0u, fmt) / size.z;
+	} else {
+		header.flags |= ddsdPitch;
+		header.pitchOrLinearSize = rowSize;
+	}
+
+	// Prefer the legacy header for compatibility with old readers,
+	// it can't describe arrays though.
+	auto& pf = header.pixelFormat;
+	if(arraySize == 1u) {
+		for(auto& entry : ddsFourCCFormats) {
+			if(entry.format == fmt) {
+				pf.flags = ddpfFourCC;
+				pf.fourCC = entry.fourCC;
+				break;
+			}
+		}
+
+		for(auto& entry : ddsMaskFormats) {
+			if(pf.flags == 0u && entry.format == fmt) {
+				pf.rgbBitCount = entry.bitCount;
+				pf.rBitMask = entry.r;
+				pf.gBitMask = entry.g;
+				pf.bBitMask = entry.b;
+				pf.aBitMask = entry.a;
+				auto rgb = entry.g != 0u || entry.b != 0u;
+				pf.flags = rgb ? ddpfRGB : ddpfLuminance;
+				pf.flags |= entry.a ? ddpfAlphaPixels : 0u;
+				break;
+			}
+		}
+	}
+
+	std::optional<DdsHeaderDX10> dx10;
+	if(pf.flags == 0u) {
+		auto it = std::find_if(std::begin(ddsDxgiFormats), std::end(ddsDxgiFormats),
+			[&](auto& entry) { return entry.format == fmt; });
+		if(it == std::end(ddsDxgiFormats)) {
+			dlg_error("writeDds: unsupported format {}", (int) fmt);
+			return WriteError::unsupportedFormat;
+		}
+
+		pf.flags = ddpfFourCC;
+		pf.fourCC = ddsFourCCDX10;
+
+		dx10.emplace();
+		dx10->dxgiFormat = it->dxgi;
+		dx10->resourceDimension = size.z > 1u ?
+			ddsDimensionTexture3D : ddsDimensionTexture2D;
+		dx10->miscFlag = cubemap ? ddsMiscTextureCube : 0u;
+		dx10->arraySize = arraySize;
+	}
+
+	write.write(ddsMagic);
+	write.write(header);
+	if(dx10) {
+		write.write(*dx10);
+	}
+
+	// The data is written untouched, for providers that don't have to
+	// decode (e.g. another DDS or KTX file) it's a plain copy.
+	for(auto l = 0u; l < layers; ++l) {
+		for(auto m = 0u; m < mips; ++m) {
+			auto byteSize = sizeBytes(size, m, fmt);
+			auto data = image.read(m, l);
+			if(data.size() != byteSize) {
+				dlg_debug("invalid ImageProvider read size: "
+					"got {}, expected {}", data.size(), byteSize);
+				return WriteError::readError;
+			}
+
+			write.write(data);
+		}
+	}
+
+	return WriteError::none;
+}
+
+WriteError writeDds(Write& write, const ImageProvider& image) {
+	try {
+		return writeDdsThrow(write, image);
+	} catch(const std::runtime_error& err) {
+		dlg_error("writeDds: {}", err.what());
+		return WriteError::cantWrite;
+	}
+}
+
+WriteError writeDds(StringParam path, const ImageProvider& image) {
+	auto file = FileHandle(path, "wb");
+	if(!file) {
+		dlg_debug("fopen: {}", std::strerror(errno));
+		return WriteError::cantOpen;
+	}
+
+	FileWrite writer(std::move(file));
+	return writeDds(writer, image);
+}
+
+} // namespace imgio
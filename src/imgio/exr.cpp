@@ -1,5 +1,7 @@
+#include <imgio/exr.hpp>
 #include <imgio/image.hpp>
 #include <imgio/stream.hpp>
+#include <imgio/allocation.hpp>
 #include <imgio/f16.hpp>
 #include <imgio/format.hpp>
 #include <nytl/scope.hpp>
@@ -7,24 +9,28 @@
 #include <dlg/dlg.hpp>
 #include <vector>
 #include <optional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include "parallel.hpp"
+#include "interleave.hpp"
 
 #define TINYEXR_IMPLEMENTATION
 #include <zlib.h>
 #include "../tinyexr.hpp"
 
 // TODO: extend support, evaluate what is needed/useful:
-// - support for actually tiled images?
-//   also, support for mip level is not tested yet, since I didn't
+// - support for mip level is not tested yet, since I didn't
 //   found an example file that wasn't *really* tiled.
-// - support for multipart images
 // - support for deep images?
 // TODO: remove unneeded high-level functions from tinyexr.
 //   should reduce it by quite some size.
-// TODO: add 'class ExrReader : ImageProvider'. Make it a public
-//   interface. This can supply additional attributes, channels,
-//   allow loading deep images. Then we can also use the StreamMemoryMap
-//   optimization instead of always reading the whole image,
-//   should help performance a lot.
+// TODO: extend the public ExrReader interface. It could supply
+//   additional attributes, channels, allow loading deep images.
 
 // technical source/specificiation:
 //   https://www.openexr.com/documentation/TechnicalIntroduction.pdf
@@ -69,35 +75,33 @@ ReadError toReadError(int res) {
 // supported one.
 
 constexpr auto noChannel = u32(0xFFFFFFFF);
-Format parseFormat(const std::array<u32, 4>& mapping, int exrPixelType,
-		bool forceRGBA) {
-	auto maxChan = forceRGBA ? 3 :
-		mapping[3] != noChannel ? 3 :
-		mapping[2] != noChannel ? 2 :
-		mapping[1] != noChannel ? 1 : 0;
-	switch(maxChan) {
-		case 0:
+
+// Returns the format with the given number of components of the given
+// exr pixel type.
+Format exrFormat(unsigned numComponents, int exrPixelType) {
+	switch(numComponents) {
+		case 1:
 			switch(exrPixelType) {
 				case TINYEXR_PIXELTYPE_UINT: return Format::r32Uint;
 				case TINYEXR_PIXELTYPE_HALF: return Format::r16Sfloat;
 				case TINYEXR_PIXELTYPE_FLOAT: return Format::r32Sfloat;
 				default: return Format::undefined;
 			}
-		case 1:
+		case 2:
 			switch(exrPixelType) {
 				case TINYEXR_PIXELTYPE_UINT: return Format::r32g32Uint;
 				case TINYEXR_PIXELTYPE_HALF: return Format::r16g16Sfloat;
 				case TINYEXR_PIXELTYPE_FLOAT: return Format::r32g32Sfloat;
 				default: return Format::undefined;
 			}
-		case 2:
+		case 3:
 			switch(exrPixelType) {
 				case TINYEXR_PIXELTYPE_UINT: return Format::r32g32b32Uint;
 				case TINYEXR_PIXELTYPE_HALF: return Format::r16g16b16Sfloat;
 				case TINYEXR_PIXELTYPE_FLOAT: return Format::r32g32b32Sfloat;
 				default: return Format::undefined;
 			}
-		case 3:
+		case 4:
 			switch(exrPixelType) {
 				case TINYEXR_PIXELTYPE_UINT: return Format::r32g32b32a32Uint;
 				case TINYEXR_PIXELTYPE_HALF: return Format::r16g16b16a16Sfloat;
@@ -108,20 +112,209 @@ Format parseFormat(const std::array<u32, 4>& mapping, int exrPixelType,
 	}
 }
 
-ReadError loadExr(std::unique_ptr<Read>&& stream,
-		std::unique_ptr<ImageProvider>& provider, bool forceRGBA) {
-	dlg_debug("== Loading EXR image ==");
+Format parseFormat(const std::array<u32, 4>& mapping, int exrPixelType,
+		bool forceRGBA) {
+	auto numComponents = forceRGBA ? 4u :
+		mapping[3] != noChannel ? 4u :
+		mapping[2] != noChannel ? 3u :
+		mapping[1] != noChannel ? 2u : 1u;
+	return exrFormat(numComponents, exrPixelType);
+}
+
+// Number of tile levels in one dimension, see the OpenEXR
+// TiledInputFile implementation.
+unsigned numTileLevels(unsigned size, int roundingMode) {
+	auto levels = 1u;
+	while(size > 1u) {
+		size = (roundingMode == TINYEXR_TILE_ROUND_UP) ? (size + 1u) / 2u : size / 2u;
+		++levels;
+	}
+
+	return levels;
+}
+
+unsigned tileLevelSize(unsigned size, unsigned level, int roundingMode) {
+	auto ret = size >> level;
+	if(roundingMode == TINYEXR_TILE_ROUND_UP && (ret << level) < size) {
+		++ret;
+	}
+
+	return std::max(ret, 1u);
+}
+
+i32 readI32(const std::byte* data) {
+	u32 val;
+	std::memcpy(&val, data, sizeof(val));
+	tinyexr::swap4(&val);
+	return i32(val);
+}
+
+class ExrReaderImpl : public ExrReader {
+public:
+	// A level exposed as mip level
+	struct Level {
+		Vec2ui size;
+		Vec2ui chunkSize; // tile size or {width, linesPerChunk}
+		Vec2ui numTiles; // {1, numChunks} for scanline images
+		u64 firstChunk; // in the offsets of the part
+	};
+
+	// A part of a multipart file. Single part files have exactly one.
+	struct Part {
+		EXRHeader header {};
+		bool headerValid {};
+		unsigned index {}; // in the file, stored in multipart chunks
+		std::string name; // 'name' attribute, only for multipart files
+		bool tiled {};
+		bool deep {};
+		u64 tableBegin {}; // file offset of the chunk offset table
+
+		int pixelType {}; // stored pixel type
+		bool halfToFloat {}; // whether half channels are converted to float
+		unsigned linesPerChunk {1u};
+		std::vector<Level> levels;
+		std::vector<u64> offsets; // chunk offset table
+		std::vector<std::size_t> channelOffsets; // see ComputeChannelLayout
+		std::size_t pixelDataSize {};
+		std::vector<int> requestedPixelTypes;
+
+		~Part() {
+			if(headerValid) {
+				FreeEXRHeader(&header);
+			}
+		}
+	};
+
+	struct Layer {
+		std::string name;
+		std::array<u32, 4> mapping {noChannel, noChannel, noChannel, noChannel};
+		unsigned part {}; // in parts_
+	};
+
+	// Decoded chunk in the cache, interleaved in the output format.
+	struct CachedChunk {
+		u64 key; // chunk * layers_.size() + layer
+		std::shared_ptr<const std::vector<std::byte>> data;
+	};
+
+	ReadStreamMemoryMap map_;
+	std::vector<std::unique_ptr<Part>> parts_;
+
+	Format format_ {};
+	Vec2ui size_ {};
+	unsigned numComponents_ {};
+	std::vector<Layer> layers_;
+	std::array<std::byte, 4> one_ {}; // constant one in the channel type
+
+	mutable std::vector<std::byte> tmpData_;
+
+	// cache for region reads, most recently used chunk first
+	mutable std::mutex cacheMutex_;
+	mutable std::list<CachedChunk> cache_;
+	mutable std::unordered_map<u64, std::list<CachedChunk>::iterator> cacheMap_;
+	mutable u64 cacheSize_ {};
+	u64 maxCacheSize_ {64 * 1024 * 1024};
+
+public:
+	ExrReaderImpl() = default;
+
+	ReadError load(std::unique_ptr<Read>&& stream, const ExrReadOptions& opts);
+	ReadError loadHeaders(const EXRVersion& version);
+	ReadError loadPart(unsigned p, const ExrReadOptions& opts,
+		std::vector<Layer>& layers);
+	ReadError loadOffsets(Part& part, Vec2ui size);
+
+	Vec3ui size() const noexcept override { return {size_.x, size_.y, 1u}; }
+	Format format() const noexcept override { return format_; }
+	unsigned mipLevels() const noexcept override { return part(0u).levels.size(); }
+	unsigned layers() const noexcept override { return layers_.size(); }
+
+	std::string_view layerName(unsigned layer) const override {
+		dlg_assert(layer < layers_.size());
+		return layers_[layer].name;
+	}
+
+	const Part& part(unsigned layer) const {
+		return *parts_[layers_[layer].part];
+	}
+
+	span<const std::byte> read(unsigned mip, unsigned layer) const override {
+		tmpData_.resize(sizeBytes(size(), mip, format_));
+		read(tmpData_, mip, layer);
+		return tmpData_;
+	}
 
-	// TODO: could optimize this significantly.
-	// When it's a memory stream, just use the memory.
-	// When it's a file stream and we're on linux, try to map it.
-	stream->seek(0, Seek::Origin::end);
-	auto size = stream->address();
-	stream->seek(0);
+	u64 read(span<std::byte> data, unsigned mip, unsigned layer) const override {
+		dlg_assert(mip < mipLevels() && layer < layers_.size());
+		auto byteSize = sizeBytes(size(), mip, format_);
+		dlg_assert(u64(data.size()) >= byteSize);
+
+		// Chunks are compressed independently and cover disjoint
+		// regions of the output, decode them in parallel.
+		auto& lvl = part(layer).levels[mip];
+		auto fmtSize = formatElementSize(format_);
+		auto stride = std::size_t(lvl.size.x) * fmtSize;
+		auto numChunks = u64(lvl.numTiles.x) * lvl.numTiles.y;
+		parallelFor(numChunks, [&](u64 i) {
+			thread_local std::vector<std::byte> scratch;
+			auto [x0, y0] = chunkRect(lvl, i).first;
+			auto dst = data.data() + y0 * stride + std::size_t(x0) * fmtSize;
+			decodeChunk(mip, i, layer, dst, stride, scratch);
+		});
+
+		return byteSize;
+	}
+
+	u64 readRegion(span<std::byte> data, Vec3ui offset, Vec3ui size,
+		unsigned mip, unsigned layer) const override;
+
+	void setCacheSize(u64 maxBytes) override;
+
+	// Removes the least recently used chunks from the cache until it
+	// fits into maxCacheSize_. cacheMutex_ must be locked.
+	void trimCache() const;
+
+	// Returns offset and size of the given chunk in its level.
+	static std::pair<Vec2ui, Vec2ui> chunkRect(const Level& lvl, u64 index) {
+		auto x0 = unsigned(index % lvl.numTiles.x) * lvl.chunkSize.x;
+		auto y0 = unsigned(index / lvl.numTiles.x) * lvl.chunkSize.y;
+		auto w = std::min(lvl.chunkSize.x, lvl.size.x - x0);
+		auto h = std::min(lvl.chunkSize.y, lvl.size.y - y0);
+		return {{x0, y0}, {w, h}};
+	}
+
+	// Decodes the given chunk (index in its level) and writes the channels
+	// of the given layer interleaved into 'dst', which points to the
+	// first texel of the chunk, with rows 'dstStride' bytes apart.
+	// Uses 'scratch' for the decoded, planar channels. Throws on error.
+	void decodeChunk(unsigned mip, u64 index, unsigned layer,
+		std::byte* dst, std::size_t dstStride,
+		std::vector<std::byte>& scratch) const;
+};
+
+// Whether the two parts have the same levels, i.e. their layers can be
+// exposed by the same ImageProvider.
+bool sameLevels(const ExrReaderImpl::Part& a, const ExrReaderImpl::Part& b) {
+	if(a.levels.size() != b.levels.size()) {
+		return false;
+	}
+
+	for(auto i = 0u; i < a.levels.size(); ++i) {
+		if(a.levels[i].size != b.levels[i].size) {
+			return false;
+		}
+	}
 
-	std::unique_ptr<std::byte[]> buf = std::make_unique<std::byte[]>(size);
-	auto* data = reinterpret_cast<const unsigned char*>(buf.get());
-	stream->read(buf.get(), size);
+	return true;
+}
+
+ReadError ExrReaderImpl::load(std::unique_ptr<Read>&& stream,
+		const ExrReadOptions& opts) {
+	// When it's a memory stream, this will just use the memory.
+	// When it's a file stream, tries to map it.
+	map_ = ReadStreamMemoryMap(std::move(stream));
+	auto* data = reinterpret_cast<const unsigned char*>(map_.data());
+	auto size = map_.size();
 
 	EXRVersion version;
 	auto res = ParseEXRVersionFromMemory(&version, data, size);
@@ -137,30 +330,208 @@ ReadError loadExr(std::unique_ptr<Read>&& stream,
 	dlg_debug("  non_image: {}", version.non_image);
 	dlg_debug("  multipart: {}", version.multipart);
 
-	if(version.non_image) {
+	if(version.non_image && !version.multipart) {
 		dlg_warn("EXR deep images not supported");
 		return ReadError::cantRepresent;
 	}
 
-	if(version.multipart) {
-		dlg_warn("EXR multipart images not supported");
+	if(opts.channels.size() > 4u || opts.numComponents > 4u ||
+			(opts.numComponents && opts.numComponents < opts.channels.size())) {
+		dlg_warn("EXR invalid channel selection ({} channels, {} components)",
+			opts.channels.size(), opts.numComponents);
 		return ReadError::cantRepresent;
 	}
 
-	const char* err {};
-	EXRHeader header {};
-	res = ParseEXRHeaderFromMemory(&header, &version, data, size, &err);
-	if(res != TINYEXR_SUCCESS) {
-		dlg_debug("ParseEXRHeaderFrommemory: {} ({})", err ? err : "-", res);
-		FreeEXRErrorMessage(err);
-		return toReadError(res);
+	auto headerRes = loadHeaders(version);
+	if(headerRes != ReadError::none) {
+		return headerRes;
+	}
+
+	// For multipart files, parts we can't represent are skipped.
+	std::vector<Layer> layers;
+	for(auto p = 0u; p < parts_.size(); ++p) {
+		auto partRes = loadPart(p, opts, layers);
+		if(partRes != ReadError::none) {
+			if(!version.multipart) {
+				return partRes;
+			}
+
+			dlg_warn("EXR ignoring part {} ({})", p, parts_[p]->name);
+		}
+	}
+
+	if(layers.empty()) {
+		dlg_error("EXR image has no channels/layers");
+		return ReadError::empty;
+	}
+
+	// All layers must have the same format and levels.
+	auto numSelected = opts.numComponents ? opts.numComponents :
+		unsigned(opts.channels.size());
+	const Part* first {};
+	for(auto& layer : layers) {
+		auto& part = *parts_[layer.part];
+		auto outPixelType = part.halfToFloat ? TINYEXR_PIXELTYPE_FLOAT : part.pixelType;
+		auto iformat = opts.channels.empty() ?
+			parseFormat(layer.mapping, outPixelType, opts.forceRGBA) :
+			exrFormat(numSelected, outPixelType);
+		if((first && format_ != iformat) || iformat == Format::undefined) {
+			dlg_warn("EXR image layer '{}' has {} format, ignoring it",
+				layer.name, first ? "different" : "invalid");
+			continue;
+		}
+
+		if(first && !sameLevels(*first, part)) {
+			dlg_warn("EXR image layer '{}' has different size, ignoring it",
+				layer.name);
+			continue;
+		}
+
+		if(!first) {
+			first = &part;
+			format_ = iformat;
+		}
+
+		layers_.push_back(std::move(layer));
+	}
+
+	if(!first) {
+		dlg_warn("EXR image has no layer with parsable format");
+		return ReadError::empty;
+	}
+
+	size_ = first->levels[0].size;
+	dlg_debug("EXR width: {}, height {}", size_.x, size_.y);
+
+	auto outPixelType = first->halfToFloat ? TINYEXR_PIXELTYPE_FLOAT : first->pixelType;
+	auto chanSize = outPixelType == TINYEXR_PIXELTYPE_HALF ?  2u : 4u;
+	numComponents_ = formatElementSize(format_) / chanSize;
+	if(outPixelType == TINYEXR_PIXELTYPE_HALF) {
+		auto src = f16(1.f);
+		std::memcpy(one_.data(), &src, sizeof(src));
+	} else if(outPixelType == TINYEXR_PIXELTYPE_UINT) {
+		auto src = u32(1);
+		std::memcpy(one_.data(), &src, sizeof(src));
+	} else if(outPixelType == TINYEXR_PIXELTYPE_FLOAT) {
+		auto src = float(1.f);
+		std::memcpy(one_.data(), &src, sizeof(src));
+	}
+
+	dlg_debug("== EXR image loading success ==");
+	return ReadError::none;
+}
+
+ReadError ExrReaderImpl::loadHeaders(const EXRVersion& version) {
+	auto* data = reinterpret_cast<const unsigned char*>(map_.data());
+	auto size = map_.size();
+
+	if(!version.multipart) {
+		auto& part = *parts_.emplace_back(std::make_unique<Part>());
+		const char* err {};
+		auto res = ParseEXRHeaderFromMemory(&part.header, &version, data, size, &err);
+		if(res != TINYEXR_SUCCESS) {
+			dlg_debug("ParseEXRHeaderFrommemory: {} ({})", err ? err : "-", res);
+			FreeEXRErrorMessage(err);
+			FreeEXRHeader(&part.header); // might be partially filled
+			return toReadError(res);
+		}
+
+		part.headerValid = true;
+		part.tiled = part.header.tiled;
+		dlg_assert(part.header.tiled == version.tiled);
+		dlg_assert(part.header.non_image == version.non_image);
+
+		// the offset table directly follows the header.
+		// 8 bytes for magic number and version
+		part.tableBegin = u64(part.header.header_len) + 8u;
+		return ReadError::none;
 	}
 
-	auto headerGuard = ScopeGuard([&]{ FreeEXRHeader(&header); });
-	dlg_assert(header.tiled == version.tiled);
-	dlg_assert(header.multipart == version.multipart);
-	dlg_assert(header.non_image == version.non_image);
-	if(header.tiled) {
+	// Multipart files store all headers after each other, terminated
+	// by an empty header (a single null byte). The tiled version flag
+	// is never set for them, the 'type' attribute of each header tells
+	// whether the part is tiled. Parse all headers as tiled so that
+	// tinyexr reads the 'tiles' attribute.
+	auto partVersion = version;
+	partVersion.tiled = 1;
+
+	auto pos = u64(8u);
+	while(true) {
+		if(pos >= size) {
+			dlg_warn("EXR file too small for multipart headers");
+			return ReadError::unexpectedEnd;
+		}
+
+		if(data[pos] == '\0') {
+			++pos;
+			break;
+		}
+
+		auto& part = *parts_.emplace_back(std::make_unique<Part>());
+		part.index = parts_.size() - 1;
+
+		tinyexr::HeaderInfo info;
+		info.clear();
+		std::string err;
+		auto res = tinyexr::ParseEXRHeader(&info, nullptr, &partVersion, &err,
+			data + pos, size - pos);
+
+		// the header takes ownership of the attribute values, even
+		// if parsing failed
+		tinyexr::ConvertHeader(&part.header, info);
+		part.headerValid = true;
+		if(res != TINYEXR_SUCCESS) {
+			dlg_debug("ParseEXRHeader (part {}): {} ({})", part.index, err, res);
+			return toReadError(res);
+		}
+
+		pos += info.header_len;
+
+		std::string_view type;
+		auto& header = part.header;
+		for(auto i = 0u; i < unsigned(header.num_custom_attributes); ++i) {
+			auto& att = header.custom_attributes[i];
+			auto value = std::string_view(
+				reinterpret_cast<const char*>(att.value), unsigned(att.size));
+			if(std::strcmp(att.name, "name") == 0) {
+				part.name = value;
+			} else if(std::strcmp(att.name, "type") == 0) {
+				type = value;
+			}
+		}
+
+		part.deep = (type == "deepscanline" || type == "deeptile");
+		part.tiled = type.empty() ? info.tile_size_x > 0 :
+			(type == "tiledimage" || type == "deeptile");
+		header.tiled = part.tiled;
+		header.multipart = 1;
+		header.non_image = part.deep;
+
+		if(header.chunk_count <= 0) {
+			dlg_warn("EXR multipart header without chunkCount");
+			return ReadError::invalidType;
+		}
+	}
+
+	// the offset tables of all parts follow the headers
+	for(auto& part : parts_) {
+		part->tableBegin = pos;
+		pos += u64(part->header.chunk_count) * sizeof(u64);
+	}
+
+	return ReadError::none;
+}
+
+ReadError ExrReaderImpl::loadPart(unsigned p, const ExrReadOptions& opts,
+		std::vector<Layer>& layers) {
+	auto& part = *parts_[p];
+	auto& header = part.header;
+	if(part.deep) {
+		dlg_warn("EXR deep images not supported");
+		return ReadError::cantRepresent;
+	}
+
+	if(part.tiled) {
 		// ripmap basically means mipmaps in both dimensions independently.
 		// We can't represent that via ImageProvider (and it's not
 		// really needed in gpu rendering I guess).
@@ -172,7 +543,8 @@ ReadError loadExr(std::unique_ptr<Read>&& stream,
 		// an nvidia extension for up-rounding mip map sizes
 		// NOTE: we could choose to just ignore the mipmaps here
 		// instead of completely failing the load process.
-		if(header.tile_rounding_mode != TINYEXR_TILE_ROUND_DOWN) {
+		if(header.tile_level_mode != TINYEXR_TILE_ONE_LEVEL &&
+				header.tile_rounding_mode != TINYEXR_TILE_ROUND_DOWN) {
 			dlg_warn("EXR invalid mip rounding mode {}", header.tile_rounding_mode);
 			return ReadError::cantRepresent;
 		}
@@ -183,364 +555,966 @@ ReadError loadExr(std::unique_ptr<Read>&& stream,
 		dlg_debug("attribute {} (type {}, size {})", att.name, att.type, att.size);
 	}
 
-	struct Layer {
-		std::string_view name;
-		std::array<u32, 4> mapping {noChannel, noChannel, noChannel, noChannel};
-	};
-
-	std::vector<Layer> layers;
+	std::vector<Layer> partLayers;
 	std::optional<int> oPixelType;
 
-	for(auto i = 0u; i < unsigned(header.num_channels); ++i) {
-		std::string_view name = header.channels[i].name;
-		dlg_debug("channel {}: {}", i, name);
-
-		std::string_view layerName, channelName;
-		auto sepos = name.find_last_of('.');
-		if(sepos == std::string::npos) {
-			// default layer.
-			// This means we will interpret ".R" and "R" the same,
-			// an image that has both can't be parsed.
-			layerName = "";
-			channelName = name;
-		} else {
-			std::tie(layerName, channelName) = split(name, sepos);
-		}
+	if(!opts.channels.empty()) {
+		// explicitly selected channels form a single layer
+		auto& layer = partLayers.emplace_back();
+		for(auto c = 0u; c < opts.channels.size(); ++c) {
+			auto& wanted = opts.channels[c];
+			auto matches = [&](std::string_view name) {
+				if(name == wanted) {
+					return true;
+				}
 
-		unsigned id;
-		if(channelName == "R") id = 0;
-		else if(channelName == "G") id = 1;
-		else if(channelName == "B") id = 2;
-		else if(channelName == "A") id = 3;
-		else {
-			dlg_info(" Ignoring unknown channel {}", channelName);
-			continue;
-		}
+				// for multipart files, allow '<part>.<channel>'
+				return header.multipart && wanted.size() > part.name.size() &&
+					wanted.compare(0, part.name.size(), part.name) == 0 &&
+					wanted[part.name.size()] == '.' &&
+					name == std::string_view(wanted).substr(part.name.size() + 1);
+			};
 
-		auto it = std::find_if(layers.begin(), layers.end(),
-			[&](auto& layer) { return layer.name == layerName; });
-		if(it == layers.end()) {
-			layers.emplace_back().name = layerName;
-			it = layers.end() - 1;
-		}
+			auto i = 0u;
+			while(i < unsigned(header.num_channels) && !matches(header.channels[i].name)) {
+				++i;
+			}
 
-		if(it->mapping[id] != noChannel) {
-			dlg_warn("EXR layer has multiple {} channels", name);
-			return ReadError::unsupportedFormat;
-		}
+			if(i == unsigned(header.num_channels)) {
+				dlg_warn("EXR image part {} has no channel {}", p, wanted);
+				return ReadError::empty;
+			}
+
+			if(oPixelType && header.channels[i].pixel_type != *oPixelType) {
+				dlg_warn("EXR selected channels have different pixel types");
+				return ReadError::unsupportedFormat;
+			}
 
-		it->mapping[id] = i;
-		if(!oPixelType) {
 			oPixelType = header.channels[i].pixel_type;
-		} else {
-			// all known (rgba) channels must have the same pixel type,
-			// there are no formats with varying types.
-			if(header.channels[i].pixel_type != *oPixelType) {
-				dlg_warn("EXR image channels have different pixel types");
+			layer.mapping[c] = i;
+		}
+	} else {
+		for(auto i = 0u; i < unsigned(header.num_channels); ++i) {
+			std::string_view name = header.channels[i].name;
+			dlg_debug("channel {}: {}", i, name);
+
+			std::string_view layerName, channelName;
+			auto sepos = name.find_last_of('.');
+			if(sepos == std::string::npos) {
+				// default layer.
+				// This means we will interpret ".R" and "R" the same,
+				// an image that has both can't be parsed.
+				layerName = "";
+				channelName = name;
+			} else {
+				std::tie(layerName, channelName) = split(name, sepos);
+			}
+
+			unsigned id;
+			if(channelName == "R") id = 0;
+			else if(channelName == "G") id = 1;
+			else if(channelName == "B") id = 2;
+			else if(channelName == "A") id = 3;
+			else {
+				dlg_info(" Ignoring unknown channel {}", channelName);
+				continue;
+			}
+
+			auto it = std::find_if(partLayers.begin(), partLayers.end(),
+				[&](auto& layer) { return layer.name == layerName; });
+			if(it == partLayers.end()) {
+				partLayers.emplace_back().name = layerName;
+				it = partLayers.end() - 1;
+			}
+
+			if(it->mapping[id] != noChannel) {
+				dlg_warn("EXR layer has multiple {} channels", name);
 				return ReadError::unsupportedFormat;
 			}
+
+			it->mapping[id] = i;
+			if(!oPixelType) {
+				oPixelType = header.channels[i].pixel_type;
+			} else {
+				// all known (rgba) channels must have the same pixel type,
+				// there are no formats with varying types.
+				if(header.channels[i].pixel_type != *oPixelType) {
+					dlg_warn("EXR image channels have different pixel types");
+					return ReadError::unsupportedFormat;
+				}
+			}
 		}
 	}
 
-	if(layers.empty()) {
-		dlg_error("EXR image has no channels/layers");
+	if(partLayers.empty()) {
+		dlg_warn("EXR image part {} has no rgba channels", p);
 		return ReadError::empty;
 	}
 
-	auto pixelType = *oPixelType;
+	part.pixelType = *oPixelType;
+	part.halfToFloat = opts.halfToFloat && part.pixelType == TINYEXR_PIXELTYPE_HALF;
 
-	std::optional<Format> oFormat;
-	for(auto it = layers.begin(); it != layers.end();) {
-		auto iformat = parseFormat(it->mapping, pixelType, forceRGBA);
-		if((oFormat && *oFormat != iformat) || iformat == Format::undefined) {
-			dlg_warn("EXR image layer {} has {} format, ignoring it",
-				oFormat ? "different" : "invalid", it - layers.begin());
-			it = layers.erase(it);
-			continue;
-		}
+	// we decode all channels in their stored type
+	part.requestedPixelTypes.resize(header.num_channels);
+	for(auto c = 0u; c < unsigned(header.num_channels); ++c) {
+		part.requestedPixelTypes[c] = header.channels[c].pixel_type;
+	}
 
-		oFormat = iformat;
-		++it;
+	int pixelDataSize;
+	std::size_t channelOffset;
+	if(!tinyexr::ComputeChannelLayout(&part.channelOffsets, &pixelDataSize,
+			&channelOffset, header.num_channels, header.channels)) {
+		dlg_warn("EXR invalid channel layout");
+		return ReadError::unsupportedFormat;
 	}
 
-	if(!oFormat) {
-		dlg_warn("EXR image has no layer with parsable format");
+	part.pixelDataSize = pixelDataSize;
+
+	auto dw = header.data_window;
+	if(dw[2] < dw[0] || dw[3] < dw[1]) {
+		dlg_warn("EXR invalid data window");
 		return ReadError::empty;
 	}
 
-	auto format = *oFormat;
-
-	EXRImage image {};
-	res = LoadEXRImageFromMemory(&image, &header, data, size, &err);
-	if(res != TINYEXR_SUCCESS) {
-		dlg_debug("LoadEXRImageFromMemory: {} ({})", err ? err : "-", res);
-		FreeEXRErrorMessage(err);
-		return toReadError(res);
+	auto size = Vec2ui{unsigned(dw[2] - dw[0]) + 1u, unsigned(dw[3] - dw[1]) + 1u};
+	auto offRes = loadOffsets(part, size);
+	if(offRes != ReadError::none) {
+		return offRes;
 	}
 
-	auto imageGuard = ScopeGuard([&]{ FreeEXRImage(&image); });
+	// Layers of multipart files are named after their part
+	for(auto& layer : partLayers) {
+		layer.part = p;
+		if(header.multipart) {
+			layer.name = layer.name.empty() ? part.name : part.name + "." + layer.name;
+		}
 
-	unsigned width = image.width;
-	unsigned height = image.height;
-	dlg_assert(image.num_channels == header.num_channels);
-	std::vector<unsigned char**> mips;
+		layers.push_back(std::move(layer));
+	}
 
-	dlg_debug("EXR width: {}, height {}", width, height);
-	if(header.tiled) {
-		if(!image.tiles) {
-			dlg_warn("Reading EXRImage returned no data");
-			return ReadError::internal;
+	return ReadError::none;
+}
+
+ReadError ExrReaderImpl::loadOffsets(Part& part, Vec2ui size) {
+	auto& header = part.header;
+	auto numChunks = u64(0u);
+	if(part.tiled) {
+		if(header.tile_size_x <= 0 || header.tile_size_y <= 0) {
+			dlg_warn("EXR invalid tile size");
+			return ReadError::invalidType;
 		}
 
-		// TODO: we could support cubemaps, image.height == 6 * header.tile_size.y
-		// They additional have the 'envmap' tag set (to 1) to signal that
-		// this exr represents a cubemap.
-		if(header.tile_size_x != image.width || header.tile_size_y != image.height) {
-			dlg_warn("EXR actually tiled images not supported");
-			return ReadError::cantRepresent;
+		auto tileSize = Vec2ui{unsigned(header.tile_size_x), unsigned(header.tile_size_y)};
+		auto rounding = header.tile_rounding_mode;
+
+		auto numX = 1u;
+		auto numY = 1u;
+		if(header.tile_level_mode == TINYEXR_TILE_MIPMAP_LEVELS) {
+			numX = numY = numTileLevels(std::max(size.x, size.y), rounding);
+		} else if(header.tile_level_mode == TINYEXR_TILE_RIPMAP_LEVELS) {
+			numX = numTileLevels(size.x, rounding);
+			numY = numTileLevels(size.y, rounding);
 		}
 
-		auto numLevels = numMipLevels({width, height, 1u});
-		mips.reserve(numLevels);
-		for(auto i = 0u; i < u32(image.num_tiles); ++i) {
-			auto& tile = image.tiles[i];
+		// Offset table is ordered by level, then tile row, then tile column.
+		// For ripmaps, level (lx, ly) has index ly * numX + lx.
+		// We only expose the levels with lx == ly.
+		auto ripmap = header.tile_level_mode == TINYEXR_TILE_RIPMAP_LEVELS;
+		for(auto ly = 0u; ly < numY; ++ly) {
+			for(auto lx = 0u; lx < numX; ++lx) {
+				if(!ripmap && lx != ly) {
+					continue;
+				}
 
-			// dlg_debug("tile {}: lvl: {}, {} offset: {}, {} size: {}, {}", i,
-			// 	tile.level_x, tile.level_y, tile.offset_x, tile.offset_y,
-			// 	tile.width, tile.height);
-			// continue;
+				auto w = tileLevelSize(size.x, lx, rounding);
+				auto h = tileLevelSize(size.y, ly, rounding);
+				auto numTiles = Vec2ui{ceilDivide(w, tileSize.x), ceilDivide(h, tileSize.y)};
+				if(lx == ly) {
+					part.levels.push_back({{w, h}, tileSize, numTiles, numChunks});
+				}
 
-			if(tile.offset_x != 0 || tile.offset_y != 0) {
-				// NOTE: we could support it but it's probably not
-				// worth the effort, I don't see the point of storing
-				// images as actual tiles.
-				dlg_warn("EXR actually tiled images not supported. Offset {} {}",
-					tile.offset_x, tile.offset_y);
-				return ReadError::cantRepresent;
+				numChunks += u64(numTiles.x) * numTiles.y;
 			}
+		}
+	} else {
+		if(header.compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) {
+			part.linesPerChunk = 16u;
+		} else if(header.compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
+			part.linesPerChunk = 32u;
+		}
 
-			// we discard ripmap levels
-			if(tile.level_x != tile.level_y) {
-				continue;
-			}
+		numChunks = ceilDivide(size.y, part.linesPerChunk);
+		part.levels.push_back({size, {size.x, part.linesPerChunk},
+			{1u, unsigned(numChunks)}, 0u});
+	}
 
-			auto lvl = tile.level_x;
-			if(lvl >= i32(numLevels) || lvl < 0) {
-				dlg_warn("EXR invalid number of levels");
-				return ReadError::cantRepresent;
-			}
+	if(header.multipart && u64(header.chunk_count) != numChunks) {
+		dlg_warn("EXR chunkCount {} does not match the expected {}",
+			header.chunk_count, numChunks);
+		return ReadError::invalidType;
+	}
+
+	auto tableBegin = part.tableBegin;
+	if(tableBegin + numChunks * sizeof(u64) > map_.size()) {
+		dlg_warn("EXR file too small for offset table");
+		return ReadError::unexpectedEnd;
+	}
 
-			auto ewidth = i32(std::max(width >> lvl, 1u));
-			auto eheight = i32(std::max(height >> lvl, 1u));
-			dlg_assertm(tile.width == ewidth, "{} vs {}", tile.width, ewidth);
-			dlg_assertm(tile.height == eheight, "{} vs {}", tile.height, eheight);
+	part.offsets.resize(numChunks);
+	std::memcpy(part.offsets.data(), map_.data() + tableBegin, numChunks * sizeof(u64));
+	for(auto& off : part.offsets) {
+		tinyexr::swap8(&off);
 
-			mips.resize(std::max<u32>(mips.size(), lvl));
-			dlg_assertm(!mips[lvl], "EXR image has duplicate mip level {}", lvl);
-			mips[lvl] = tile.images;
+		// NOTE: we could try to reconstruct the table (incomplete files),
+		// like tinyexr does.
+		if(off == 0u || off >= map_.size()) {
+			dlg_warn("EXR invalid chunk offset {}", off);
+			return ReadError::unexpectedEnd;
 		}
+	}
 
-		// EXR specifies there must be a full mip chain.
-		// We can't trust the data if there is not
-		if(mips.size() != numLevels) {
-			dlg_warn("EXR image has invalid number of levels");
-			return ReadError::cantRepresent;
+	return ReadError::none;
+}
+
+void ExrReaderImpl::decodeChunk(unsigned mip, u64 index, unsigned layer,
+		std::byte* dst, std::size_t dstStride,
+		std::vector<std::byte>& scratch) const {
+	auto& part = this->part(layer);
+	auto& header = part.header;
+	auto& lvl = part.levels[mip];
+	auto off = part.offsets[lvl.firstChunk + index];
+
+	// chunks of multipart files are prefixed with their part number
+	auto partSize = header.multipart ? 4u : 0u;
+	auto headerSize = part.tiled ? 20u : 8u;
+	if(off + partSize + headerSize > map_.size()) {
+		throw std::runtime_error("EXR chunk out of range");
+	}
+
+	auto ptr = map_.data() + off;
+	if(header.multipart && readI32(ptr) != i32(part.index)) {
+		throw std::runtime_error("EXR chunk belongs to another part");
+	}
+
+	// The position of a chunk is given by its index in the offset table,
+	// make sure the chunk header agrees.
+	ptr += partSize;
+	auto [pos, extent] = chunkRect(lvl, index);
+	auto [width, height] = extent;
+	if(part.tiled) {
+		auto tx = readI32(ptr + 0);
+		auto ty = readI32(ptr + 4);
+		auto lx = readI32(ptr + 8);
+		auto ly = readI32(ptr + 12);
+		if(tx < 0 || ty < 0 || unsigned(tx) * lvl.chunkSize.x != pos.x ||
+				unsigned(ty) * lvl.chunkSize.y != pos.y ||
+				lx != i32(mip) || ly != i32(mip)) {
+			throw std::runtime_error("EXR invalid tile coordinates");
 		}
 	} else {
-		if(!image.images) {
-			dlg_warn("Reading EXRImage returned no data");
-			return ReadError::internal;
+		auto y = i64(readI32(ptr)) - header.data_window[1];
+		if(y != i64(pos.y)) {
+			throw std::runtime_error("EXR invalid scanline chunk");
 		}
+	}
 
-		mips.push_back(image.images);
+	auto dataSize = u64(u32(readI32(ptr + headerSize - 4)));
+	if(off + partSize + headerSize + dataSize > map_.size()) {
+		throw std::runtime_error("EXR chunk data out of range");
 	}
 
+	// Decode the channels of the layer into planes. The chunk data of
+	// all channels has to be decompressed but other channels are not
+	// converted or stored (see the imgio patch in DecodePixelData).
+	auto& mapping = layers_[layer].mapping;
+	auto chanSize = part.pixelType == TINYEXR_PIXELTYPE_HALF ? 2u : 4u;
+	auto numChannels = unsigned(header.num_channels);
+	auto numPixels = std::size_t(width) * height;
+	scratch.resize(numComponents_ * chanSize * numPixels);
+
+	std::vector<unsigned char*> planes(numChannels);
+	for(auto c = 0u; c < numComponents_; ++c) {
+		if(mapping[c] != noChannel) {
+			planes[mapping[c]] = reinterpret_cast<unsigned char*>(
+				scratch.data() + c * chanSize * numPixels);
+		}
+	}
 
-	// interlace channels
-	auto fmtSize = formatElementSize(format);
-	auto totalSize = fmtSize * tightTexelNumber(
-		{width, height, 1u}, layers.size() + 1, mips.size() + 1, 0u);
-	auto interlaced = std::make_unique<std::byte[]>(totalSize);
+	auto data = reinterpret_cast<const unsigned char*>(ptr + headerSize);
+	auto ok = tinyexr::DecodePixelData(planes.data(), part.requestedPixelTypes.data(),
+		data, dataSize, header.compression_type, 0, width, height, width,
+		0, 0, height, part.pixelDataSize, header.num_custom_attributes,
+		header.custom_attributes, numChannels, header.channels,
+		part.channelOffsets);
+	if(!ok) {
+		throw std::runtime_error("EXR failed to decode chunk");
+	}
 
-	auto chanSize = pixelType == TINYEXR_PIXELTYPE_HALF ?  2 : 4;
+	// interleave the channels of the requested layer, row by row
+	for(auto y = 0u; y < height; ++y) {
+		const std::byte* srcs[4] {};
+		for(auto c = 0u; c < numComponents_; ++c) {
+			auto id = mapping[c];
+			if(id != noChannel) {
+				auto plane = reinterpret_cast<const std::byte*>(planes[id]);
+				srcs[c] = plane + std::size_t(y) * width * chanSize;
+			}
+		}
 
-	std::byte src1[4];
-	if(pixelType == TINYEXR_PIXELTYPE_HALF) {
-		auto src = f16(1.f);
-		std::memcpy(src1, &src, sizeof(src));
-	} else if(pixelType == TINYEXR_PIXELTYPE_UINT) {
-		auto src = u32(1);
-		std::memcpy(src1, &src, sizeof(src));
-	} else if(pixelType == TINYEXR_PIXELTYPE_FLOAT) {
-		auto src = float(1.f);
-		std::memcpy(src1, &src, sizeof(src));
-	}
-
-	// NOTE: instead of just forceRGBA, we could already perform
-	// cpu format conversion here if this is desired (i.e. the required
-	// format different than what we desire). Could extent the api
-	// to allow this.
-	for(auto m = 0u; m < mips.size(); ++m) {
-		auto iwidth = std::max(width >> m, 1u);
-		auto iheight = std::max(height >> m, 1u);
-		auto srcData = mips[m];
-
-		for(auto l = 0u; l < layers.size(); ++l) {
-			auto& layer = layers[l];
-			auto dstOff = fmtSize * tightTexelNumber(
-				{width, height, 1u}, layers.size(), m, l);
-
-			for(auto y = 0u; y < iheight; ++y) {
-				for(auto x = 0u; x < iwidth; ++x) {
-					auto address = y * iwidth + x;
-					auto dst = interlaced.get() + dstOff + (address * fmtSize);
-
-					for(auto c = 0u; c < 4u; ++c) {
-						auto id = layer.mapping[c];
-						if(id == noChannel) {
-							std::memcpy(dst + c * chanSize, src1, chanSize);
-						} else {
-							auto src = srcData[id] + chanSize * address;
-							std::memcpy(dst + c * chanSize, src, chanSize);
-						}
-					}
+		auto dstRow = dst + y * dstStride;
+		if(part.halfToFloat) {
+			interleaveHalfToFloat(dstRow, numComponents_, srcs, 1.f, width);
+		} else {
+			interleave(dstRow, numComponents_, chanSize, srcs, one_.data(), width);
+		}
+	}
+}
+
+u64 ExrReaderImpl::readRegion(span<std::byte> data, Vec3ui offset,
+		Vec3ui size, unsigned mip, unsigned layer) const {
+	dlg_assert(mip < mipLevels() && layer < layers_.size());
+	auto& lvl = part(layer).levels[mip];
+	dlg_assert(offset.z == 0u && size.z == 1u);
+	dlg_assert(offset.x + size.x <= lvl.size.x && offset.y + size.y <= lvl.size.y);
+
+	auto fmtSize = formatElementSize(format_);
+	auto byteSize = u64(size.x) * size.y * fmtSize;
+	dlg_assert(u64(data.size()) >= byteSize);
+	if(size.x == 0u || size.y == 0u) {
+		return 0u;
+	}
+
+	// chunks overlapping the region
+	auto begin = Vec2ui{offset.x / lvl.chunkSize.x, offset.y / lvl.chunkSize.y};
+	auto end = Vec2ui{
+		(offset.x + size.x - 1) / lvl.chunkSize.x + 1,
+		(offset.y + size.y - 1) / lvl.chunkSize.y + 1,
+	};
+
+	struct Needed {
+		u64 index; // in level
+		std::shared_ptr<const std::vector<std::byte>> data;
+	};
+
+	std::vector<Needed> needed;
+	std::vector<std::size_t> missing; // in needed
+	{
+		std::lock_guard lock(cacheMutex_);
+		for(auto ty = begin.y; ty < end.y; ++ty) {
+			for(auto tx = begin.x; tx < end.x; ++tx) {
+				auto index = u64(ty) * lvl.numTiles.x + tx;
+				auto key = (lvl.firstChunk + index) * layers_.size() + layer;
+				auto& n = needed.emplace_back();
+				n.index = index;
+
+				auto it = cacheMap_.find(key);
+				if(it != cacheMap_.end()) {
+					cache_.splice(cache_.begin(), cache_, it->second);
+					n.data = it->second->data;
+				} else {
+					missing.push_back(needed.size() - 1);
 				}
 			}
 		}
 	}
 
-	dlg_debug("== EXR image loading success ==");
-	provider = wrapImage({width, height, 1u}, format, mips.size(), layers.size(),
-		std::move(interlaced));
-	return provider ? ReadError::none : ReadError::internal;
+	parallelFor(missing.size(), [&](u64 i) {
+		thread_local std::vector<std::byte> scratch;
+		auto& n = needed[missing[i]];
+		auto extent = chunkRect(lvl, n.index).second;
+		auto stride = std::size_t(extent.x) * fmtSize;
+		auto chunkData = std::make_shared<std::vector<std::byte>>(stride * extent.y);
+		decodeChunk(mip, n.index, layer, chunkData->data(), stride, scratch);
+		n.data = std::move(chunkData);
+	});
+
+	if(!missing.empty()) {
+		std::lock_guard lock(cacheMutex_);
+		for(auto m : missing) {
+			auto& n = needed[m];
+			auto key = (lvl.firstChunk + n.index) * layers_.size() + layer;
+			if(cacheMap_.count(key)) { // inserted by another thread meanwhile
+				continue;
+			}
+
+			cache_.push_front({key, n.data});
+			cacheMap_[key] = cache_.begin();
+			cacheSize_ += n.data->size();
+		}
+
+		trimCache();
+	}
+
+	// copy the overlapping part of every chunk
+	auto dstStride = std::size_t(size.x) * fmtSize;
+	for(auto& n : needed) {
+		auto [pos, extent] = chunkRect(lvl, n.index);
+		auto x0 = std::max(pos.x, offset.x);
+		auto y0 = std::max(pos.y, offset.y);
+		auto x1 = std::min(pos.x + extent.x, offset.x + size.x);
+		auto y1 = std::min(pos.y + extent.y, offset.y + size.y);
+		auto rowSize = std::size_t(x1 - x0) * fmtSize;
+		for(auto y = y0; y < y1; ++y) {
+			auto src = n.data->data() +
+				(std::size_t(y - pos.y) * extent.x + (x0 - pos.x)) * fmtSize;
+			auto dst = data.data() + (y - offset.y) * dstStride +
+				std::size_t(x0 - offset.x) * fmtSize;
+			std::memcpy(dst, src, rowSize);
+		}
+	}
+
+	return byteSize;
 }
 
-WriteError writeExr(StringParam path, const ImageProvider& provider) {
-	auto [width, height, depth] = provider.size();
-	if(depth > 1) {
-		dlg_warn("writeExr: discarding {} slices", depth - 1);
+void ExrReaderImpl::setCacheSize(u64 maxBytes) {
+	std::lock_guard lock(cacheMutex_);
+	maxCacheSize_ = maxBytes;
+	trimCache();
+}
+
+void ExrReaderImpl::trimCache() const {
+	while(cacheSize_ > maxCacheSize_ && !cache_.empty()) {
+		auto& last = cache_.back();
+		cacheSize_ -= last.data->size();
+		cacheMap_.erase(last.key);
+		cache_.pop_back();
 	}
+}
 
-	if(provider.mipLevels() > 1) {
-		dlg_warn("writeExr: discarding {} mips", provider.mipLevels() - 1);
+ReadError loadExr(std::unique_ptr<Read>&& stream,
+		std::unique_ptr<ImageProvider>& provider, bool forceRGBA) {
+	ExrReadOptions opts;
+	opts.forceRGBA = forceRGBA;
+	return loadExr(std::move(stream), provider, opts);
+}
+
+ReadError loadExr(std::unique_ptr<Read>&& stream,
+		std::unique_ptr<ImageProvider>& provider, const ExrReadOptions& opts) {
+	dlg_debug("== Loading EXR image ==");
+
+	auto reader = std::make_unique<ExrReaderImpl>();
+	auto res = ReadError::internal;
+	try {
+		res = reader->load(std::move(stream), opts);
+	} catch(const std::runtime_error& err) {
+		dlg_warn("loadExr: {}", err.what());
 	}
 
-	// TODO: we could add support for writing multiple layers
-	if(provider.layers() > 1) {
-		dlg_warn("writeExr: discarding {} layers", provider.layers() - 1);
+	if(res == ReadError::none) {
+		provider = std::move(reader);
+	} else if(!stream) {
+		// we only move from the stream on success
+		stream = reader->map_.release();
 	}
 
-	EXRChannelInfo channels[4] {};
+	return res;
+}
 
-	auto fmt = provider.format();
-	auto nc = 0u;
+// EXR writing
+constexpr auto exrMagic = u32(20000630);
+constexpr auto exrFlagTiled = u32(0x200);
+constexpr auto exrFlagLongNames = u32(0x400);
+constexpr auto exrFlagMultipart = u32(0x1000);
+
+void putExrBytes(std::vector<std::byte>& out, const void* data, std::size_t size) {
+	auto ptr = static_cast<const std::byte*>(data);
+	out.insert(out.end(), ptr, ptr + size);
+}
+
+// Appends the given value in little endian
+template<typename T>
+void putExr(std::vector<std::byte>& out, T val) {
+	static_assert(sizeof(T) == 1u || sizeof(T) == 4u || sizeof(T) == 8u);
+	if constexpr(sizeof(T) == 4u) {
+		u32 uval;
+		std::memcpy(&uval, &val, sizeof(uval));
+		tinyexr::swap4(&uval);
+		putExrBytes(out, &uval, sizeof(uval));
+	} else if constexpr(sizeof(T) == 8u) {
+		u64 uval;
+		std::memcpy(&uval, &val, sizeof(uval));
+		tinyexr::swap8(&uval);
+		putExrBytes(out, &uval, sizeof(uval));
+	} else {
+		putExrBytes(out, &val, 1u);
+	}
+}
+
+void putExrString(std::vector<std::byte>& out, std::string_view str) {
+	putExrBytes(out, str.data(), str.size());
+	out.push_back(std::byte(0));
+}
+
+// Starts an attribute, the value of the given size has to be
+// appended afterwards.
+void putExrAttrib(std::vector<std::byte>& out, std::string_view name,
+		std::string_view type, u32 size) {
+	putExrString(out, name);
+	putExrString(out, type);
+	putExr(out, size);
+}
+
+// Channel layout used to store a format in EXR. Channels are stored in
+// alphabetical order (i.e. A, B, G, R), component c of the format is
+// channel numChannels - c - 1 in the file.
+struct ExrChannelLayout {
+	unsigned numChannels;
 	unsigned chanSize;
-	int pixType;
+	int pixelType;
+};
+
+std::optional<ExrChannelLayout> exrChannelLayout(Format fmt) {
 	switch(fmt) {
-		case Format::r16g16b16a16Sfloat:
-			std::strcpy(channels[nc++].name, "A"); [[fallthrough]];
-		case Format::r16g16b16Sfloat:
-			std::strcpy(channels[nc++].name, "B"); [[fallthrough]];
-		case Format::r16g16Sfloat:
-			std::strcpy(channels[nc++].name, "G"); [[fallthrough]];
-		case Format::r16Sfloat:
-			chanSize = 2;
-			pixType = TINYEXR_PIXELTYPE_HALF;
-			std::strcpy(channels[nc++].name, "R");
-			break;
+		case Format::r16Sfloat: return ExrChannelLayout{1, 2, TINYEXR_PIXELTYPE_HALF};
+		case Format::r16g16Sfloat: return ExrChannelLayout{2, 2, TINYEXR_PIXELTYPE_HALF};
+		case Format::r16g16b16Sfloat: return ExrChannelLayout{3, 2, TINYEXR_PIXELTYPE_HALF};
+		case Format::r16g16b16a16Sfloat: return ExrChannelLayout{4, 2, TINYEXR_PIXELTYPE_HALF};
+		case Format::r32Sfloat: return ExrChannelLayout{1, 4, TINYEXR_PIXELTYPE_FLOAT};
+		case Format::r32g32Sfloat: return ExrChannelLayout{2, 4, TINYEXR_PIXELTYPE_FLOAT};
+		case Format::r32g32b32Sfloat: return ExrChannelLayout{3, 4, TINYEXR_PIXELTYPE_FLOAT};
+		case Format::r32g32b32a32Sfloat: return ExrChannelLayout{4, 4, TINYEXR_PIXELTYPE_FLOAT};
+		case Format::r32Uint: return ExrChannelLayout{1, 4, TINYEXR_PIXELTYPE_UINT};
+		case Format::r32g32Uint: return ExrChannelLayout{2, 4, TINYEXR_PIXELTYPE_UINT};
+		case Format::r32g32b32Uint: return ExrChannelLayout{3, 4, TINYEXR_PIXELTYPE_UINT};
+		case Format::r32g32b32a32Uint: return ExrChannelLayout{4, 4, TINYEXR_PIXELTYPE_UINT};
+		default: return std::nullopt;
+	}
+}
 
-		case Format::r32g32b32a32Sfloat:
-			std::strcpy(channels[nc++].name, "A"); [[fallthrough]];
-		case Format::r32g32b32Sfloat:
-			std::strcpy(channels[nc++].name, "B"); [[fallthrough]];
-		case Format::r32g32Sfloat:
-			std::strcpy(channels[nc++].name, "G"); [[fallthrough]];
-		case Format::r32Sfloat:
-			chanSize = 4;
-			pixType = TINYEXR_PIXELTYPE_FLOAT;
-			std::strcpy(channels[nc++].name, "R");
-			break;
+// Everything needed to encode the chunks of one level of a part.
+struct ExrEncodeInfo {
+	int compression;
+	ExrChannelLayout layout;
+	const std::vector<tinyexr::ChannelInfo>* channels; // for PIZ
+	std::optional<i32> part; // set for multipart files
+	std::optional<i32> tileLevel; // set for tiled files
+	Vec2ui levelSize;
+	Vec2ui chunkSize; // tile size or {width, linesPerChunk}
+	Vec2ui numChunks;
+	span<const std::byte> data; // whole level, tightly packed
+};
+
+// Packs the channels of the given chunk into the EXR line layout,
+// compresses it and writes the whole chunk (including its header)
+// into 'out'. Throws on error.
+void encodeExrChunk(const ExrEncodeInfo& info, u64 chunk, std::vector<std::byte>& out) {
+	auto cx = unsigned(chunk % info.numChunks.x);
+	auto cy = unsigned(chunk / info.numChunks.x);
+	auto x0 = cx * info.chunkSize.x;
+	auto y0 = cy * info.chunkSize.y;
+	auto width = std::min(info.chunkSize.x, info.levelSize.x - x0);
+	auto height = std::min(info.chunkSize.y, info.levelSize.y - y0);
+
+	// every line holds all samples of the first channel, then all
+	// samples of the second one and so on
+	auto nc = info.layout.numChannels;
+	auto chanSize = info.layout.chanSize;
+	auto texelSize = nc * chanSize;
+	auto rowSize = std::size_t(width) * texelSize;
+	auto rawSize = rowSize * height;
+
+	thread_local std::vector<std::byte> raw;
+	raw.resize(rawSize);
+	for(auto y = 0u; y < height; ++y) {
+		auto row = raw.data() + y * rowSize;
+		std::byte* dsts[4] {};
+		for(auto c = 0u; c < nc; ++c) {
+			dsts[c] = row + (nc - c - 1) * std::size_t(width) * chanSize;
+		}
+
+		auto src = info.data.data() +
+			((y0 + y) * std::size_t(info.levelSize.x) + x0) * texelSize;
+		deinterleave(dsts, nc, chanSize, src, width);
+	}
+
+#ifndef TINYEXR_LITTLE_ENDIAN
+	for(auto off = 0u; off < rawSize; off += chanSize) {
+		std::reverse(raw.data() + off, raw.data() + off + chanSize);
+	}
+#endif // TINYEXR_LITTLE_ENDIAN
+
+	out.clear();
+	if(info.part) {
+		putExr(out, *info.part);
+	}
+
+	if(info.tileLevel) {
+		putExr(out, i32(cx));
+		putExr(out, i32(cy));
+		putExr(out, *info.tileLevel);
+		putExr(out, *info.tileLevel);
+	} else {
+		putExr(out, i32(y0));
+	}
 
-		case Format::r32g32b32a32Uint:
-			std::strcpy(channels[nc++].name, "A"); [[fallthrough]];
-		case Format::r32g32b32Uint:
-			std::strcpy(channels[nc++].name, "B"); [[fallthrough]];
-		case Format::r32g32Uint:
-			std::strcpy(channels[nc++].name, "G"); [[fallthrough]];
-		case Format::r32Uint:
-			chanSize = 4;
-			pixType = TINYEXR_PIXELTYPE_UINT;
-			std::strcpy(channels[nc++].name, "R");
+	auto sizeOff = out.size();
+	putExr(out, u32(0u));
+	auto dataOff = out.size();
+
+	auto rawPtr = reinterpret_cast<const unsigned char*>(raw.data());
+	auto dataSize = u64(rawSize);
+	switch(info.compression) {
+		case TINYEXR_COMPRESSIONTYPE_NONE:
+			putExrBytes(out, raw.data(), rawSize);
+			break;
+		case TINYEXR_COMPRESSIONTYPE_RLE: {
+			out.resize(dataOff + (rawSize * 3) / 2 + 16u);
+			auto dst = reinterpret_cast<unsigned char*>(out.data() + dataOff);
+			tinyexr::tinyexr_uint64 outSize;
+			tinyexr::CompressRle(dst, outSize, rawPtr, rawSize);
+			dataSize = outSize;
+			break;
+		} case TINYEXR_COMPRESSIONTYPE_ZIPS:
+		case TINYEXR_COMPRESSIONTYPE_ZIP: {
+			out.resize(dataOff + compressBound(uLong(rawSize)));
+			auto dst = reinterpret_cast<unsigned char*>(out.data() + dataOff);
+			tinyexr::tinyexr_uint64 outSize;
+			tinyexr::CompressZip(dst, outSize, rawPtr, rawSize);
+			dataSize = outSize;
+			break;
+		} case TINYEXR_COMPRESSIONTYPE_PIZ: {
+			// same bound as OpenEXR, the huffman table may need up to
+			// 64K and incompressible data can expand
+			out.resize(dataOff + 65536u + 8192u + 2 * rawSize);
+			auto dst = reinterpret_cast<unsigned char*>(out.data() + dataOff);
+			unsigned outSize;
+			if(!tinyexr::CompressPiz(dst, &outSize, rawPtr, rawSize,
+					*info.channels, width, height)) {
+				throw std::runtime_error("PIZ compression failed");
+			}
+			dataSize = outSize;
 			break;
+		} default:
+			throw std::logic_error("Invalid EXR compression");
+	}
+
+	out.resize(dataOff + dataSize);
+	auto size32 = u32(dataSize);
+	tinyexr::swap4(&size32);
+	std::memcpy(out.data() + sizeOff, &size32, sizeof(size32));
+}
 
+// Point-samples the next smaller mip level from the given one, used when
+// the provider has less levels than required for an EXR mipmap.
+void downsampleExrLevel(span<const std::byte> src, Vec2ui srcSize,
+		std::vector<std::byte>& dst, Vec2ui dstSize, unsigned texelSize) {
+	dst.resize(std::size_t(dstSize.x) * dstSize.y * texelSize);
+	for(auto y = 0u; y < dstSize.y; ++y) {
+		auto sy = std::min(2 * y, srcSize.y - 1);
+		for(auto x = 0u; x < dstSize.x; ++x) {
+			auto sx = std::min(2 * x, srcSize.x - 1);
+			std::memcpy(dst.data() + (std::size_t(y) * dstSize.x + x) * texelSize,
+				src.data() + (std::size_t(sy) * srcSize.x + sx) * texelSize,
+				texelSize);
+		}
+	}
+}
+
+WriteError writeExrThrow(Write& write, const ImageProvider& provider,
+		const ExrWriteOptions& opts) {
+	auto [width, height, depth] = provider.size();
+	if(depth > 1) {
+		dlg_warn("writeExr: discarding {} slices", depth - 1);
+	}
+
+	auto fmt = provider.format();
+	auto layout = exrChannelLayout(fmt);
+	if(!layout) {
+		dlg_error("Can't represent format {} as exr", (int) fmt);
+		return WriteError::unsupportedFormat;
+	}
+
+	int compression;
+	unsigned linesPerChunk;
+	switch(opts.compression) {
+		case ExrCompression::none:
+			compression = TINYEXR_COMPRESSIONTYPE_NONE;
+			linesPerChunk = 1u;
+			break;
+		case ExrCompression::rle:
+			compression = TINYEXR_COMPRESSIONTYPE_RLE;
+			linesPerChunk = 1u;
+			break;
+		case ExrCompression::zips:
+			compression = TINYEXR_COMPRESSIONTYPE_ZIPS;
+			linesPerChunk = 1u;
+			break;
+		case ExrCompression::zip:
+			compression = TINYEXR_COMPRESSIONTYPE_ZIP;
+			linesPerChunk = 16u;
+			break;
+		case ExrCompression::piz:
+			compression = TINYEXR_COMPRESSIONTYPE_PIZ;
+			linesPerChunk = 32u;
+			break;
 		default:
-			dlg_error("Can't represent format {} as exr", (int) fmt);
+			dlg_error("writeExr: invalid compression {}", int(opts.compression));
 			return WriteError::unsupportedFormat;
 	}
 
-	int pixTypes[4] {pixType, pixType, pixType, pixType};
-
-	EXRHeader header {};
-	header.channels = channels;
-	header.num_channels = nc;
-	header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
-	header.pixel_types = pixTypes;
-	header.requested_pixel_types = pixTypes;
+	auto tiled = opts.tiled || provider.mipLevels() > 1;
+	auto tileSize = opts.tileSize;
+	if(tiled && (tileSize.x == 0u || tileSize.y == 0u)) {
+		dlg_error("writeExr: invalid tile size {}x{}", tileSize.x, tileSize.y);
+		return WriteError::internal;
+	}
 
-	auto pixelSize = formatElementSize(fmt);
-	auto byteSize = width * height * pixelSize;
+	// EXR mipmaps always contain the full chain. We use rounding down,
+	// matching the mip sizes of ImageProvider.
+	auto numLevels = 1u;
+	if(provider.mipLevels() > 1) {
+		numLevels = numTileLevels(std::max(width, height), TINYEXR_TILE_ROUND_DOWN);
+	}
 
-	auto data = provider.read();
-	if(data.size() != byteSize) {
-		dlg_warn("writeExr: expected {} bytes from provider, got {}",
-			byteSize, data.size());
-		return WriteError::readError;
+	auto numMips = std::min(provider.mipLevels(), numLevels);
+	if(numMips < numLevels) {
+		dlg_info("writeExr: generating {} missing mip levels", numLevels - numMips);
 	}
 
-	// de-interlace
-	auto deint = std::make_unique<std::byte[]>(byteSize);
-	unsigned char* chanptrs[4];
+	struct Level {
+		Vec2ui size;
+		Vec2ui chunkSize;
+		Vec2ui numChunks;
+		u64 firstChunk;
+	};
+
+	std::vector<Level> levels(numLevels);
+	auto chunksPerPart = u64(0u);
+	for(auto l = 0u; l < numLevels; ++l) {
+		auto& lvl = levels[l];
+		lvl.size.x = tileLevelSize(width, l, TINYEXR_TILE_ROUND_DOWN);
+		lvl.size.y = tileLevelSize(height, l, TINYEXR_TILE_ROUND_DOWN);
+		lvl.chunkSize = tiled ? tileSize : Vec2ui{lvl.size.x, linesPerChunk};
+		lvl.numChunks.x = ceilDivide(lvl.size.x, lvl.chunkSize.x);
+		lvl.numChunks.y = ceilDivide(lvl.size.y, lvl.chunkSize.y);
+		lvl.firstChunk = chunksPerPart;
+		chunksPerPart += u64(lvl.numChunks.x) * lvl.numChunks.y;
+	}
 
-	auto planeSize = width * height * chanSize;
-	for(auto c = 0u; c < nc; ++c) {
-		auto base = deint.get() + c * planeSize;
-		for(auto y = 0u; y < height; ++y) {
-			for(auto x = 0u; x < width; ++x) {
-				auto address = y * width + x;
-				auto src = data.data() + address * pixelSize + c * chanSize;
-				auto dst = base + address * chanSize;
-				std::memcpy(dst, src, chanSize);
+	// Multiple layers are written as parts of a multipart file.
+	// Use the layer names when the image comes from an EXR file.
+	auto numParts = std::max(provider.layers(), 1u);
+	auto multipart = numParts > 1u;
+	auto exrReader = dynamic_cast<const ExrReader*>(&provider);
+	std::vector<std::string> partNames;
+	auto longNames = false;
+	if(multipart) {
+		for(auto p = 0u; p < numParts; ++p) {
+			auto name = exrReader ? std::string(exrReader->layerName(p)) : std::string{};
+			if(name.empty() || name.size() > 255u) {
+				name = "layer" + std::to_string(p);
 			}
+
+			longNames |= (name.size() > 31u);
+			partNames.push_back(std::move(name));
 		}
+	}
 
-		// channel order is reversed, see the switch above
-		chanptrs[nc - c - 1] = reinterpret_cast<unsigned char*>(base);
+	// channels, in file order
+	auto nc = layout->numChannels;
+	std::vector<tinyexr::ChannelInfo> channels(nc);
+	for(auto i = 0u; i < nc; ++i) {
+		channels[i].name = std::string(1u, "RGBA"[nc - i - 1]);
+		channels[i].pixel_type = layout->pixelType;
+		channels[i].x_sampling = 1;
+		channels[i].y_sampling = 1;
+		channels[i].p_linear = 0;
 	}
 
-	EXRImage img {};
-	img.width = width;
-	img.height = height;
-	img.images = chanptrs;
-	img.num_channels = nc;
+	// header
+	std::vector<std::byte> header;
+	putExr(header, exrMagic);
+	auto version = u32(2u);
+	version |= (tiled && !multipart) ? exrFlagTiled : 0u;
+	version |= longNames ? exrFlagLongNames : 0u;
+	version |= multipart ? exrFlagMultipart : 0u;
+	putExr(header, version);
+
+	for(auto p = 0u; p < numParts; ++p) {
+		auto chlistSize = 1u;
+		for(auto& chan : channels) {
+			chlistSize += chan.name.size() + 1u + 16u;
+		}
 
-	const char* err {};
-	auto res = SaveEXRImageToFile(&img, &header, path.c_str(), &err);
-	if(res != TINYEXR_SUCCESS) {
-		dlg_debug("SaveEXRImagetofile: {} ({})", err ? err : "-", res);
-		FreeEXRErrorMessage(err);
-		switch(res) {
-			case TINYEXR_ERROR_CANT_OPEN_FILE:
-				return WriteError::cantOpen;
-			case TINYEXR_ERROR_CANT_WRITE_FILE:
-				return WriteError::cantWrite;
-			case TINYEXR_ERROR_UNSUPPORTED_FORMAT:
-				return WriteError::unsupportedFormat;
-			default:
-				return WriteError::internal;
+		putExrAttrib(header, "channels", "chlist", chlistSize);
+		for(auto& chan : channels) {
+			putExrString(header, chan.name);
+			putExr(header, i32(chan.pixel_type));
+			putExr(header, u8(chan.p_linear));
+			putExr(header, u8(0u));
+			putExr(header, u8(0u));
+			putExr(header, u8(0u));
+			putExr(header, i32(chan.x_sampling));
+			putExr(header, i32(chan.y_sampling));
+		}
+		putExr(header, u8(0u));
+
+		putExrAttrib(header, "compression", "compression", 1u);
+		putExr(header, u8(compression));
+
+		for(auto name : {"dataWindow", "displayWindow"}) {
+			putExrAttrib(header, name, "box2i", 16u);
+			putExr(header, i32(0));
+			putExr(header, i32(0));
+			putExr(header, i32(width - 1));
+			putExr(header, i32(height - 1));
+		}
+
+		putExrAttrib(header, "lineOrder", "lineOrder", 1u);
+		putExr(header, u8(0u)); // increasing y
+
+		putExrAttrib(header, "pixelAspectRatio", "float", 4u);
+		putExr(header, 1.f);
+
+		putExrAttrib(header, "screenWindowCenter", "v2f", 8u);
+		putExr(header, 0.f);
+		putExr(header, 0.f);
+
+		putExrAttrib(header, "screenWindowWidth", "float", 4u);
+		putExr(header, 1.f);
+
+		if(tiled) {
+			auto levelMode = numLevels > 1u ?
+				TINYEXR_TILE_MIPMAP_LEVELS : TINYEXR_TILE_ONE_LEVEL;
+			putExrAttrib(header, "tiles", "tiledesc", 9u);
+			putExr(header, u32(tileSize.x));
+			putExr(header, u32(tileSize.y));
+			putExr(header, u8(levelMode | (TINYEXR_TILE_ROUND_DOWN << 4)));
+		}
+
+		if(multipart) {
+			auto& name = partNames[p];
+			putExrAttrib(header, "name", "string", name.size());
+			putExrBytes(header, name.data(), name.size());
+
+			std::string_view type = tiled ? "tiledimage" : "scanlineimage";
+			putExrAttrib(header, "type", "string", type.size());
+			putExrBytes(header, type.data(), type.size());
+
+			putExrAttrib(header, "chunkCount", "int", 4u);
+			putExr(header, i32(chunksPerPart));
+		}
+
+		putExr(header, u8(0u)); // end of header
+	}
+
+	if(multipart) {
+		putExr(header, u8(0u)); // empty header, end of headers
+	}
+
+	// The offset table comes before the chunks but depends on their
+	// compressed sizes. For seekable streams, we write it afterwards,
+	// otherwise we have to keep all compressed chunks in memory.
+	auto seekable = write.seekable();
+	auto start = seekable ? write.address() : 0u;
+	auto numChunks = chunksPerPart * numParts;
+	std::vector<u64> offsets(numChunks);
+	std::vector<std::vector<std::byte>> pending;
+
+	write.write(header.data(), header.size());
+	auto pos = u64(header.size() + numChunks * sizeof(u64));
+	if(seekable) {
+		write.seek(start + pos);
+	}
+
+	auto texelSize = nc * layout->chanSize;
+	std::vector<std::byte> generated;
+	std::vector<std::byte> prevGenerated;
+	for(auto p = 0u; p < numParts; ++p) {
+		span<const std::byte> data;
+		for(auto l = 0u; l < numLevels; ++l) {
+			auto& lvl = levels[l];
+			if(l < numMips) {
+				data = provider.read(l, p);
+				auto expected = sizeBytes({width, height, 1u}, l, fmt);
+				if(data.size() != expected) {
+					dlg_warn("writeExr: expected {} bytes from provider, got {}",
+						expected, data.size());
+					return WriteError::readError;
+				}
+			} else {
+				std::swap(generated, prevGenerated);
+				downsampleExrLevel(data, levels[l - 1].size, generated,
+					lvl.size, texelSize);
+				data = generated;
+			}
+
+			ExrEncodeInfo info;
+			info.compression = compression;
+			info.layout = *layout;
+			info.channels = &channels;
+			info.part = multipart ? std::optional<i32>(p) : std::nullopt;
+			info.tileLevel = tiled ? std::optional<i32>(l) : std::nullopt;
+			info.levelSize = lvl.size;
+			info.chunkSize = lvl.chunkSize;
+			info.numChunks = lvl.numChunks;
+			info.data = data;
+
+			// chunks are compressed independently
+			auto count = u64(lvl.numChunks.x) * lvl.numChunks.y;
+			std::vector<std::vector<std::byte>> chunks(count);
+			parallelFor(count, [&](u64 i) {
+				encodeExrChunk(info, i, chunks[i]);
+			});
+
+			for(auto i = 0u; i < count; ++i) {
+				offsets[p * chunksPerPart + lvl.firstChunk + i] = pos;
+				pos += chunks[i].size();
+				if(seekable) {
+					write.write(chunks[i].data(), chunks[i].size());
+				} else {
+					pending.push_back(std::move(chunks[i]));
+				}
+			}
+		}
+	}
+
+	std::vector<std::byte> table;
+	table.reserve(numChunks * sizeof(u64));
+	for(auto off : offsets) {
+		putExr(table, off);
+	}
+
+	if(seekable) {
+		write.writeAt(start + header.size(), table);
+	} else {
+		write.write(table.data(), table.size());
+		for(auto& chunk : pending) {
+			write.write(chunk.data(), chunk.size());
 		}
 	}
 
 	return WriteError::none;
 }
 
+WriteError writeExr(Write& write, const ImageProvider& provider,
+		const ExrWriteOptions& opts) {
+	try {
+		return writeExrThrow(write, provider, opts);
+	} catch(const std::runtime_error& err) {
+		dlg_error("writeExr: {}", err.what());
+		return WriteError::cantWrite;
+	}
+}
+
+WriteError writeExr(Write& write, const ImageProvider& provider) {
+	return writeExr(write, provider, ExrWriteOptions{});
+}
+
+WriteError writeExr(StringParam path, const ImageProvider& provider,
+		const ExrWriteOptions& opts) {
+	auto file = FileHandle(path, "wb");
+	if(!file) {
+		dlg_debug("fopen: {}", std::strerror(errno));
+		return WriteError::cantOpen;
+	}
+
+	FileWrite writer(std::move(file));
+	return writeExr(writer, provider, opts);
+}
+
+WriteError writeExr(StringParam path, const ImageProvider& provider) {
+	return writeExr(path, provider, ExrWriteOptions{});
+}
+
 } // namespace
@@ -4,7 +4,9 @@
 #include <nytl/vecOps.hpp>
 #include <nytl/bytes.hpp>
 #include <dlg/dlg.hpp>
+#include <array>
 #include <cmath>
+#include <cstring>
 #include "../format_utils.h"
 
 namespace imgio {
@@ -861,6 +863,229 @@ void convert(Format dstFormat, span<std::byte>& dst,
 	write(dstFormat, dst, col);
 }
 
+// Bulk conversion kernels
+namespace {
+
+// Layout of the non-packed formats from r8Unorm to r64g64b64a64Sfloat:
+// all channels have the same size and are stored in rgba order or,
+// for the b8g8r8(a8) formats, in bgra order.
+struct ChannelLayout {
+	u32 channels {}; // zero for all other formats
+	u32 channelSize {};
+	std::array<u32, 4> components {}; // rgba component per channel
+	bool sfloat {};
+};
+
+ChannelLayout channelLayout(Format format) {
+	ChannelLayout ret;
+	auto vkFormat = VkFormat(format);
+	if(u32(format) < u32(Format::r8Unorm) ||
+			u32(format) > u32(Format::r64g64b64a64Sfloat) ||
+			FormatIsPacked(vkFormat)) {
+		return ret;
+	}
+
+	ret.channels = FormatComponentCount(vkFormat);
+	ret.channelSize = FormatElementSize(vkFormat) / ret.channels;
+	ret.sfloat = FormatIsSFLOAT(vkFormat);
+
+	// perm[i] is the channel holding component i
+	auto perm = formatSwizzle<false>(format, Vec4d{0.0, 1.0, 2.0, 3.0});
+	for(auto i = 0u; i < 4u; ++i) {
+		ret.components[u32(perm[i])] = i;
+	}
+
+	return ret;
+}
+
+enum class ConvertKernel {
+	none,
+	copy, // identical formats
+	lut8, // 8-bit channels to any channel layout, via lookup tables
+	sfloat, // float formats with different size or channel count
+};
+
+// Lookup tables only pay off when they are used for enough texels
+constexpr auto minLutTexels = 1024u;
+
+// Returns the kernel convertTexels uses for 'count' texels.
+ConvertKernel findKernel(const ChannelLayout& dst, const ChannelLayout& src,
+		u64 count) {
+	if(!dst.channels || !src.channels) {
+		return ConvertKernel::none;
+	}
+
+	if(src.channelSize == 1u) {
+		return count >= minLutTexels ? ConvertKernel::lut8 : ConvertKernel::none;
+	}
+
+	if(src.sfloat && dst.sfloat) {
+		return ConvertKernel::sfloat;
+	}
+
+	return ConvertKernel::none;
+}
+
+// Every channel of the destination only depends on a single channel of
+// the source (or none at all). So for 8-bit sources, all conversions
+// can be done with a table of 256 entries per destination channel. The
+// tables are filled using the generic path, the results are identical.
+template<typename T, u32 DstChannels>
+void convertLut8(std::byte* dst, Format dstFormat, const ChannelLayout& dl,
+		const std::byte* src, Format srcFormat, const ChannelLayout& sl,
+		u64 count) {
+	static_assert(DstChannels <= 4u);
+	dlg_assert(dl.channelSize == sizeof(T));
+
+	T lut[DstChannels][256];
+	for(auto i = 0u; i < 256u; ++i) {
+		std::byte probe[4];
+		std::byte texel[DstChannels * sizeof(T)];
+		std::memset(probe, int(i), sizeof(probe));
+
+		auto probeSpan = span<const std::byte>(probe, sl.channels);
+		auto texelSpan = span<std::byte>(texel, sizeof(texel));
+		convert(dstFormat, texelSpan, srcFormat, probeSpan);
+		for(auto c = 0u; c < DstChannels; ++c) {
+			std::memcpy(&lut[c][i], texel + c * sizeof(T), sizeof(T));
+		}
+	}
+
+	// Channels whose component is missing in the source are constant,
+	// it doesn't matter which source channel they use.
+	u32 srcChannel[DstChannels] {};
+	for(auto c = 0u; c < DstChannels; ++c) {
+		for(auto s = 0u; s < sl.channels; ++s) {
+			if(sl.components[s] == dl.components[c]) {
+				srcChannel[c] = s;
+			}
+		}
+	}
+
+	// Channels are stored directly and unrolled manually, compilers
+	// don't unroll the loop over channels and assembling the texel on
+	// the stack first defeats store forwarding for odd texel sizes.
+	const auto srcStride = sl.channels;
+	const auto store = [&](auto... c) {
+		(std::memcpy(dst + c * sizeof(T), &lut[c][u8(src[srcChannel[c]])], sizeof(T)), ...);
+	};
+
+	for(u64 i = 0u; i < count; ++i) {
+		if constexpr(DstChannels == 1u) {
+			store(0u);
+		} else if constexpr(DstChannels == 2u) {
+			store(0u, 1u);
+		} else if constexpr(DstChannels == 3u) {
+			store(0u, 1u, 2u);
+		} else {
+			store(0u, 1u, 2u, 3u);
+		}
+
+		dst += DstChannels * sizeof(T);
+		src += srcStride;
+	}
+}
+
+template<typename T>
+void convertLut8(std::byte* dst, Format dstFormat, const ChannelLayout& dl,
+		const std::byte* src, Format srcFormat, const ChannelLayout& sl,
+		u64 count) {
+	switch(dl.channels) {
+		case 1: return convertLut8<T, 1>(dst, dstFormat, dl, src, srcFormat, sl, count);
+		case 2: return convertLut8<T, 2>(dst, dstFormat, dl, src, srcFormat, sl, count);
+		case 3: return convertLut8<T, 3>(dst, dstFormat, dl, src, srcFormat, sl, count);
+		case 4: return convertLut8<T, 4>(dst, dstFormat, dl, src, srcFormat, sl, count);
+		default: dlg_error("invalid channel count {}", dl.channels); break;
+	}
+}
+
+// Float formats always use rgba order, missing components are zero.
+// Goes through double like the generic path to get the same rounding.
+template<typename D, typename S>
+void convertFloat(std::byte* dst, u32 dstChannels,
+		const std::byte* src, u32 srcChannels, u64 count) {
+	for(u64 i = 0u; i < count; ++i) {
+		for(auto c = 0u; c < dstChannels; ++c) {
+			double val = 0.0;
+			if(c < srcChannels) {
+				S s;
+				std::memcpy(&s, src + c * sizeof(S), sizeof(S));
+				val = double(s);
+			}
+
+			auto d = D(val);
+			std::memcpy(dst, &d, sizeof(D));
+			dst += sizeof(D);
+		}
+
+		src += srcChannels * sizeof(S);
+	}
+}
+
+template<typename S>
+void convertFloat(std::byte* dst, const ChannelLayout& dl,
+		const std::byte* src, const ChannelLayout& sl, u64 count) {
+	switch(dl.channelSize) {
+		case 2: return convertFloat<f16, S>(dst, dl.channels, src, sl.channels, count);
+		case 4: return convertFloat<float, S>(dst, dl.channels, src, sl.channels, count);
+		case 8: return convertFloat<double, S>(dst, dl.channels, src, sl.channels, count);
+		default: dlg_error("invalid float size {}", dl.channelSize); break;
+	}
+}
+
+} // anon namespace
+
+bool hasConvertKernel(Format dstFormat, Format srcFormat, u64 count) {
+	if(dstFormat == srcFormat) {
+		return true;
+	}
+
+	auto dl = channelLayout(dstFormat);
+	auto sl = channelLayout(srcFormat);
+	return findKernel(dl, sl, count) != ConvertKernel::none;
+}
+
+void convertTexels(Format dstFormat, span<std::byte> dst,
+		Format srcFormat, span<const std::byte> src, u64 count) {
+	dlg_assert(dst.size() >= count * formatElementSize(dstFormat));
+	dlg_assert(src.size() >= count * formatElementSize(srcFormat));
+
+	if(dstFormat == srcFormat) {
+		std::memcpy(dst.data(), src.data(), count * formatElementSize(srcFormat));
+		return;
+	}
+
+	auto dl = channelLayout(dstFormat);
+	auto sl = channelLayout(srcFormat);
+	auto kernel = findKernel(dl, sl, count);
+
+	switch(kernel) {
+		case ConvertKernel::lut8:
+			switch(dl.channelSize) {
+				case 1: return convertLut8<u8>(dst.data(), dstFormat, dl, src.data(), srcFormat, sl, count);
+				case 2: return convertLut8<u16>(dst.data(), dstFormat, dl, src.data(), srcFormat, sl, count);
+				case 4: return convertLut8<u32>(dst.data(), dstFormat, dl, src.data(), srcFormat, sl, count);
+				case 8: return convertLut8<u64>(dst.data(), dstFormat, dl, src.data(), srcFormat, sl, count);
+				default: break;
+			}
+			break;
+		case ConvertKernel::sfloat:
+			switch(sl.channelSize) {
+				case 2: return convertFloat<f16>(dst.data(), dl, src.data(), sl, count);
+				case 4: return convertFloat<float>(dst.data(), dl, src.data(), sl, count);
+				case 8: return convertFloat<double>(dst.data(), dl, src.data(), sl, count);
+				default: break;
+			}
+			break;
+		default:
+			break;
+	}
+
+	for(u64 i = 0u; i < count; ++i) {
+		convert(dstFormat, dst, srcFormat, src);
+	}
+}
+
 // Implementation directly from the OpenGL EXT_texture_shared_exponent spec
 // https://raw.githubusercontent.com/KhronosGroup/OpenGL-Registry/
 //  d62c37dde0a40148aecc9e9701ba0ae4ab83ee22/extensions/EXT/
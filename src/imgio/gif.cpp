@@ -0,0 +1,304 @@
+// We only need the gif decoder from stb here. Its internal per-frame
+// api (stbi__gif_load_next) allows to compose the frames one at a time,
+// stbi_load_gif_from_memory would decode all frames at once.
+// Buffers allocated by stb are only used (and freed) in this file,
+// so we don't need the custom allocation functions from image.cpp.
+// Must be included before the imgio headers (stream.hpp includes the
+// stb header) so that all stb functions are static in this file.
+#define STBI_ONLY_GIF
+#define STBI_NO_STDIO
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_STATIC // needed, otherwise we mess with other usages
+
+#ifdef __GNUC__
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Wunused-function"
+	#pragma GCC diagnostic ignored "-Wunused-parameter"
+#endif // __GNUC__
+#include "stb_image.h"
+#ifdef __GNUC__
+	#pragma GCC diagnostic pop
+#endif // __GNUC__
+#undef STB_IMAGE_IMPLEMENTATION
+
+#include <imgio/gif.hpp>
+#include <imgio/image.hpp>
+#include <imgio/stream.hpp>
+#include <imgio/format.hpp>
+#include <dlg/dlg.hpp>
+#include <array>
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <stdexcept>
+
+// GIF specification:
+//   https://www.w3.org/Graphics/GIF/spec-gif89a.txt
+
+namespace imgio {
+
+struct GifInfo {
+	Vec2ui size;
+	std::vector<unsigned> delays; // per frame, in milliseconds
+};
+
+// Walks over the blocks of the file without decoding the image data
+// to find the number of frames and their delays.
+ReadError scanGif(span<const std::byte> data, GifInfo& info) {
+	std::size_t off = 0u;
+	auto has = [&](std::size_t count) {
+		return off <= data.size() && data.size() - off >= count;
+	};
+	// Only advances if the bytes are there, 'off' never passes the end
+	auto skip = [&](std::size_t count) {
+		if(!has(count)) {
+			return false;
+		}
+
+		off += count;
+		return true;
+	};
+	auto u8At = [&](std::size_t i) {
+		return unsigned(data[off + i]);
+	};
+	auto u16At = [&](std::size_t i) {
+		return u8At(i) | (u8At(i + 1) << 8u);
+	};
+	auto skipSubBlocks = [&]() {
+		while(has(1)) {
+			auto len = u8At(0);
+			++off;
+			if(len == 0u) {
+				return true;
+			}
+
+			if(!skip(len)) {
+				return false;
+			}
+		}
+
+		return false;
+	};
+
+	if(!has(13)) {
+		return ReadError::invalidType;
+	}
+
+	auto sig = reinterpret_cast<const char*>(data.data());
+	if(std::memcmp(sig, "GIF87a", 6) != 0 && std::memcmp(sig, "GIF89a", 6) != 0) {
+		return ReadError::invalidType;
+	}
+
+	info.size = {u16At(6), u16At(8)};
+	auto flags = u8At(10);
+	off = 13u;
+	if(flags & 0x80u) { // global color table
+		if(!skip(3u * (2u << (flags & 7u)))) {
+			return ReadError::unexpectedEnd;
+		}
+	}
+
+	if(info.size.x == 0u || info.size.y == 0u) {
+		dlg_warn("GIF has size 0");
+		return ReadError::empty;
+	}
+
+	// Like stb, we keep the last specified delay for frames
+	// without graphic control extension.
+	auto delay = 0u;
+	while(true) {
+		if(!has(1)) {
+			// Some encoders omit the trailer, stb handles
+			// that as error though.
+			return ReadError::unexpectedEnd;
+		}
+
+		auto tag = u8At(0);
+		++off;
+		if(tag == 0x3Bu) { // trailer
+			break;
+		} else if(tag == 0x21u) { // extension
+			if(!has(2)) {
+				return ReadError::unexpectedEnd;
+			}
+
+			auto label = u8At(0);
+			auto len = u8At(1);
+			if(label == 0xF9u && len == 4u) { // graphic control extension
+				if(!has(6)) {
+					return ReadError::unexpectedEnd;
+				}
+
+				delay = 10u * u16At(3); // stored in 1/100s
+				off += 6u;
+			} else {
+				off += 1u; // has(2) above
+			}
+
+			if(!skipSubBlocks()) {
+				return ReadError::unexpectedEnd;
+			}
+		} else if(tag == 0x2Cu) { // image descriptor
+			if(!has(9)) {
+				return ReadError::unexpectedEnd;
+			}
+
+			auto x = u16At(0);
+			auto y = u16At(2);
+			auto w = u16At(4);
+			auto h = u16At(6);
+			if(x + w > info.size.x || y + h > info.size.y) {
+				dlg_warn("GIF frame {} out of bounds", info.delays.size());
+				return ReadError::invalidType;
+			}
+
+			auto lflags = u8At(8);
+			off += 9u;
+			if(lflags & 0x80u) { // local color table
+				if(!skip(3u * (2u << (lflags & 7u)))) {
+					return ReadError::unexpectedEnd;
+				}
+			} else if(!(flags & 0x80u)) {
+				dlg_warn("GIF frame {} without color table", info.delays.size());
+				return ReadError::invalidType;
+			}
+
+			// lzw minimum code size
+			if(!skip(1u) || !skipSubBlocks()) {
+				return ReadError::unexpectedEnd;
+			}
+
+			info.delays.push_back(delay);
+		} else {
+			dlg_warn("GIF invalid block {}", tag);
+			return ReadError::invalidType;
+		}
+	}
+
+	if(info.delays.empty()) {
+		dlg_warn("GIF without frames");
+		return ReadError::empty;
+	}
+
+	return ReadError::none;
+}
+
+class GifReaderImpl : public GifReader {
+public:
+	ReadStreamMemoryMap map_;
+	GifInfo info_;
+
+	// decoder state, frames are composed sequentially
+	mutable stbi__context ctx_;
+	mutable stbi__gif gif_;
+	mutable unsigned next_ {}; // index of the next frame to decode
+
+	// The last two composed frames. Frame i is stored in frames_[i % 2],
+	// the frame before the previous one is needed for disposal method 3.
+	mutable std::array<std::vector<std::byte>, 2> frames_;
+
+public:
+	GifReaderImpl() {
+		std::memset(&gif_, 0, sizeof(gif_));
+	}
+
+	~GifReaderImpl() {
+		freeDecoder();
+	}
+
+	ReadError load(std::unique_ptr<Read>&& stream) {
+		map_ = ReadStreamMemoryMap(std::move(stream));
+		auto data = map_.span();
+		if(data.size() > u64(std::numeric_limits<int>::max())) {
+			dlg_warn("GIF file too large");
+			return ReadError::cantRepresent;
+		}
+
+		auto res = scanGif(data, info_);
+		if(res != ReadError::none) {
+			return res;
+		}
+
+		restart();
+		return ReadError::none;
+	}
+
+	void freeDecoder() const {
+		STBI_FREE(gif_.out);
+		STBI_FREE(gif_.background);
+		STBI_FREE(gif_.history);
+		std::memset(&gif_, 0, sizeof(gif_));
+	}
+
+	void restart() const {
+		freeDecoder();
+		auto data = reinterpret_cast<const stbi_uc*>(map_.data());
+		stbi__start_mem(&ctx_, data, int(map_.size()));
+		next_ = 0u;
+	}
+
+	// Composes the given frame, returns its data in frames_.
+	span<const std::byte> compose(unsigned frame) const {
+		if(frame + 2u < next_) {
+			restart();
+		}
+
+		while(next_ <= frame) {
+			auto& dst = frames_[next_ % 2];
+			auto twoBack = next_ >= 2u ? reinterpret_cast<stbi_uc*>(dst.data()) : nullptr;
+
+			int comp;
+			auto res = stbi__gif_load_next(&ctx_, &gif_, &comp, 4, twoBack);
+			if(!res || res == reinterpret_cast<stbi_uc*>(&ctx_)) {
+				auto reason = res ? "unexpected end" : stbi_failure_reason();
+				auto msg = dlg::format("GIF frame {}: {}", next_, reason);
+				next_ = std::numeric_limits<unsigned>::max(); // restart next time
+				throw std::runtime_error(msg);
+			}
+
+			auto byteSize = sizeBytes(size(), 0u, format());
+			dst.resize(byteSize);
+			std::memcpy(dst.data(), res, byteSize);
+			++next_;
+		}
+
+		return frames_[frame % 2];
+	}
+
+	Vec3ui size() const noexcept override { return {info_.size.x, info_.size.y, 1u}; }
+	Format format() const noexcept override { return Format::r8g8b8a8Srgb; }
+	unsigned mipLevels() const noexcept override { return 1u; }
+	unsigned layers() const noexcept override { return info_.delays.size(); }
+
+	unsigned frameDelay(unsigned frame) const override {
+		dlg_assert(frame < info_.delays.size());
+		return info_.delays[frame];
+	}
+
+	span<const std::byte> read(unsigned mip, unsigned layer) const override {
+		dlg_assert(mip == 0u && layer < layers());
+		return compose(layer);
+	}
+
+	u64 read(span<std::byte> data, unsigned mip, unsigned layer) const override {
+		auto src = read(mip, layer);
+		dlg_assert(data.size() >= src.size());
+		std::memcpy(data.data(), src.data(), src.size());
+		return src.size();
+	}
+};
+
+ReadError loadGif(std::unique_ptr<Read>&& stream, std::unique_ptr<ImageProvider>& provider) {
+	auto reader = std::make_unique<GifReaderImpl>();
+	auto res = reader->load(std::move(stream));
+	if(res == ReadError::none) {
+		provider = std::move(reader);
+	} else {
+		// we only move from the stream on success
+		stream = reader->map_.release();
+	}
+
+	return res;
+}
+
+} // namespace imgio
@@ -0,0 +1,586 @@
+#include <imgio/hdr.hpp>
+#include <imgio/image.hpp>
+#include <imgio/stream.hpp>
+#include <imgio/format.hpp>
+#include <imgio/f16.hpp>
+#include <imgio/file.hpp>
+#include <dlg/dlg.hpp>
+#include <string_view>
+#include <string>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <cmath>
+#include "parallel.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define IMGIO_SSE2
+	#include <emmintrin.h>
+#endif
+
+// Radiance HDR (RGBE) images. Specification:
+//   https://radsite.lbl.gov/radiance/refer/filefmts.pdf
+// Every texel is stored as 8-bit mantissas with a shared 8-bit exponent,
+// value = mantissa * 2^(exponent - 136). Scanlines are either flat or
+// run-length encoded, separately per component ("new" RLE).
+
+namespace imgio {
+
+struct HdrHeader {
+	Vec2ui size;
+	std::size_t dataBegin; // offset of the first scanline
+};
+
+ReadError parseHdrHeader(span<const std::byte> data, HdrHeader& header) {
+	auto str = std::string_view(reinterpret_cast<const char*>(data.data()), data.size());
+	auto rest = str;
+	auto nextLine = [&](std::string_view& line) {
+		auto end = rest.find('\n');
+		if(end == rest.npos) {
+			return false;
+		}
+
+		line = rest.substr(0, end);
+		rest.remove_prefix(end + 1);
+		return true;
+	};
+
+	std::string_view line;
+	if(!nextLine(line) || (line != "#?RADIANCE" && line != "#?RGBE")) {
+		return ReadError::invalidType;
+	}
+
+	// variables, terminated by an empty line
+	while(true) {
+		if(!nextLine(line)) {
+			return ReadError::unexpectedEnd;
+		}
+
+		if(line.empty()) {
+			break;
+		}
+
+		// other variables (e.g. EXPOSURE) and comments are ignored
+		constexpr std::string_view formatVar = "FORMAT=";
+		if(line.substr(0, formatVar.size()) == formatVar) {
+			auto format = line.substr(formatVar.size());
+			if(format != "32-bit_rle_rgbe") {
+				dlg_warn("HDR unsupported format {}", format);
+				return ReadError::unsupportedFormat;
+			}
+		}
+	}
+
+	// resolution string. We only support the standard orientation,
+	// rows from top to bottom, texels from left to right.
+	if(!nextLine(line)) {
+		return ReadError::unexpectedEnd;
+	}
+
+	auto resolution = std::string(line);
+	unsigned width, height;
+	char end;
+	if(std::sscanf(resolution.c_str(), "-Y %u +X %u%c", &height, &width, &end) != 2) {
+		dlg_warn("HDR unsupported resolution string '{}'", resolution);
+		return ReadError::unsupportedFormat;
+	}
+
+	if(width == 0u || height == 0u) {
+		return ReadError::empty;
+	}
+
+	header.size = {width, height};
+	header.dataBegin = str.size() - rest.size();
+	return ReadError::none;
+}
+
+// Decodes the scanline at the beginning of 'src' into 'dst' (RGBE
+// quadruples for 'width' texels). Returns the number of bytes consumed,
+// zero when the data is invalid or incomplete.
+std::size_t decodeHdrScanline(span<const u8> src, u8* dst, unsigned width) {
+	auto size = src.size();
+	auto newRLE = width >= 8u && width < 0x8000u && size >= 4u &&
+		src[0] == 2u && src[1] == 2u && (src[2] & 0x80u) == 0u;
+	if(newRLE) {
+		if(((unsigned(src[2]) << 8u) | src[3]) != width) {
+			dlg_warn("HDR invalid scanline width");
+			return 0u;
+		}
+
+		auto pos = std::size_t(4u);
+		for(auto c = 0u; c < 4u; ++c) {
+			auto x = 0u;
+			while(x < width) {
+				if(pos >= size) {
+					return 0u;
+				}
+
+				auto count = unsigned(src[pos++]);
+				if(count > 128u) { // run
+					count -= 128u;
+					if(x + count > width || pos >= size) {
+						return 0u;
+					}
+
+					auto val = src[pos++];
+					for(auto i = 0u; i < count; ++i) {
+						dst[4u * (x + i) + c] = val;
+					}
+				} else { // literal
+					if(count == 0u || x + count > width || pos + count > size) {
+						return 0u;
+					}
+
+					for(auto i = 0u; i < count; ++i) {
+						dst[4u * (x + i) + c] = src[pos + i];
+					}
+
+					pos += count;
+				}
+
+				x += count;
+			}
+		}
+
+		return pos;
+	}
+
+	// flat texels, possibly with old-style runs: a texel (1, 1, 1, n)
+	// repeats the previous one n << shift times, shift grows by 8 for
+	// consecutive run texels.
+	auto pos = std::size_t(0u);
+	auto shift = 0u;
+	auto x = 0u;
+	while(x < width) {
+		if(pos + 4u > size) {
+			return 0u;
+		}
+
+		auto texel = &src[pos];
+		pos += 4u;
+		if(texel[0] == 1u && texel[1] == 1u && texel[2] == 1u) {
+			if(x == 0u || shift > 16u) {
+				return 0u;
+			}
+
+			auto count = unsigned(texel[3]) << shift;
+			if(x + count > width) {
+				return 0u;
+			}
+
+			for(auto i = 0u; i < count; ++i) {
+				std::memcpy(dst + 4u * (x + i), dst + 4u * (x - 1), 4u);
+			}
+
+			x += count;
+			shift += 8u;
+		} else {
+			std::memcpy(dst + 4u * x, texel, 4u);
+			++x;
+			shift = 0u;
+		}
+	}
+
+	return pos;
+}
+
+// Converts RGBE to e5b9g9r9 with bit operations only.
+// RGBE: m8 * 2^(e8 - 136), e5b9g9r9: m9 * 2^(e5 - 24).
+// With m9 = m8 << 1 this gives e5 = e8 - 113.
+u32 rgbeToE5b9g9r9(const u8* rgbe) {
+	if(rgbe[3] == 0u) {
+		return 0u;
+	}
+
+	auto exp = int(rgbe[3]) - 113;
+	if(exp > 31) {
+		return 0xFFFFFFFFu; // clamp to the maximum value
+	}
+
+	auto r = u32(rgbe[0]) << 1u;
+	auto g = u32(rgbe[1]) << 1u;
+	auto b = u32(rgbe[2]) << 1u;
+	if(exp < 0) {
+		// too small for the e5b9g9r9 exponent range, denormalize
+		auto shift = u32(-exp);
+		if(shift > 9u) {
+			return 0u;
+		}
+
+		r >>= shift;
+		g >>= shift;
+		b >>= shift;
+		exp = 0;
+	}
+
+	return (u32(exp) << 27u) | (b << 18u) | (g << 9u) | r;
+}
+
+ReadError decodeHdr(span<const std::byte> data, Format format, ImageData& img) {
+	HdrHeader header;
+	auto res = parseHdrHeader(data, header);
+	if(res != ReadError::none) {
+		return res;
+	}
+
+	auto [width, height] = header.size;
+	dlg_debug("HDR width: {}, height: {}", width, height);
+
+	// scale for every exponent, as ldexp(1, e - 136)
+	std::array<float, 256> scales;
+	scales[0] = 0.f;
+	for(auto e = 1u; e < 256u; ++e) {
+		scales[e] = std::ldexp(1.f, int(e) - 136);
+	}
+
+	auto fmtSize = formatElementSize(format);
+	auto byteSize = std::size_t(width) * height * fmtSize;
+	img.size = {width, height, 1u};
+	img.format = format;
+	img.data = std::make_unique<std::byte[]>(byteSize);
+
+	std::vector<u8> rgbe(4u * std::size_t(width));
+	auto src = span<const u8>(reinterpret_cast<const u8*>(data.data()), data.size());
+	src = src.subspan(header.dataBegin);
+	for(auto y = 0u; y < height; ++y) {
+		auto consumed = decodeHdrScanline(src, rgbe.data(), width);
+		if(consumed == 0u) {
+			dlg_warn("HDR invalid or incomplete scanline {}", y);
+			return ReadError::unexpectedEnd;
+		}
+
+		src = src.subspan(consumed);
+
+		auto dst = img.data.get() + std::size_t(y) * width * fmtSize;
+		for(auto x = 0u; x < width; ++x) {
+			auto texel = &rgbe[4u * x];
+			if(format == Format::e5b9g9r9UfloatPack32) {
+				auto val = rgbeToE5b9g9r9(texel);
+				std::memcpy(dst + 4u * x, &val, 4u);
+				continue;
+			}
+
+			auto scale = scales[texel[3]];
+			float rgba[4] = {
+				scale * texel[0],
+				scale * texel[1],
+				scale * texel[2],
+				1.f,
+			};
+
+			if(format == Format::r16g16b16a16Sfloat) {
+				f16 vals[4] = {rgba[0], rgba[1], rgba[2], rgba[3]};
+				std::memcpy(dst + 8u * x, vals, sizeof(vals));
+			} else {
+				std::memcpy(dst + 16u * x, rgba, sizeof(rgba));
+			}
+		}
+	}
+
+	return ReadError::none;
+}
+
+ReadError loadHdr(std::unique_ptr<Read>&& stream,
+		std::unique_ptr<ImageProvider>& provider) {
+	return loadHdr(std::move(stream), provider, {});
+}
+
+ReadError loadHdr(std::unique_ptr<Read>&& stream,
+		std::unique_ptr<ImageProvider>& provider, const HdrReadOptions& opts) {
+	if(opts.format != Format::e5b9g9r9UfloatPack32 &&
+			opts.format != Format::r16g16b16a16Sfloat &&
+			opts.format != Format::r32g32b32a32Sfloat) {
+		dlg_warn("HDR unsupported output format {}", u32(opts.format));
+		return ReadError::cantRepresent;
+	}
+
+	// When it's a memory stream, this will just use the memory.
+	// When it's a file stream, tries to map it.
+	auto map = ReadStreamMemoryMap(std::move(stream));
+
+	ImageData img;
+	auto res = decodeHdr(map.span(), opts.format, img);
+	if(res == ReadError::none) {
+		provider = wrap(std::move(img));
+	} else {
+		// we only move from the stream on success
+		stream = map.release();
+	}
+
+	return res;
+}
+
+// Radiance HDR writing
+// Values are clamped so that the exponent stays in range, smaller
+// values are written as zero (like Ward's float2rgbe).
+constexpr auto rgbeMaxValue = 1.7e38f;
+constexpr auto rgbeMinValue = 1e-32f;
+
+// Converts the rgb part of the given rgba texels to RGBE. The largest
+// component determines the shared exponent, mantissas are truncated.
+// Uses bit operations instead of frexp so that the vectorized and scalar
+// version produce the same results.
+void floatToRgbeScalar(u8* dst, const float* src, u64 begin, u64 count) {
+	auto clamp = [](float x) {
+		// also maps NaN to zero
+		return x > 0.f ? (x < rgbeMaxValue ? x : rgbeMaxValue) : 0.f;
+	};
+
+	for(auto i = begin; i < count; ++i) {
+		auto r = clamp(src[4 * i + 0]);
+		auto g = clamp(src[4 * i + 1]);
+		auto b = clamp(src[4 * i + 2]);
+		auto max = std::max(r, std::max(g, b));
+		auto out = dst + 4 * i;
+		if(max < rgbeMinValue) {
+			std::memset(out, 0x0, 4u);
+			continue;
+		}
+
+		// max = m * 2^exp with m in [0.5, 1), scale = 2^(8 - exp)
+		u32 bits;
+		std::memcpy(&bits, &max, sizeof(bits));
+		auto expField = bits >> 23u;
+		auto scaleBits = (261u - expField) << 23u;
+		float scale;
+		std::memcpy(&scale, &scaleBits, sizeof(scale));
+
+		out[0] = u8(r * scale);
+		out[1] = u8(g * scale);
+		out[2] = u8(b * scale);
+		out[3] = u8(expField + 2u); // exp + 128
+	}
+}
+
+void floatToRgbe(u8* dst, const float* src, u64 count) {
+	auto i = u64(0u);
+#ifdef IMGIO_SSE2
+	auto zero = _mm_setzero_ps();
+	auto maxValue = _mm_set1_ps(rgbeMaxValue);
+	auto minValue = _mm_set1_ps(rgbeMinValue);
+	auto scaleBase = _mm_set1_epi32(261);
+	auto expOffset = _mm_set1_epi32(2);
+	for(; i + 4 <= count; i += 4) {
+		auto t0 = _mm_loadu_ps(src + 4 * i + 0);
+		auto t1 = _mm_loadu_ps(src + 4 * i + 4);
+		auto t2 = _mm_loadu_ps(src + 4 * i + 8);
+		auto t3 = _mm_loadu_ps(src + 4 * i + 12);
+		_MM_TRANSPOSE4_PS(t0, t1, t2, t3);
+
+		// max(x, 0) returns 0 for NaN
+		auto r = _mm_min_ps(_mm_max_ps(t0, zero), maxValue);
+		auto g = _mm_min_ps(_mm_max_ps(t1, zero), maxValue);
+		auto b = _mm_min_ps(_mm_max_ps(t2, zero), maxValue);
+		auto max = _mm_max_ps(r, _mm_max_ps(g, b));
+
+		auto expField = _mm_srli_epi32(_mm_castps_si128(max), 23);
+		auto scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(scaleBase, expField), 23));
+		auto ri = _mm_cvttps_epi32(_mm_mul_ps(r, scale));
+		auto gi = _mm_cvttps_epi32(_mm_mul_ps(g, scale));
+		auto bi = _mm_cvttps_epi32(_mm_mul_ps(b, scale));
+		auto ei = _mm_add_epi32(expField, expOffset);
+
+		auto packed = _mm_or_si128(
+			_mm_or_si128(ri, _mm_slli_epi32(gi, 8)),
+			_mm_or_si128(_mm_slli_epi32(bi, 16), _mm_slli_epi32(ei, 24)));
+		auto small = _mm_castps_si128(_mm_cmplt_ps(max, minValue));
+		packed = _mm_andnot_si128(small, packed);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4 * i), packed);
+	}
+#endif // IMGIO_SSE2
+
+	floatToRgbeScalar(dst, src, i, count);
+}
+
+// Converts a row of 'width' texels in the given format to rgba floats.
+void hdrRowToFloat(float* dst, const std::byte* src, Format format, unsigned width) {
+	switch(format) {
+		case Format::r32g32b32a32Sfloat:
+			std::memcpy(dst, src, 16u * std::size_t(width));
+			break;
+		case Format::r32g32b32Sfloat:
+			for(auto x = 0u; x < width; ++x) {
+				std::memcpy(dst + 4u * x, src + 12u * x, 12u);
+				dst[4u * x + 3] = 1.f;
+			}
+			break;
+		case Format::r16g16b16a16Sfloat:
+		case Format::r16g16b16Sfloat: {
+			auto nc = format == Format::r16g16b16a16Sfloat ? 4u : 3u;
+			for(auto x = 0u; x < width; ++x) {
+				f16 vals[4] {};
+				std::memcpy(vals, src + 2u * nc * x, 2u * nc);
+				for(auto c = 0u; c < 3u; ++c) {
+					dst[4u * x + c] = vals[c];
+				}
+				dst[4u * x + 3] = 1.f;
+			}
+			break;
+		} case Format::e5b9g9r9UfloatPack32:
+			// m9 * 2^(e5 - 24), the scale is built from its bits
+			for(auto x = 0u; x < width; ++x) {
+				u32 val;
+				std::memcpy(&val, src + 4u * x, 4u);
+				auto scaleBits = ((val >> 27u) + 103u) << 23u;
+				float scale;
+				std::memcpy(&scale, &scaleBits, sizeof(scale));
+				dst[4u * x + 0] = scale * float(val & 0x1FFu);
+				dst[4u * x + 1] = scale * float((val >> 9u) & 0x1FFu);
+				dst[4u * x + 2] = scale * float((val >> 18u) & 0x1FFu);
+				dst[4u * x + 3] = 1.f;
+			}
+			break;
+		default:
+			dlg_error("unreachable");
+			break;
+	}
+}
+
+// Appends the given scanline of 'width' RGBE texels to 'out'.
+// Uses the new run-length encoding (every component separately) when
+// the width allows it, following Ward's RGBE_WritePixels_RLE.
+void encodeHdrScanline(const u8* rgbe, unsigned width, std::vector<std::byte>& out) {
+	auto put = [&](unsigned val) { out.push_back(std::byte(val)); };
+	if(width < 8u || width >= 0x8000u) {
+		auto ptr = reinterpret_cast<const std::byte*>(rgbe);
+		out.insert(out.end(), ptr, ptr + 4u * std::size_t(width));
+		return;
+	}
+
+	put(2u);
+	put(2u);
+	put(width >> 8u);
+	put(width & 0xFFu);
+
+	// runs shorter than this are written as literals
+	constexpr auto minRun = 4u;
+	for(auto c = 0u; c < 4u; ++c) {
+		auto at = [&](unsigned x) { return rgbe[4u * x + c]; };
+		auto cur = 0u;
+		while(cur < width) {
+			// find the next run of at least minRun
+			auto runBegin = cur;
+			auto runCount = 0u;
+			auto oldRunCount = 0u;
+			while(runCount < minRun && runBegin < width) {
+				runBegin += runCount;
+				oldRunCount = runCount;
+				runCount = 1u;
+				while(runBegin + runCount < width && runCount < 127u &&
+						at(runBegin) == at(runBegin + runCount)) {
+					++runCount;
+				}
+			}
+
+			// a short run directly before the long one
+			if(oldRunCount > 1u && oldRunCount == runBegin - cur) {
+				put(128u + oldRunCount);
+				put(at(cur));
+				cur = runBegin;
+			}
+
+			// literals up to the run
+			while(cur < runBegin) {
+				auto count = std::min(128u, runBegin - cur);
+				put(count);
+				for(auto i = 0u; i < count; ++i) {
+					put(at(cur + i));
+				}
+				cur += count;
+			}
+
+			if(runCount >= minRun) {
+				put(128u + runCount);
+				put(at(runBegin));
+				cur += runCount;
+			}
+		}
+	}
+}
+
+WriteError writeHdrThrow(Write& write, const ImageProvider& provider) {
+	auto [width, height, depth] = provider.size();
+	if(depth > 1) {
+		dlg_warn("writeHdr: discarding {} slices", depth - 1);
+	}
+
+	if(provider.layers() > 1) {
+		dlg_warn("writeHdr: discarding {} layers", provider.layers() - 1);
+	}
+
+	if(provider.mipLevels() > 1) {
+		dlg_warn("writeHdr: discarding {} mip levels", provider.mipLevels() - 1);
+	}
+
+	auto fmt = provider.format();
+	if(fmt != Format::r32g32b32a32Sfloat && fmt != Format::r32g32b32Sfloat &&
+			fmt != Format::r16g16b16a16Sfloat && fmt != Format::r16g16b16Sfloat &&
+			fmt != Format::e5b9g9r9UfloatPack32) {
+		dlg_error("Can't represent format {} as hdr", (int) fmt);
+		return WriteError::unsupportedFormat;
+	}
+
+	auto fmtSize = formatElementSize(fmt);
+	auto rowSize = std::size_t(width) * fmtSize;
+	auto data = provider.read(0u, 0u);
+	if(u64(data.size()) < u64(rowSize) * height) {
+		dlg_error("writeHdr: image provider returned too few bytes");
+		return WriteError::readError;
+	}
+
+	auto header = std::string("#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n");
+	header += "-Y " + std::to_string(height) + " +X " + std::to_string(width) + "\n";
+	write.write(reinterpret_cast<const std::byte*>(header.data()), header.size());
+
+	// Rows are encoded in parallel into their own buffers and then
+	// written in order. Batches limit the memory needed for them.
+	constexpr auto batchSize = 256u;
+	std::vector<std::vector<std::byte>> rows(std::min(batchSize, height));
+	for(auto y0 = 0u; y0 < height; y0 += batchSize) {
+		auto count = std::min(batchSize, height - y0);
+		parallelFor(count, [&](u64 i) {
+			thread_local std::vector<float> rgba;
+			thread_local std::vector<u8> rgbe;
+			rgba.resize(4u * std::size_t(width));
+			rgbe.resize(4u * std::size_t(width));
+
+			auto src = data.data() + (y0 + i) * rowSize;
+			hdrRowToFloat(rgba.data(), src, fmt, width);
+			floatToRgbe(rgbe.data(), rgba.data(), width);
+
+			rows[i].clear();
+			encodeHdrScanline(rgbe.data(), width, rows[i]);
+		});
+
+		for(auto i = 0u; i < count; ++i) {
+			write.write(rows[i].data(), rows[i].size());
+		}
+	}
+
+	return WriteError::none;
+}
+
+WriteError writeHdr(Write& write, const ImageProvider& provider) {
+	try {
+		return writeHdrThrow(write, provider);
+	} catch(const std::runtime_error& err) {
+		dlg_error("writeHdr: {}", err.what());
+		return WriteError::cantWrite;
+	}
+}
+
+WriteError writeHdr(StringParam path, const ImageProvider& provider) {
+	auto file = FileHandle(path, "wb");
+	if(!file) {
+		dlg_debug("fopen: {}", std::strerror(errno));
+		return WriteError::cantOpen;
+	}
+
+	FileWrite writer(std::move(file));
+	return writeHdr(writer, provider);
+}
+
+} // namespace imgio
@@ -2,18 +2,36 @@
 #include <imgio/stream.hpp>
 #include <imgio/file.hpp>
 #include <imgio/file.hpp>
+#include <imgio/allocation.hpp>
 #include <nytl/scope.hpp>
 #include <nytl/vecOps.hpp>
 #include <dlg/dlg.hpp>
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 
 // Make stbi std::unique_ptr<std::byte[]> compatible.
 // Needed since calling delete on a pointer allocated with malloc
 // is undefined behavior.
 namespace {
-void* stbiRealloc(void* old, std::size_t newSize) {
-	delete[] (std::byte*) old;
-	return (void*) (new std::byte[newSize]);
+void* stbiRealloc(void* old, std::size_t oldSize, std::size_t newSize) {
+	// like realloc, the contents must be preserved. stbi grows
+	// buffers this way, e.g. for the concatenated png IDAT chunks
+	auto ret = new std::byte[newSize];
+	if(old) {
+		std::memcpy(ret, old, std::min(oldSize, newSize));
+		delete[] (std::byte*) old;
+	}
+
+	return (void*) ret;
+}
+
+// Only used by stbi_load_gif_from_memory, which we don't use (see
+// gif.cpp). The contents can't be preserved without the old size,
+// so fail like on allocation failure.
+void* stbiReallocUnsized(void*, std::size_t) {
+	dlg_error("unexpected unsized stbi realloc");
+	return nullptr;
 }
 } // anon namespace
 
@@ -25,7 +43,8 @@ void* stbiRealloc(void* old, std::size_t newSize) {
 // that should make this well-defined behavior.
 #define STBI_FREE(p) (delete[] (std::byte*) p)
 #define STBI_MALLOC(size) ((void*) new std::byte[size])
-#define STBI_REALLOC(p, size) (stbiRealloc((void*) p, size))
+#define STBI_REALLOC(p, size) (stbiReallocUnsized((void*) p, size))
+#define STBI_REALLOC_SIZED(p, oldSize, newSize) (stbiRealloc((void*) p, oldSize, newSize))
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_STATIC // needed, otherwise we mess with other usages
 
@@ -41,6 +60,47 @@ void* stbiRealloc(void* old, std::size_t newSize) {
 
 namespace imgio {
 
+u64 ImageProvider::readRegion(span<std::byte> data, Vec3ui offset,
+		Vec3ui size, unsigned mip, unsigned layer) const {
+	auto fmt = format();
+	auto full = this->size();
+	auto mipSize = Vec3ui{
+		std::max(full.x >> mip, 1u),
+		std::max(full.y >> mip, 1u),
+		std::max(full.z >> mip, 1u),
+	};
+
+	dlg_assert(offset.x + size.x <= mipSize.x);
+	dlg_assert(offset.y + size.y <= mipSize.y);
+	dlg_assert(offset.z + size.z <= mipSize.z);
+
+	// work in blocks, for block-compressed formats
+	auto [bx, by, bz] = blockSize(fmt);
+	dlg_assert(offset.x % bx == 0 && offset.y % by == 0 && offset.z % bz == 0);
+	auto elemSize = formatElementSize(fmt);
+	auto srcRowSize = u64(ceilDivide(mipSize.x, bx)) * elemSize;
+	auto srcSliceSize = srcRowSize * ceilDivide(mipSize.y, by);
+	auto numRows = ceilDivide(size.y, by);
+	auto numSlices = ceilDivide(size.z, bz);
+	auto rowSize = u64(ceilDivide(size.x, bx)) * elemSize;
+	auto byteSize = rowSize * numRows * numSlices;
+	dlg_assert(u64(data.size()) >= byteSize);
+
+	auto src = read(mip, layer);
+	auto dst = data.data();
+	for(auto z = 0u; z < numSlices; ++z) {
+		for(auto y = 0u; y < numRows; ++y) {
+			auto srcOff = (offset.z / bz + z) * srcSliceSize +
+				(offset.y / by + y) * srcRowSize + (offset.x / bx) * elemSize;
+			dlg_assert(srcOff + rowSize <= u64(src.size()));
+			std::memcpy(dst, src.data() + srcOff, rowSize);
+			dst += rowSize;
+		}
+	}
+
+	return byteSize;
+}
+
 // S1, S2 are expected to be string-like types.
 template<typename C, typename CT>
 inline bool hasSuffix(std::basic_string_view<C, CT> str,
@@ -81,8 +141,8 @@ inline bool hasSuffixCI(std::string_view cstr, std::string_view csuffix) {
 
 // ImageProvider api
 ReadError loadStb(std::unique_ptr<Read>&& stream,
-		std::unique_ptr<ImageProvider>& provider) {
-	auto img = readImageDataStb(std::move(stream));
+		std::unique_ptr<ImageProvider>& provider, const StbReadOptions& opts) {
+	auto img = readImageDataStb(std::move(stream), opts);
 	if(!img.data) {
 		return ReadError::internal;
 	}
@@ -91,28 +151,82 @@ ReadError loadStb(std::unique_ptr<Read>&& stream,
 	return ReadError::none;
 }
 
+ReadError loadStb(std::unique_ptr<Read>&& stream,
+		std::unique_ptr<ImageProvider>& provider) {
+	return loadStb(std::move(stream), provider, {});
+}
+
 std::unique_ptr<ImageProvider> loadImage(std::unique_ptr<Read>&& stream,
 		std::string_view ext) {
 	using ImageLoader = ReadError(*)(std::unique_ptr<Read>&& stream,
 		std::unique_ptr<ImageProvider>&);
 
+	// 'magic' are the fixed bytes at 'magicOffset' every file of the
+	// format starts with. Loaders with magic can't load other data.
 	struct {
 		std::array<std::string_view, 5> exts {};
 		ImageLoader loader;
+		std::string_view magic {};
+		unsigned magicOffset {};
 		bool tried {false};
 	} loaders[] = {
-		{{".png"}, &loadPng},
-		// {{".jpg", ".jpeg"}, &loadJpeg},
-		{{".ktx"}, &loadKtx},
-		{{".ktx2"}, &loadKtx2},
+		{{".png"}, &loadPng, "\x89PNG\r\n\x1A\n"},
+#ifdef IMGIO_WITH_JPEG
+		{{".jpg", ".jpeg", ".jfif"}, &loadJpeg, "\xFF\xD8\xFF"},
+#endif // IMGIO_WITH_JPEG
+#ifdef IMGIO_WITH_WEBP
+		{{".webp"}, &loadWebp, "WEBP", 8u}, // after "RIFF" and the size
+#endif // IMGIO_WITH_WEBP
+		{{".ktx"}, &loadKtx, "\xABKTX 11\xBB\r\n\x1A\n"},
+		{{".ktx2"}, &loadKtx2, "\xABKTX 20\xBB\r\n\x1A\n"},
+		{{".dds"}, &loadDds, "DDS "},
 		{{".exr"}, [](auto&& stream, auto& provider) {
 			return loadExr(std::move(stream), provider);
-		}},
-		{{".hdr", ".tga", ".bmp", ".psd", ".gif"}, &loadStb},
+		}, "v/1\x01"},
+		{{".hdr"}, &loadHdr, "#?"},
+		{{".qoi"}, &loadQoi, "qoif"},
+		{{".gif"}, &loadGif, "GIF8"},
+		{{".tga", ".bmp", ".psd"}, &loadStb},
+	};
+
+	// Read the first bytes once and try the loader with matching magic
+	// first. Other loaders with magic are skipped, so they don't have to
+	// probe the stream (some of them map or copy it for that).
+	std::array<std::byte, 16> header {};
+	auto headerSize = 0u;
+	auto sniffed = stream->seekable();
+	if(sniffed) {
+		auto res = stream->readPartial(header.data(), header.size());
+		headerSize = res > 0 ? unsigned(res) : 0u;
+		stream->seek(0, Seek::Origin::set);
+	}
+
+	auto matchesMagic = [&](const auto& loader) {
+		auto& magic = loader.magic;
+		return loader.magicOffset + magic.size() <= headerSize &&
+			std::memcmp(header.data() + loader.magicOffset, magic.data(),
+				magic.size()) == 0;
 	};
 
-	// Try the one with matching extension
 	std::unique_ptr<ImageProvider> reader;
+	if(sniffed) {
+		for(auto& loader : loaders) {
+			if(loader.magic.empty() || !matchesMagic(loader)) {
+				continue;
+			}
+
+			loader.tried = true;
+			auto res = loader.loader(std::move(stream), reader);
+			if(res == ReadError::none) {
+				dlg_assert(reader);
+				return reader;
+			}
+
+			break;
+		}
+	}
+
+	// Try the one with matching extension
 	if(!ext.empty()) {
 		for(auto& loader : loaders) {
 			bool found = false;
@@ -127,6 +241,14 @@ std::unique_ptr<ImageProvider> loadImage(std::unique_ptr<Read>&& stream,
 			}
 
 			if(found) {
+				if(loader.tried || (sniffed && !loader.magic.empty())) {
+					break;
+				}
+
+				if(sniffed) {
+					stream->seek(0, Seek::Origin::set);
+				}
+
 				loader.tried = true;
 				auto res = loader.loader(std::move(stream), reader);
 				if(res == ReadError::none) {
@@ -146,6 +268,10 @@ std::unique_ptr<ImageProvider> loadImage(std::unique_ptr<Read>&& stream,
 			continue;
 		}
 
+		if(sniffed && !loader.magic.empty()) {
+			continue; // can't match, see above
+		}
+
 		stream->seek(0, Seek::Origin::set); // reset stream
 		auto res = loader.loader(std::move(stream), reader);
 		if(res == ReadError::none) {
@@ -176,8 +302,9 @@ std::unique_ptr<ImageProvider> loadImage(span<const std::byte> data) {
 }
 
 // Image api
-ImageData readImageDataStb(std::unique_ptr<Read>&& stream) {
-	constexpr auto channels = 4u; // TODO: make configurable
+ImageData readImageDataStb(std::unique_ptr<Read>&& stream,
+		const StbReadOptions& opts) {
+	dlg_assert(opts.channels <= 4u);
 	int width, height, ch;
 	std::byte* data;
 	ImageData ret;
@@ -185,15 +312,24 @@ ImageData readImageDataStb(std::unique_ptr<Read>&& stream) {
 	auto& cb = streamStbiCallbacks();
 	bool hdr = stbi_is_hdr_from_callbacks(&cb, stream.get());
 	stream->seek(0u, Seek::Origin::set);
+	bool is16 = !hdr && stbi_is_16_bit_from_callbacks(&cb, stream.get());
+	stream->seek(0u, Seek::Origin::set);
 
+	// with zero requested channels, stbi returns the channels of the file
+	auto channels = int(opts.channels);
+	unsigned channelSize;
 	if(hdr) {
 		auto fd = stbi_loadf_from_callbacks(&cb, stream.get(), &width, &height, &ch, channels);
 		data = reinterpret_cast<std::byte*>(fd);
-		ret.format = Format::r32g32b32a32Sfloat;
+		channelSize = 4u;
+	} else if(is16) {
+		auto sd = stbi_load_16_from_callbacks(&cb, stream.get(), &width, &height, &ch, channels);
+		data = reinterpret_cast<std::byte*>(sd);
+		channelSize = 2u;
 	} else {
 		auto cd = stbi_load_from_callbacks(&cb, stream.get(), &width, &height, &ch, channels);
 		data = reinterpret_cast<std::byte*>(cd);
-		ret.format = Format::r8g8b8a8Unorm;
+		channelSize = 1u;
 	}
 
 	if(!data) {
@@ -203,6 +339,15 @@ ImageData readImageDataStb(std::unique_ptr<Read>&& stream) {
 		return ret;
 	}
 
+	static constexpr Format formats[3][4] = {
+		{Format::r8Unorm, Format::r8g8Unorm, Format::r8g8b8Unorm, Format::r8g8b8a8Unorm},
+		{Format::r16Unorm, Format::r16g16Unorm, Format::r16g16b16Unorm, Format::r16g16b16a16Unorm},
+		{Format::r32Sfloat, Format::r32g32Sfloat, Format::r32g32b32Sfloat, Format::r32g32b32a32Sfloat},
+	};
+
+	auto numChannels = channels ? channels : ch;
+	dlg_assert(numChannels >= 1 && numChannels <= 4);
+	ret.format = formats[channelSize / 2u][numChannels - 1];
 	ret.data.reset(data);
 	ret.size.x = width;
 	ret.size.y = height;
@@ -278,6 +423,8 @@ public:
 		std::memcpy(data.data(), data_[id].ref, byteSize);
 		return byteSize;
 	}
+
+	bool concurrentRead() const noexcept override { return true; }
 };
 
 std::unique_ptr<ImageProvider> wrap(ImageData&& image) {
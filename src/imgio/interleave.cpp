@@ -0,0 +1,471 @@
+#include "interleave.hpp"
+#include <imgio/f16.hpp>
+#include <dlg/dlg.hpp>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define IMGIO_SSE2
+	#include <emmintrin.h>
+	#ifdef __F16C__
+		#include <immintrin.h>
+	#endif
+#endif
+
+namespace imgio {
+namespace {
+
+// Generic fallback, also used for the remainder of the vectorized kernels.
+// Starts at texel 'begin'.
+template<typename T, unsigned N>
+void interleaveScalar(std::byte* dst, const std::byte* const* srcs,
+		const std::byte* fill, u64 begin, u64 count) {
+	for(auto c = 0u; c < N; ++c) {
+		T val;
+		std::memcpy(&val, fill, sizeof(T));
+		auto src = srcs[c];
+		auto out = dst + (begin * N + c) * sizeof(T);
+		for(auto i = begin; i < count; ++i) {
+			if(src) {
+				std::memcpy(&val, src + i * sizeof(T), sizeof(T));
+			}
+
+			std::memcpy(out, &val, sizeof(T));
+			out += N * sizeof(T);
+		}
+	}
+}
+
+template<typename T, unsigned N>
+void deinterleaveScalar(std::byte* const* dsts, const std::byte* src,
+		u64 begin, u64 count) {
+	for(auto c = 0u; c < N; ++c) {
+		auto dst = dsts[c];
+		if(!dst) {
+			continue;
+		}
+
+		auto in = src + (begin * N + c) * sizeof(T);
+		for(auto i = begin; i < count; ++i) {
+			std::memcpy(dst + i * sizeof(T), in, sizeof(T));
+			in += N * sizeof(T);
+		}
+	}
+}
+
+void halfToFloatScalar(float* dst, unsigned numChannels,
+		const std::byte* const* srcs, float fill, u64 begin, u64 count) {
+	for(auto c = 0u; c < numChannels; ++c) {
+		auto src = srcs[c];
+		auto out = dst + begin * numChannels + c;
+		for(auto i = begin; i < count; ++i) {
+			if(src) {
+				f16 val;
+				std::memcpy(&val, src + i * 2u, 2u);
+				*out = float(val);
+			} else {
+				*out = fill;
+			}
+
+			out += numChannels;
+		}
+	}
+}
+
+#ifdef IMGIO_SSE2
+
+inline __m128i load(const std::byte* src) {
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+}
+
+inline __m128i load64(const std::byte* src) {
+	return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src));
+}
+
+inline void store(std::byte* dst, __m128i val) {
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(dst), val);
+}
+
+inline void store(std::byte* dst, __m128 val) {
+	_mm_storeu_ps(reinterpret_cast<float*>(dst), val);
+}
+
+// Loads 16 bytes from the channel at the given byte offset or returns the
+// fill vector if there is no channel.
+inline __m128i loadChannel(const std::byte* src, u64 off, __m128i fill) {
+	return src ? load(src + off) : fill;
+}
+
+// Converts the 4 halfs in the low 64 bits of 'h' to floats.
+inline __m128 halfToFloat4(__m128i h) {
+#ifdef __F16C__
+	return _mm_cvtph_ps(h);
+#else
+	// Fabian Giesen's conversion via float multiplication, handles
+	// denormals, infinities and NaNs.
+	// https://gist.github.com/rygorous/2144712
+	h = _mm_unpacklo_epi16(h, _mm_setzero_si128());
+	const auto maskNoSign = _mm_set1_epi32(0x7fff);
+	const auto magic = _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23));
+	const auto wasInfNan = _mm_set1_epi32(0x7bff);
+	const auto expInfNan = _mm_castsi128_ps(_mm_set1_epi32(255 << 23));
+
+	auto expmant = _mm_and_si128(maskNoSign, h);
+	auto justSign = _mm_xor_si128(h, expmant);
+	auto shifted = _mm_slli_epi32(expmant, 13);
+	auto scaled = _mm_mul_ps(_mm_castsi128_ps(shifted), magic);
+	auto infNan = _mm_cmpgt_epi32(expmant, wasInfNan);
+	auto sign = _mm_slli_epi32(justSign, 16);
+	auto infNanExp = _mm_and_ps(_mm_castsi128_ps(infNan), expInfNan);
+	auto signInf = _mm_or_ps(_mm_castsi128_ps(sign), infNanExp);
+	return _mm_or_ps(scaled, signInf);
+#endif
+}
+
+// The kernels below return the number of texels they handled, the
+// rest is done by the scalar implementation.
+
+u64 interleave2x2(std::byte* dst, const std::byte* const* srcs,
+		const std::byte* fill, u64 count) {
+	u16 fv;
+	std::memcpy(&fv, fill, 2u);
+	auto f = _mm_set1_epi16(i16(fv));
+
+	auto i = u64(0u);
+	for(; i + 8 <= count; i += 8) {
+		auto a = loadChannel(srcs[0], i * 2, f);
+		auto b = loadChannel(srcs[1], i * 2, f);
+		store(dst + i * 4, _mm_unpacklo_epi16(a, b));
+		store(dst + i * 4 + 16, _mm_unpackhi_epi16(a, b));
+	}
+
+	return i;
+}
+
+u64 interleave4x2(std::byte* dst, const std::byte* const* srcs,
+		const std::byte* fill, u64 count) {
+	u16 fv;
+	std::memcpy(&fv, fill, 2u);
+	auto f = _mm_set1_epi16(i16(fv));
+
+	auto i = u64(0u);
+	for(; i + 8 <= count; i += 8) {
+		auto a = loadChannel(srcs[0], i * 2, f);
+		auto b = loadChannel(srcs[1], i * 2, f);
+		auto c = loadChannel(srcs[2], i * 2, f);
+		auto d = loadChannel(srcs[3], i * 2, f);
+
+		auto abLo = _mm_unpacklo_epi16(a, b);
+		auto abHi = _mm_unpackhi_epi16(a, b);
+		auto cdLo = _mm_unpacklo_epi16(c, d);
+		auto cdHi = _mm_unpackhi_epi16(c, d);
+
+		auto out = dst + i * 8;
+		store(out + 0, _mm_unpacklo_epi32(abLo, cdLo));
+		store(out + 16, _mm_unpackhi_epi32(abLo, cdLo));
+		store(out + 32, _mm_unpacklo_epi32(abHi, cdHi));
+		store(out + 48, _mm_unpackhi_epi32(abHi, cdHi));
+	}
+
+	return i;
+}
+
+u64 interleave2x4(std::byte* dst, const std::byte* const* srcs,
+		const std::byte* fill, u64 count) {
+	u32 fv;
+	std::memcpy(&fv, fill, 4u);
+	auto f = _mm_set1_epi32(i32(fv));
+
+	auto i = u64(0u);
+	for(; i + 4 <= count; i += 4) {
+		auto a = loadChannel(srcs[0], i * 4, f);
+		auto b = loadChannel(srcs[1], i * 4, f);
+		store(dst + i * 8, _mm_unpacklo_epi32(a, b));
+		store(dst + i * 8 + 16, _mm_unpackhi_epi32(a, b));
+	}
+
+	return i;
+}
+
+// 4x4 transpose, rows to columns
+inline void transpose4(__m128i& a, __m128i& b, __m128i& c, __m128i& d) {
+	auto t0 = _mm_unpacklo_epi32(a, b);
+	auto t1 = _mm_unpacklo_epi32(c, d);
+	auto t2 = _mm_unpackhi_epi32(a, b);
+	auto t3 = _mm_unpackhi_epi32(c, d);
+	a = _mm_unpacklo_epi64(t0, t1);
+	b = _mm_unpackhi_epi64(t0, t1);
+	c = _mm_unpacklo_epi64(t2, t3);
+	d = _mm_unpackhi_epi64(t2, t3);
+}
+
+u64 interleave4x4(std::byte* dst, const std::byte* const* srcs,
+		const std::byte* fill, u64 count) {
+	u32 fv;
+	std::memcpy(&fv, fill, 4u);
+	auto f = _mm_set1_epi32(i32(fv));
+
+	auto i = u64(0u);
+	for(; i + 4 <= count; i += 4) {
+		auto a = loadChannel(srcs[0], i * 4, f);
+		auto b = loadChannel(srcs[1], i * 4, f);
+		auto c = loadChannel(srcs[2], i * 4, f);
+		auto d = loadChannel(srcs[3], i * 4, f);
+		transpose4(a, b, c, d);
+
+		auto out = dst + i * 16;
+		store(out + 0, a);
+		store(out + 16, b);
+		store(out + 32, c);
+		store(out + 48, d);
+	}
+
+	return i;
+}
+
+u64 deinterleave2x2(std::byte* const* dsts, const std::byte* src, u64 count) {
+	auto i = u64(0u);
+	for(; i + 8 <= count; i += 8) {
+		auto r0 = load(src + i * 4);
+		auto r1 = load(src + i * 4 + 16);
+
+		// sign-extend the 16-bit halves so that packs doesn't saturate
+		if(dsts[0]) {
+			auto a0 = _mm_srai_epi32(_mm_slli_epi32(r0, 16), 16);
+			auto a1 = _mm_srai_epi32(_mm_slli_epi32(r1, 16), 16);
+			store(dsts[0] + i * 2, _mm_packs_epi32(a0, a1));
+		}
+
+		if(dsts[1]) {
+			auto b0 = _mm_srai_epi32(r0, 16);
+			auto b1 = _mm_srai_epi32(r1, 16);
+			store(dsts[1] + i * 2, _mm_packs_epi32(b0, b1));
+		}
+	}
+
+	return i;
+}
+
+u64 deinterleave4x2(std::byte* const* dsts, const std::byte* src, u64 count) {
+	auto i = u64(0u);
+	for(; i + 8 <= count; i += 8) {
+		auto in = src + i * 8;
+		auto r0 = load(in + 0); // texels 0, 1
+		auto r1 = load(in + 16); // texels 2, 3
+		auto r2 = load(in + 32); // texels 4, 5
+		auto r3 = load(in + 48); // texels 6, 7
+
+		auto s0 = _mm_unpacklo_epi16(r0, r1); // a0 a2 b0 b2 c0 c2 d0 d2
+		auto s1 = _mm_unpackhi_epi16(r0, r1); // a1 a3 b1 b3 c1 c3 d1 d3
+		auto s2 = _mm_unpacklo_epi16(r2, r3);
+		auto s3 = _mm_unpackhi_epi16(r2, r3);
+
+		auto u0 = _mm_unpacklo_epi16(s0, s1); // a0 a1 a2 a3 b0 b1 b2 b3
+		auto u1 = _mm_unpackhi_epi16(s0, s1); // c0 c1 c2 c3 d0 d1 d2 d3
+		auto u2 = _mm_unpacklo_epi16(s2, s3); // a4 .. a7 b4 .. b7
+		auto u3 = _mm_unpackhi_epi16(s2, s3); // c4 .. c7 d4 .. d7
+
+		__m128i out[4] {
+			_mm_unpacklo_epi64(u0, u2),
+			_mm_unpackhi_epi64(u0, u2),
+			_mm_unpacklo_epi64(u1, u3),
+			_mm_unpackhi_epi64(u1, u3),
+		};
+
+		for(auto c = 0u; c < 4u; ++c) {
+			if(dsts[c]) {
+				store(dsts[c] + i * 2, out[c]);
+			}
+		}
+	}
+
+	return i;
+}
+
+u64 deinterleave2x4(std::byte* const* dsts, const std::byte* src, u64 count) {
+	auto i = u64(0u);
+	for(; i + 4 <= count; i += 4) {
+		auto r0 = _mm_castsi128_ps(load(src + i * 8));
+		auto r1 = _mm_castsi128_ps(load(src + i * 8 + 16));
+		if(dsts[0]) {
+			store(dsts[0] + i * 4, _mm_shuffle_ps(r0, r1, _MM_SHUFFLE(2, 0, 2, 0)));
+		}
+
+		if(dsts[1]) {
+			store(dsts[1] + i * 4, _mm_shuffle_ps(r0, r1, _MM_SHUFFLE(3, 1, 3, 1)));
+		}
+	}
+
+	return i;
+}
+
+u64 deinterleave4x4(std::byte* const* dsts, const std::byte* src, u64 count) {
+	auto i = u64(0u);
+	for(; i + 4 <= count; i += 4) {
+		auto in = src + i * 16;
+		__m128i r[4] {load(in), load(in + 16), load(in + 32), load(in + 48)};
+		transpose4(r[0], r[1], r[2], r[3]);
+		for(auto c = 0u; c < 4u; ++c) {
+			if(dsts[c]) {
+				store(dsts[c] + i * 4, r[c]);
+			}
+		}
+	}
+
+	return i;
+}
+
+u64 interleaveHalfToFloatSSE(std::byte* dst, unsigned numChannels,
+		const std::byte* const* srcs, float fill, u64 count) {
+	if(numChannels == 3u) {
+		return 0u;
+	}
+
+	auto f = _mm_set1_ps(fill);
+	auto i = u64(0u);
+	for(; i + 4 <= count; i += 4) {
+		__m128 v[4];
+		for(auto c = 0u; c < numChannels; ++c) {
+			v[c] = srcs[c] ? halfToFloat4(load64(srcs[c] + i * 2)) : f;
+		}
+
+		auto out = dst + i * numChannels * 4;
+		if(numChannels == 1u) {
+			store(out, v[0]);
+		} else if(numChannels == 2u) {
+			store(out, _mm_unpacklo_ps(v[0], v[1]));
+			store(out + 16, _mm_unpackhi_ps(v[0], v[1]));
+		} else {
+			_MM_TRANSPOSE4_PS(v[0], v[1], v[2], v[3]);
+			store(out + 0, v[0]);
+			store(out + 16, v[1]);
+			store(out + 32, v[2]);
+			store(out + 48, v[3]);
+		}
+	}
+
+	return i;
+}
+
+#endif // IMGIO_SSE2
+
+template<typename T>
+void interleaveT(std::byte* dst, unsigned numChannels,
+		const std::byte* const* srcs, const std::byte* fill, u64 count) {
+	auto begin = u64(0u);
+	switch(numChannels) {
+		case 1:
+			if(srcs[0]) {
+				std::memcpy(dst, srcs[0], count * sizeof(T));
+			} else {
+				interleaveScalar<T, 1>(dst, srcs, fill, 0u, count);
+			}
+			break;
+		case 2:
+#ifdef IMGIO_SSE2
+			begin = sizeof(T) == 2 ?
+				interleave2x2(dst, srcs, fill, count) :
+				interleave2x4(dst, srcs, fill, count);
+#endif // IMGIO_SSE2
+			interleaveScalar<T, 2>(dst, srcs, fill, begin, count);
+			break;
+		case 3:
+			interleaveScalar<T, 3>(dst, srcs, fill, begin, count);
+			break;
+		case 4:
+#ifdef IMGIO_SSE2
+			begin = sizeof(T) == 2 ?
+				interleave4x2(dst, srcs, fill, count) :
+				interleave4x4(dst, srcs, fill, count);
+#endif // IMGIO_SSE2
+			interleaveScalar<T, 4>(dst, srcs, fill, begin, count);
+			break;
+		default:
+			dlg_error("interleave: invalid channel count {}", numChannels);
+			break;
+	}
+}
+
+template<typename T>
+void deinterleaveT(std::byte* const* dsts, unsigned numChannels,
+		const std::byte* src, u64 count) {
+	auto begin = u64(0u);
+	switch(numChannels) {
+		case 1:
+			if(dsts[0]) {
+				std::memcpy(dsts[0], src, count * sizeof(T));
+			}
+			break;
+		case 2:
+#ifdef IMGIO_SSE2
+			begin = sizeof(T) == 2 ?
+				deinterleave2x2(dsts, src, count) :
+				deinterleave2x4(dsts, src, count);
+#endif // IMGIO_SSE2
+			deinterleaveScalar<T, 2>(dsts, src, begin, count);
+			break;
+		case 3:
+			deinterleaveScalar<T, 3>(dsts, src, begin, count);
+			break;
+		case 4:
+#ifdef IMGIO_SSE2
+			begin = sizeof(T) == 2 ?
+				deinterleave4x2(dsts, src, count) :
+				deinterleave4x4(dsts, src, count);
+#endif // IMGIO_SSE2
+			deinterleaveScalar<T, 4>(dsts, src, begin, count);
+			break;
+		default:
+			dlg_error("deinterleave: invalid channel count {}", numChannels);
+			break;
+	}
+}
+
+} // anon namespace
+
+void interleave(std::byte* dst, unsigned numChannels, unsigned sampleSize,
+		const std::byte* const* srcs, const std::byte* fill, u64 count) {
+	dlg_assert(sampleSize == 2u || sampleSize == 4u);
+	if(sampleSize == 2u) {
+		interleaveT<u16>(dst, numChannels, srcs, fill, count);
+	} else {
+		interleaveT<u32>(dst, numChannels, srcs, fill, count);
+	}
+}
+
+void interleaveHalfToFloat(std::byte* dst, unsigned numChannels,
+		const std::byte* const* srcs, float fill, u64 count) {
+	dlg_assert(numChannels >= 1u && numChannels <= 4u);
+	auto begin = u64(0u);
+#ifdef IMGIO_SSE2
+	begin = interleaveHalfToFloatSSE(dst, numChannels, srcs, fill, count);
+#endif // IMGIO_SSE2
+
+	// dst might not be aligned for float, so we can't just cast it
+	// for the scalar path. Process the remainder through a small buffer.
+	float buf[64 * 4];
+	while(begin < count) {
+		auto num = std::min<u64>(count - begin, 64u);
+		const std::byte* offSrcs[4] {};
+		for(auto c = 0u; c < numChannels; ++c) {
+			offSrcs[c] = srcs[c] ? srcs[c] + begin * 2u : nullptr;
+		}
+
+		halfToFloatScalar(buf, numChannels, offSrcs, fill, 0u, num);
+		std::memcpy(dst + begin * numChannels * 4u, buf,
+			num * numChannels * 4u);
+		begin += num;
+	}
+}
+
+void deinterleave(std::byte* const* dsts, unsigned numChannels,
+		unsigned sampleSize, const std::byte* src, u64 count) {
+	dlg_assert(sampleSize == 2u || sampleSize == 4u);
+	if(sampleSize == 2u) {
+		deinterleaveT<u16>(dsts, numChannels, src, count);
+	} else {
+		deinterleaveT<u32>(dsts, numChannels, src, count);
+	}
+}
+
+} // namespace imgio
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <cstddef>
+
+// Conversion between planar (one buffer per channel) and interleaved
+// texel data, as needed e.g. for EXR. Uses SSE2 kernels where available,
+// source and destination pointers don't have to be aligned.
+
+namespace imgio {
+
+// Interleaves 'count' texels with 'numChannels' (1 to 4) components of
+// 'sampleSize' (2 or 4) bytes from the planar channels 'srcs' into 'dst'.
+// When srcs[c] is null, the component is filled with the 'sampleSize'
+// bytes at 'fill' instead, e.g. the constant one for a missing alpha.
+void interleave(std::byte* dst, unsigned numChannels, unsigned sampleSize,
+	const std::byte* const* srcs, const std::byte* fill, u64 count);
+
+// Like interleave but the planar channels contain 16-bit half floats
+// that are converted to 32-bit floats. 'fill' is used for null channels.
+void interleaveHalfToFloat(std::byte* dst, unsigned numChannels,
+	const std::byte* const* srcs, float fill, u64 count);
+
+// Inverse of interleave: splits 'count' texels with 'numChannels'
+// (1 to 4) components of 'sampleSize' (2 or 4) bytes from 'src' into
+// the planar channels 'dsts'. Channels with a null dst are skipped.
+void deinterleave(std::byte* const* dsts, unsigned numChannels,
+	unsigned sampleSize, const std::byte* src, u64 count);
+
+} // namespace imgio
@@ -0,0 +1,486 @@
+#include <imgio/jpeg.hpp>
+#include <imgio/image.hpp>
+#include <imgio/stream.hpp>
+#include <imgio/format.hpp>
+#include <imgio/file.hpp>
+#include <nytl/scope.hpp>
+#include <dlg/dlg.hpp>
+#include <algorithm>
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdio> // jpeglib.h needs FILE
+#include <csetjmp>
+#include <cstring>
+#include <cerrno>
+#include <mutex>
+#include <stdexcept>
+#include <jpeglib.h>
+
+// JPEG decoding and encoding via libjpeg(-turbo), which uses SIMD for the
+// (I)DCT, up/downsampling and color conversion. We only use the libjpeg api so that plain libjpeg
+// works as well.
+
+namespace imgio {
+
+// libjpeg reports fatal errors via the error_exit callback, which must not
+// return. We longjmp back to jpegCall and throw from there. The jumped-over
+// frames only contain libjpeg code and the lambdas passed to jpegCall, which
+// must not hold objects with non-trivial destructors.
+struct JpegErrorMgr {
+	jpeg_error_mgr mgr;
+	std::jmp_buf jmp;
+	char msg[JMSG_LENGTH_MAX];
+};
+
+void jpegErrorExit(j_common_ptr cinfo) {
+	auto& err = *reinterpret_cast<JpegErrorMgr*>(cinfo->err);
+	(*cinfo->err->format_message)(cinfo, err.msg);
+	std::longjmp(err.jmp, 1);
+}
+
+void jpegOutputMessage(j_common_ptr cinfo) {
+	char msg[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, msg);
+	dlg_debug("libjpeg: {}", msg);
+}
+
+template<typename F>
+void jpegCall(JpegErrorMgr& err, F&& func) {
+	if(setjmp(err.jmp)) {
+		throw std::runtime_error(std::string("libjpeg: ") + err.msg);
+	}
+
+	func();
+}
+
+// Decompressor reading from memory, destroyed with the object.
+struct JpegDecompressor {
+	jpeg_decompress_struct cinfo {};
+	JpegErrorMgr err {};
+
+	JpegDecompressor(span<const std::byte> data) {
+		cinfo.err = jpeg_std_error(&err.mgr);
+		err.mgr.error_exit = jpegErrorExit;
+		err.mgr.output_message = jpegOutputMessage;
+
+		// jpeg_create_decompress may fail itself, e.g. on allocation
+		// failure, before cinfo is valid for jpeg_destroy_decompress.
+		auto src = reinterpret_cast<const unsigned char*>(data.data());
+		auto size = static_cast<unsigned long>(data.size());
+		jpegCall(err, [&]{ jpeg_create_decompress(&cinfo); });
+		try {
+			jpegCall(err, [&]{
+				jpeg_mem_src(&cinfo, src, size);
+				jpeg_read_header(&cinfo, TRUE);
+			});
+		} catch(...) {
+			jpeg_destroy_decompress(&cinfo);
+			throw;
+		}
+	}
+
+	~JpegDecompressor() {
+		jpeg_destroy_decompress(&cinfo);
+	}
+
+	JpegDecompressor(const JpegDecompressor&) = delete;
+	JpegDecompressor& operator=(const JpegDecompressor&) = delete;
+};
+
+// Adobe files store CMYK inverted, libjpeg doesn't undo that.
+void cmykToRgb(const u8* src, u8* dst, unsigned count, bool inverted) {
+	for(auto i = 0u; i < count; ++i) {
+		unsigned c = src[4 * i + 0];
+		unsigned m = src[4 * i + 1];
+		unsigned y = src[4 * i + 2];
+		unsigned k = src[4 * i + 3];
+		if(!inverted) {
+			c = 255u - c;
+			m = 255u - m;
+			y = 255u - y;
+			k = 255u - k;
+		}
+
+		dst[3 * i + 0] = u8((c * k + 127u) / 255u);
+		dst[3 * i + 1] = u8((m * k + 127u) / 255u);
+		dst[3 * i + 2] = u8((y * k + 127u) / 255u);
+	}
+}
+
+class JpegReaderImpl : public JpegReader {
+public:
+	ReadStreamMemoryMap map_;
+	Vec2ui size_ {};
+	Format format_ {};
+	unsigned mipLevels_ {};
+	J_COLOR_SPACE outSpace_ {}; // what we let libjpeg decode to
+
+	// read(mip, layer) decodes every level once into its own buffer.
+	// The returned spans stay valid and concurrent reads (see
+	// concurrentRead) never resize memory another thread reads from.
+	mutable std::array<std::once_flag, 4> mipOnce_;
+	mutable std::array<std::vector<std::byte>, 4> mipData_;
+
+public:
+	ReadError load(std::unique_ptr<Read>&& stream) {
+		// SOI marker, followed by another marker. Checked before mapping,
+		// streams that can't be mapped are copied completely.
+		std::array<std::byte, 3> soi;
+		auto start = stream->address();
+		auto read = stream->readPartial(soi.data(), soi.size());
+		stream->seek(i64(start));
+		if(read != i64(soi.size()) || soi[0] != std::byte(0xFF) ||
+				soi[1] != std::byte(0xD8) || soi[2] != std::byte(0xFF)) {
+			return ReadError::invalidType;
+		}
+
+		map_ = ReadStreamMemoryMap(std::move(stream));
+		auto data = map_.span();
+
+		JpegDecompressor dec(data);
+		auto& cinfo = dec.cinfo;
+		switch(cinfo.jpeg_color_space) {
+			case JCS_GRAYSCALE:
+				format_ = Format::r8Srgb;
+				outSpace_ = JCS_GRAYSCALE;
+				break;
+			case JCS_YCbCr:
+			case JCS_RGB:
+				format_ = Format::r8g8b8Srgb;
+				outSpace_ = JCS_RGB;
+				break;
+			case JCS_CMYK:
+			case JCS_YCCK:
+				format_ = Format::r8g8b8Srgb;
+				outSpace_ = JCS_CMYK;
+				break;
+			default:
+				dlg_warn("JPEG unsupported color space {}", int(cinfo.jpeg_color_space));
+				return ReadError::unsupportedFormat;
+		}
+
+		size_ = {cinfo.image_width, cinfo.image_height};
+		if(size_.x == 0u || size_.y == 0u) {
+			return ReadError::empty;
+		}
+
+		// libjpeg can scale by 1/2, 1/4, 1/8 while decoding
+		mipLevels_ = std::min(4u, numMipLevels(size_));
+		return ReadError::none;
+	}
+
+	Vec3ui size() const noexcept override { return {size_.x, size_.y, 1u}; }
+	Format format() const noexcept override { return format_; }
+	unsigned mipLevels() const noexcept override { return mipLevels_; }
+	unsigned layers() const noexcept override { return 1u; }
+	bool concurrentRead() const noexcept override { return true; }
+
+	span<const std::byte> read(unsigned mip, unsigned layer) const override {
+		dlg_assert(mip < mipLevels_);
+		// call_once doesn't set the flag when the decoding throws
+		std::call_once(mipOnce_[mip], [&]{
+			std::vector<std::byte> data(sizeBytes(size(), mip, format_));
+			read(data, mip, layer);
+			mipData_[mip] = std::move(data);
+		});
+
+		return mipData_[mip];
+	}
+
+	u64 read(span<std::byte> data, unsigned mip, unsigned layer) const override {
+		dlg_assert(layer == 0u);
+		auto rowSize = u64(std::max(size_.x >> mip, 1u)) * formatElementSize(format_);
+		return readPitched(data, rowSize, mip);
+	}
+
+	u64 readPitched(span<std::byte> data, u64 rowPitch, unsigned mip) const override {
+		dlg_assert(mip < mipLevels_);
+		auto width = std::max(size_.x >> mip, 1u);
+		auto height = std::max(size_.y >> mip, 1u);
+		auto fmtSize = formatElementSize(format_);
+		auto rowSize = u64(width) * fmtSize;
+		auto byteSize = (height - 1u) * rowPitch + rowSize;
+		dlg_assert(rowPitch >= rowSize);
+		dlg_assert(u64(data.size()) >= byteSize);
+
+		JpegDecompressor dec(map_.span());
+		auto& cinfo = dec.cinfo;
+		cinfo.out_color_space = outSpace_;
+		cinfo.scale_num = 1u;
+		cinfo.scale_denom = 1u << mip;
+		jpegCall(dec.err, [&]{ jpeg_start_decompress(&cinfo); });
+
+		// libjpeg rounds the scaled size up while we round down.
+		// Rows that are not in the mip level, rows with an additional
+		// column and CMYK rows are decoded into scratch memory first.
+		dlg_assert(cinfo.output_width >= width && cinfo.output_height >= height);
+		auto outRowSize = std::size_t(cinfo.output_width) * cinfo.output_components;
+		auto direct = (cinfo.output_width == width && outSpace_ != JCS_CMYK);
+		auto inverted = bool(cinfo.saw_Adobe_marker);
+
+		auto maxRows = unsigned(std::max(cinfo.rec_outbuf_height, 1));
+		std::vector<std::byte> scratch(maxRows * outRowSize);
+		std::array<JSAMPROW, 16> rows;
+		maxRows = std::min<unsigned>(maxRows, rows.size());
+
+		while(cinfo.output_scanline < cinfo.output_height) {
+			auto y0 = cinfo.output_scanline;
+			auto count = std::min(maxRows, cinfo.output_height - y0);
+			for(auto i = 0u; i < count; ++i) {
+				auto y = y0 + i;
+				auto dst = (direct && y < height) ?
+					data.data() + y * rowPitch :
+					scratch.data() + i * outRowSize;
+				rows[i] = reinterpret_cast<JSAMPROW>(dst);
+			}
+
+			JDIMENSION read {};
+			jpegCall(dec.err, [&]{
+				read = jpeg_read_scanlines(&cinfo, rows.data(), count);
+			});
+
+			if(read == 0u) {
+				throw std::runtime_error("libjpeg: no scanlines read");
+			}
+
+			if(direct) {
+				continue;
+			}
+
+			for(auto i = 0u; i < read && y0 + i < height; ++i) {
+				auto src = scratch.data() + i * outRowSize;
+				auto dst = data.data() + (y0 + i) * rowPitch;
+				if(outSpace_ == JCS_CMYK) {
+					cmykToRgb(reinterpret_cast<const u8*>(src),
+						reinterpret_cast<u8*>(dst), width, inverted);
+				} else {
+					std::memcpy(dst, src, rowSize);
+				}
+			}
+		}
+
+		jpegCall(dec.err, [&]{ jpeg_finish_decompress(&cinfo); });
+		return byteSize;
+	}
+};
+
+ReadError loadJpeg(std::unique_ptr<Read>&& stream,
+		std::unique_ptr<ImageProvider>& provider) {
+	auto reader = std::make_unique<JpegReaderImpl>();
+	auto res = ReadError::internal;
+	try {
+		res = reader->load(std::move(stream));
+	} catch(const std::runtime_error& err) {
+		dlg_warn("loadJpeg: {}", err.what());
+	}
+
+	if(res == ReadError::none) {
+		provider = std::move(reader);
+	} else if(auto mapped = reader->map_.release()) {
+		// we only move from the stream on success
+		stream = std::move(mapped);
+	}
+
+	return res;
+}
+
+// Destination writing to a Write stream in blocks. Exceptions from the
+// stream are turned into libjpeg errors since they must not propagate
+// through libjpeg.
+struct JpegStreamDest {
+	jpeg_destination_mgr mgr;
+	Write* write;
+	JpegErrorMgr* err;
+	std::vector<JOCTET> buf;
+};
+
+void jpegWriteBlock(j_compress_ptr cinfo, std::size_t size) {
+	auto& dest = *reinterpret_cast<JpegStreamDest*>(cinfo->dest);
+	auto failed = false;
+	try {
+		dest.write->write(reinterpret_cast<const std::byte*>(dest.buf.data()), size);
+	} catch(const std::runtime_error& err) {
+		std::snprintf(dest.err->msg, sizeof(dest.err->msg), "%s", err.what());
+		failed = true;
+	}
+
+	if(failed) {
+		std::longjmp(dest.err->jmp, 1);
+	}
+}
+
+void jpegInitDest(j_compress_ptr cinfo) {
+	auto& dest = *reinterpret_cast<JpegStreamDest*>(cinfo->dest);
+	dest.mgr.next_output_byte = dest.buf.data();
+	dest.mgr.free_in_buffer = dest.buf.size();
+}
+
+boolean jpegEmptyOutputBuffer(j_compress_ptr cinfo) {
+	// must write the whole buffer, ignoring free_in_buffer
+	auto& dest = *reinterpret_cast<JpegStreamDest*>(cinfo->dest);
+	jpegWriteBlock(cinfo, dest.buf.size());
+	jpegInitDest(cinfo);
+	return TRUE;
+}
+
+void jpegTermDest(j_compress_ptr cinfo) {
+	auto& dest = *reinterpret_cast<JpegStreamDest*>(cinfo->dest);
+	jpegWriteBlock(cinfo, dest.buf.size() - dest.mgr.free_in_buffer);
+}
+
+WriteError writeJpegThrow(Write& write, const ImageProvider& provider,
+		unsigned quality, JpegSubsampling subsampling) {
+	auto [width, height, depth] = provider.size();
+	if(depth > 1) {
+		dlg_warn("writeJpeg: discarding {} slices", depth - 1);
+	}
+
+	if(provider.layers() > 1) {
+		dlg_warn("writeJpeg: discarding {} layers", provider.layers() - 1);
+	}
+
+	if(provider.mipLevels() > 1) {
+		dlg_warn("writeJpeg: discarding {} mip levels", provider.mipLevels() - 1);
+	}
+
+	if(width > JPEG_MAX_DIMENSION || height > JPEG_MAX_DIMENSION) {
+		dlg_error("writeJpeg: size {}x{} too large", width, height);
+		return WriteError::unsupportedFormat;
+	}
+
+	// Formats libjpeg can read directly. Everything else is converted
+	// to rgb, in batches of rows.
+	auto fmt = provider.format();
+	auto inSpace = JCS_RGB;
+	auto inComponents = 3;
+	auto convertRows = false;
+	switch(fmt) {
+		case Format::r8Unorm:
+		case Format::r8Srgb:
+			inSpace = JCS_GRAYSCALE;
+			inComponents = 1;
+			break;
+		case Format::r8g8b8Unorm:
+		case Format::r8g8b8Srgb:
+			break;
+#ifdef JCS_EXTENSIONS
+		case Format::r8g8b8a8Unorm:
+		case Format::r8g8b8a8Srgb:
+			inSpace = JCS_EXT_RGBX; // alpha is ignored
+			inComponents = 4;
+			break;
+#endif // JCS_EXTENSIONS
+		default:
+			if(blockSize(fmt) != Vec3ui{1u, 1u, 1u}) {
+				dlg_error("writeJpeg: can't write block-compressed format {}", (int) fmt);
+				return WriteError::unsupportedFormat;
+			}
+
+			convertRows = true;
+			break;
+	}
+
+	auto fmtSize = formatElementSize(fmt);
+	auto rowSize = std::size_t(width) * fmtSize;
+	auto data = provider.read(0u, 0u);
+	if(u64(data.size()) < u64(rowSize) * height) {
+		dlg_error("writeJpeg: image provider returned too few bytes");
+		return WriteError::readError;
+	}
+
+	jpeg_compress_struct cinfo {};
+	JpegErrorMgr err {};
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpegErrorExit;
+	err.mgr.output_message = jpegOutputMessage;
+	jpegCall(err, [&]{ jpeg_create_compress(&cinfo); });
+	ScopeGuard cinfoGuard([&]{ jpeg_destroy_compress(&cinfo); });
+
+	JpegStreamDest dest;
+	dest.buf.resize(64 * 1024);
+	dest.mgr.init_destination = jpegInitDest;
+	dest.mgr.empty_output_buffer = jpegEmptyOutputBuffer;
+	dest.mgr.term_destination = jpegTermDest;
+	dest.write = &write;
+	dest.err = &err;
+	cinfo.dest = &dest.mgr;
+
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = inComponents;
+	cinfo.in_color_space = inSpace;
+	jpegCall(err, [&]{
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_quality(&cinfo, int(std::clamp(quality, 1u, 100u)), TRUE);
+	});
+
+	cinfo.dct_method = quality < 90u ? JDCT_IFAST : JDCT_ISLOW;
+	if(inSpace != JCS_GRAYSCALE) {
+		// luma sampling factors, chroma always has 1x1
+		auto& luma = cinfo.comp_info[0];
+		luma.h_samp_factor = subsampling == JpegSubsampling::s444 ? 1 : 2;
+		luma.v_samp_factor = subsampling == JpegSubsampling::s420 ? 2 : 1;
+	}
+
+	jpegCall(err, [&]{ jpeg_start_compress(&cinfo, TRUE); });
+
+	constexpr auto batchSize = 16u;
+	std::vector<std::byte> converted;
+	if(convertRows) {
+		converted.resize(std::size_t(batchSize) * width * 3u);
+	}
+
+	std::array<JSAMPROW, batchSize> rows;
+	while(cinfo.next_scanline < height) {
+		auto y0 = cinfo.next_scanline;
+		auto count = std::min(batchSize, height - y0);
+		auto src = data.data() + y0 * rowSize;
+		if(convertRows) {
+			// the rows are contiguous, convert the whole batch at once
+			auto texels = u64(count) * width;
+			convertTexels(Format::r8g8b8Srgb, converted,
+				fmt, {src, count * rowSize}, texels);
+		}
+
+		for(auto i = 0u; i < count; ++i) {
+			if(convertRows) {
+				auto dstRow = converted.data() + std::size_t(i) * width * 3u;
+				rows[i] = reinterpret_cast<JSAMPROW>(dstRow);
+			} else {
+				// libjpeg doesn't write to the rows
+				auto srcRow = src + i * rowSize;
+				rows[i] = reinterpret_cast<JSAMPROW>(const_cast<std::byte*>(srcRow));
+			}
+		}
+
+		jpegCall(err, [&]{ jpeg_write_scanlines(&cinfo, rows.data(), count); });
+	}
+
+	jpegCall(err, [&]{ jpeg_finish_compress(&cinfo); });
+	return WriteError::none;
+}
+
+WriteError writeJpeg(Write& write, const ImageProvider& provider,
+		unsigned quality, JpegSubsampling subsampling) {
+	try {
+		return writeJpegThrow(write, provider, quality, subsampling);
+	} catch(const std::runtime_error& err) {
+		dlg_error("writeJpeg: {}", err.what());
+		return WriteError::cantWrite;
+	}
+}
+
+WriteError writeJpeg(StringParam path, const ImageProvider& provider,
+		unsigned quality, JpegSubsampling subsampling) {
+	auto file = FileHandle(path, "wb");
+	if(!file) {
+		dlg_debug("fopen: {}", std::strerror(errno));
+		return WriteError::cantOpen;
+	}
+
+	FileWrite writer(std::move(file));
+	return writeJpeg(writer, provider, quality, subsampling);
+}
+
+} // namespace imgio
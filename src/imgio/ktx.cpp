@@ -1,10 +1,14 @@
 #include <imgio/image.hpp>
+#include <imgio/ktx.hpp>
 #include <imgio/stream.hpp>
 #include <imgio/allocation.hpp>
 #include <imgio/format.hpp>
 #include <nytl/scope.hpp>
 #include "gl.hpp"
+#include "parallel.hpp"
 #include <dlg/dlg.hpp>
+#include <cstring>
+#include <atomic>
 
 // TODO: support for compressed formats and such
 
@@ -108,8 +112,10 @@ void tfwrite(void* buffer, std::size_t size, std::size_t count,
 }
 
 // wip
-class KtxReader : public ImageProvider {
+class KtxReader : public KtxProvider {
 public:
+	using KtxProvider::readMetadata;
+
 	Format format_;
 	Vec3ui size_;
 	u32 mipLevels_;
@@ -151,6 +157,12 @@ public:
 		return byteSize;
 	}
 
+	const Read& stream() const override { return *stream_; }
+
+	std::optional<u64> dataOffset(unsigned mip, unsigned layer) const override {
+		return offset(mip, layer);
+	}
+
 	u64 offset(unsigned mip = 0, unsigned layer = 0) const {
 		errno = {};
 		dlg_assert(mip < mipLevels());
@@ -257,6 +269,97 @@ std::ostream& operator<<(std::ostream& os, const KtxHeader& header) {
 	return os;
 }
 
+// KtxProvider
+bool parseKtxMetadata(span<const std::byte> data, std::vector<KtxKeyValue>& out) {
+	auto chars = reinterpret_cast<const char*>(data.data());
+	auto size = u64(data.size());
+	auto off = u64(0u);
+	while(off < size) {
+		u32 byteSize;
+		if(size - off < sizeof(byteSize)) {
+			dlg_warn("KTX unexpected end in key/value pairs");
+			return false;
+		}
+
+		std::memcpy(&byteSize, chars + off, sizeof(byteSize));
+		off += sizeof(byteSize);
+		if(byteSize > size - off) {
+			dlg_warn("KTX key/value pair exceeds key/value data");
+			return false;
+		}
+
+		std::string_view keyValue(chars + off, byteSize);
+		off += align(byteSize, 4u);
+
+		auto sep = keyValue.find('\0');
+		if(sep == keyValue.npos) {
+			dlg_warn("KTX keyValue pair without null separator");
+			continue;
+		}
+
+		auto& kv = out.emplace_back();
+		kv.key = keyValue.substr(0, sep);
+		kv.value = keyValue.substr(sep + 1);
+	}
+
+	return true;
+}
+
+ReadError KtxProvider::readMetadata(Read& stream, u64 size) {
+	metadata_.clear();
+	metadataData_ = {};
+	if(size == 0u) {
+		return ReadError::none;
+	}
+
+	// for memory streams, reference the data directly
+	span<const std::byte> data;
+	if(auto mem = dynamic_cast<MemoryRead*>(&stream); mem) {
+		auto buf = mem->buffer();
+		auto address = mem->address();
+		if(address > u64(buf.size()) || size > u64(buf.size()) - address) {
+			dlg_debug("KTX unexpected end in key/value data");
+			return ReadError::unexpectedEnd;
+		}
+
+		data = buf.subspan(address, size);
+		mem->seek(size, Seek::Origin::curr);
+	} else {
+		metadataData_ = std::make_unique<std::byte[]>(size);
+		if(stream.readPartial(metadataData_.get(), size) != i64(size)) {
+			dlg_debug("KTX unexpected end in key/value data");
+			return ReadError::unexpectedEnd;
+		}
+
+		data = {metadataData_.get(), std::size_t(size)};
+	}
+
+	if(!parseKtxMetadata(data, metadata_)) {
+		return ReadError::unexpectedEnd;
+	}
+
+	for(auto& kv : metadata_) {
+		auto value = kv.value;
+		if(value.length() > 50) {
+			value = "<too long to print>";
+		}
+
+		dlg_debug("KTX key value pair: {} = {}", kv.key, value);
+	}
+
+	return ReadError::none;
+}
+
+std::optional<std::string_view> KtxProvider::findMetadata(std::string_view key) const {
+	for(auto& kv : metadata_) {
+		if(kv.key == key) {
+			return kv.value;
+		}
+	}
+
+	return std::nullopt;
+}
+
 ReadError loadKtx(std::unique_ptr<Read>&& stream, KtxReader& reader) {
 	std::array<u8, 12> identifier;
 	if(!stream->readPartial(identifier)) {
@@ -324,44 +427,12 @@ ReadError loadKtx(std::unique_ptr<Read>&& stream, KtxReader& reader) {
 		return ReadError::unsupportedFormat;
 	}
 
-	// just for debugging: read keys and values
-	auto keysPos = stream->address();
-	dlg_check({
-		auto bytesRead = 0u;
-		while(bytesRead < header.bytesKeyValueData) {
-			u32 byteSize;
-			if(!stream->readPartial(byteSize)) {
-				dlg_warn("KTX unexpected end in key/value pairs");
-				return ReadError::unexpectedEnd;
-			}
-
-			bytesRead += align(byteSize, 4);
-
-			std::vector<char> keyValue(byteSize);
-			if(!stream->readPartial(keyValue)) {
-				dlg_warn("KTX unexpected end in key/value pairs");
-				return ReadError::unexpectedEnd;
-			}
-
-			auto sep = std::find(keyValue.begin(), keyValue.end(), '\0');
-			if(sep == keyValue.end()) {
-				dlg_warn("KTX keyValue pair without null separator");
-				continue;
-			}
-
-			std::string_view key(&*keyValue.begin(), sep - keyValue.begin());
-
-			++sep;
-			std::string_view value(&*sep, keyValue.end() - sep);
-			if(value.length() > 50) {
-				value = "<too long to print>";
-			}
-
-			dlg_debug("KTX key value pair: {} = {}", key, value);
-		}
-	});
+	auto res = reader.readMetadata(*stream, header.bytesKeyValueData);
+	if(res != ReadError::none) {
+		return res;
+	}
 
-	reader.dataBegin_ = keysPos + header.bytesKeyValueData;
+	reader.dataBegin_ = stream->address();
 	reader.stream_ = std::move(stream);
 
 	return ReadError::none;
@@ -379,29 +450,23 @@ ReadError loadKtx(std::unique_ptr<Read>&& stream,
 }
 
 // save
-WriteError writeKtxThrow(Write& write, const ImageProvider& image) {
-	write.write(ktxIdentifier);
-
-	auto fmt = image.format();
-	auto size = image.size();
-	auto mips = std::max(image.mipLevels(), 1u);
-	auto layers = std::max(image.layers(), 1u);
-	auto fmtSize = formatElementSize(fmt);
+WriteError fillKtxHeader(KtxHeader& header, Vec3ui size, Format fmt,
+		unsigned mips, unsigned layers, bool cubemap) {
 	auto faces = 1u;
-	if(image.cubemap()) {
+	if(cubemap) {
 		dlg_assert(layers % 6u == 0);
 		faces = 6u;
 		layers = layers / 6u;
 	}
 
-	KtxHeader header;
+	header = {};
 	header.endianness = ktxEndianess;
 	header.bytesKeyValueData = 0u;
 	header.pixelWidth = size.x;
 	header.pixelHeight = size.y > 1 ? size.y : 0;
 	header.pixelDepth = size.z > 1 ? size.z : 0;
 	header.numberMipmapLevels = mips;
-	header.glTypeSize = fmtSize;
+	header.glTypeSize = formatElementSize(fmt);
 	header.numberArrayElements = layers > 1 ? layers : 0;
 	header.numberFaces = faces;
 
@@ -428,26 +493,63 @@ WriteError writeKtxThrow(Write& write, const ImageProvider& image) {
 		header.glFormat = 0u;
 	}
 
+	return WriteError::none;
+}
+
+// ktx exception: for non-array cubemaps, imageSize should only
+// contain the size of *one face* instead of everything.
+u32 ktxImageSize(const KtxHeader& header, u64 faceSize) {
+	auto layers = std::max(header.numberArrayElements, 1u);
+	if(header.numberArrayElements == 0 && header.numberFaces == 6) {
+		return faceSize;
+	}
+
+	return align(faceSize, 4u) * layers * header.numberFaces;
+}
+
+WriteError writeKtxThrow(Write& write, const ImageProvider& image) {
+	auto fmt = image.format();
+	auto size = image.size();
+	auto mips = std::max(image.mipLevels(), 1u);
+	auto layers = std::max(image.layers(), 1u);
+
+	// Seekable streams: write the subresources to their final position,
+	// potentially in parallel. Otherwise write everything in order.
+	if(write.seekable()) {
+		KtxWriter writer(write);
+		auto res = writer.begin(size, fmt, mips, layers, image.cubemap());
+		if(res == WriteError::none) {
+			res = writer.writeSubresources(image);
+		}
+		if(res == WriteError::none) {
+			res = writer.finish();
+		}
+		if(res == WriteError::none) {
+			write.seek(writer.endAddress());
+		}
+
+		return res;
+	}
+
+	write.write(ktxIdentifier);
+
+	KtxHeader header;
+	auto res = fillKtxHeader(header, size, fmt, mips, layers, image.cubemap());
+	if(res != WriteError::none) {
+		return res;
+	}
+
+	auto faces = header.numberFaces;
+	layers = layers / faces;
+
 	write.write(header);
 	const std::byte zeroBytes[4] {};
 
 	auto off = sizeof(ktxIdentifier) + sizeof(header);
 	for(auto m = 0u; m < mips; ++m) {
 		// image size
-		Vec3ui msize;
-		msize.x = std::max(size.x >> m, 1u);
-		msize.y = std::max(size.y >> m, 1u);
-		msize.z = std::max(size.z >> m, 1u);
-		u32 faceSize = msize.x * msize.y * msize.z * fmtSize;
-
-		// ktx exception: for this condition imagesize should only
-		// contain the size of *one face* instead of everything.
-		u32 metaSize = 0u;
-		if(header.numberArrayElements == 0 && image.cubemap()) {
-			metaSize = faceSize;
-		} else {
-			metaSize = align(faceSize, 4u) * layers * faces;
-		}
+		u32 faceSize = sizeBytes(size, m, fmt);
+		u32 metaSize = ktxImageSize(header, faceSize);
 		write.write(metaSize);
 		off += sizeof(u32);
 
@@ -493,14 +595,405 @@ WriteError writeKtx(Write& write, const ImageProvider& img) {
 }
 
 WriteError writeKtx(StringParam path, const ImageProvider& image) {
-	auto file = FileHandle(path, "wb");
+	auto file = FileHandle(path, "w+b");
 	if(!file) {
 		dlg_debug("fopen: {}", std::strerror(errno));
 		return WriteError::cantOpen;
 	}
 
+	// The file size is known up front, so try to write directly
+	// into a memory mapping of the file. Data from other KTX files
+	// is copied directly between the files instead, see
+	// KtxWriterBase::writeSubresources.
+	if(!KtxWriterBase::fileCopyable(image)) {
+		auto fileSize = KtxWriter::fileSize(image.size(), image.format(),
+			std::max(image.mipLevels(), 1u), std::max(image.layers(), 1u));
+		try {
+			MappedFileWrite writer(std::move(file), fileSize);
+			return writeKtx(writer, image);
+		} catch(const std::runtime_error& err) {
+			dlg_debug("writeKtx: can't map output file: {}", err.what());
+		}
+	}
+
 	FileWrite writer(std::move(file));
 	return writeKtx(writer, image);
 }
 
+// KtxWriterBase
+void KtxWriterBase::initLayout(Vec3ui size, Format format, unsigned mips,
+		unsigned layers, u32 faceAlign) {
+	dlg_assert(size.x >= 1 && size.y >= 1 && size.z >= 1);
+	dlg_assert(mips >= 1 && layers >= 1);
+
+	size_ = size;
+	format_ = format;
+	mips_ = mips;
+	layers_ = layers;
+	faceAlign_ = faceAlign;
+	offsets_.assign(mips * layers, 0u);
+	written_.assign(mips * layers, 0u);
+}
+
+u64 KtxWriterBase::offset(unsigned mip, unsigned layer) const {
+	dlg_assert(mip < mips_ && layer < layers_);
+	return offsets_[mip * layers_ + layer];
+}
+
+WriteError KtxWriterBase::writeSubresource(unsigned mip, unsigned layer,
+		span<const std::byte> data) {
+	dlg_assert(write_);
+	dlg_assert(mip < mips_ && layer < layers_);
+
+	auto faceSize = sizeBytes(size_, mip, format_);
+	if(data.size() != faceSize) {
+		dlg_debug("KtxWriter: invalid subresource size: "
+			"got {}, expected {}", data.size(), faceSize);
+		return WriteError::readError;
+	}
+
+	const std::byte zeroBytes[16] {};
+	auto id = mip * layers_ + layer;
+	auto address = offsets_[id];
+	auto padding = align(faceSize, faceAlign_) - faceSize;
+	dlg_assert(padding <= sizeof(zeroBytes));
+
+	try {
+		std::unique_lock lock(mutex_, std::defer_lock);
+		if(!write_->concurrentWriteAt()) {
+			lock.lock();
+		}
+
+		write_->writeAt(address, data);
+		if(padding > 0) {
+			write_->writeAt(address + faceSize, {zeroBytes, zeroBytes + padding});
+		}
+	} catch(const std::runtime_error& err) {
+		dlg_error("KtxWriter::writeSubresource: {}", err.what());
+		return WriteError::cantWrite;
+	}
+
+	written_[id] = 1u;
+	return WriteError::none;
+}
+
+bool KtxWriterBase::fileCopyable(const ImageProvider& image) {
+	auto ktx = dynamic_cast<const KtxProvider*>(&image);
+	return ktx && ktx->dataOffset(0u, 0u) &&
+		dynamic_cast<const FileRead*>(&ktx->stream());
+}
+
+bool KtxWriterBase::copySubresources(const ImageProvider& image) {
+	auto dst = dynamic_cast<FileWrite*>(write_);
+	if(!dst || !fileCopyable(image)) {
+		return false;
+	}
+
+	auto& ktx = static_cast<const KtxProvider&>(image);
+	auto& src = static_cast<const FileRead&>(ktx.stream());
+
+	std::lock_guard lock(mutex_);
+	const std::byte zeroBytes[16] {};
+
+	// Merge subresources that are contiguous in both files,
+	// e.g. all layers of a KTX2 level.
+	u64 srcBegin {}, dstBegin {}, rangeSize {};
+	auto copyRange = [&]{
+		auto ok = rangeSize == 0u ||
+			copyFileRange(src, srcBegin, *dst, dstBegin, rangeSize);
+		rangeSize = 0u;
+		return ok;
+	};
+
+	for(auto m = 0u; m < mips_; ++m) {
+		auto faceSize = sizeBytes(size_, m, format_);
+		auto padding = align(faceSize, faceAlign_) - faceSize;
+		dlg_assert(padding <= sizeof(zeroBytes));
+
+		for(auto l = 0u; l < layers_; ++l) {
+			auto id = m * layers_ + l;
+			auto srcOff = *ktx.dataOffset(m, l);
+			auto dstOff = offsets_[id];
+			if(rangeSize > 0u && srcBegin + rangeSize == srcOff &&
+					dstBegin + rangeSize == dstOff) {
+				rangeSize += faceSize;
+			} else {
+				if(!copyRange()) {
+					return false;
+				}
+
+				srcBegin = srcOff;
+				dstBegin = dstOff;
+				rangeSize = faceSize;
+			}
+
+			if(padding > 0) {
+				write_->writeAt(dstOff + faceSize, {zeroBytes, zeroBytes + padding});
+			}
+		}
+	}
+
+	if(!copyRange()) {
+		return false;
+	}
+
+	std::fill(written_.begin(), written_.end(), u8(1u));
+	return true;
+}
+
+WriteError KtxWriterBase::writeSubresources(const ImageProvider& image) {
+	dlg_assert(write_);
+	if(image.size() != size_ || image.format() != format_ ||
+			image.mipLevels() < mips_ || image.layers() < layers_) {
+		dlg_debug("KtxWriter: image does not match the file layout");
+		return WriteError::readError;
+	}
+
+	try {
+		if(copySubresources(image)) {
+			return WriteError::none;
+		}
+	} catch(const std::runtime_error& err) {
+		dlg_error("KtxWriter::writeSubresources: {}", err.what());
+		return WriteError::cantWrite;
+	}
+
+	auto mapped = dynamic_cast<MappedFileWrite*>(write_);
+	if(mapped && u64(mapped->data().size()) < end_) {
+		mapped = nullptr;
+	}
+
+	auto parallel = image.concurrentRead() &&
+		(mapped || write_->concurrentWriteAt());
+
+	std::atomic<WriteError> error {WriteError::none};
+	auto writeOne = [&](u64 id) {
+		if(error.load() != WriteError::none) {
+			return;
+		}
+
+		auto mip = unsigned(id / layers_);
+		auto layer = unsigned(id % layers_);
+		auto res = WriteError::none;
+		if(mapped) {
+			// read directly into the mapping, zero the padding
+			auto faceSize = sizeBytes(size_, mip, format_);
+			auto padded = align(faceSize, faceAlign_);
+			auto dst = mapped->data().subspan(offsets_[id], padded);
+			auto read = image.read(dst.first(faceSize), mip, layer);
+			if(read != faceSize) {
+				dlg_debug("invalid ImageProvider read size: "
+					"got {}, expected {}", read, faceSize);
+				res = WriteError::readError;
+			} else {
+				std::memset(dst.data() + faceSize, 0x0, padded - faceSize);
+				written_[id] = 1u;
+			}
+		} else {
+			res = writeSubresource(mip, layer, image.read(mip, layer));
+		}
+
+		if(res != WriteError::none) {
+			auto expected = WriteError::none;
+			error.compare_exchange_strong(expected, res);
+		}
+	};
+
+	try {
+		parallelFor(u64(mips_) * layers_, writeOne, parallel ? 0u : 1u);
+	} catch(const std::runtime_error& err) {
+		dlg_error("KtxWriter::writeSubresources: {}", err.what());
+		return WriteError::readError;
+	}
+
+	return error.load();
+}
+
+WriteError KtxWriterBase::finish() {
+	for(auto m = 0u; m < mips_; ++m) {
+		for(auto l = 0u; l < layers_; ++l) {
+			if(!written_[m * layers_ + l]) {
+				dlg_error("KtxWriter::finish: mip {}, layer {} was not written",
+					m, l);
+				return WriteError::internal;
+			}
+		}
+	}
+
+	write_ = {};
+	return WriteError::none;
+}
+
+// KtxWriter
+u64 KtxWriter::fileSize(Vec3ui size, Format format, unsigned mips,
+		unsigned layers) {
+	// Every face is padded to 4 bytes, see begin
+	auto ret = u64(sizeof(ktxIdentifier) + sizeof(KtxHeader));
+	for(auto m = 0u; m < mips; ++m) {
+		ret += sizeof(u32); // imageSize
+		ret += layers * align(sizeBytes(size, m, format), 4u);
+	}
+
+	return ret;
+}
+
+WriteError KtxWriter::begin(Vec3ui size, Format format, unsigned mips,
+		unsigned layers, bool cubemap) {
+	dlg_assert(write_);
+
+	KtxHeader header;
+	auto res = fillKtxHeader(header, size, format, mips, layers, cubemap);
+	if(res != WriteError::none) {
+		return res;
+	}
+
+	initLayout(size, format, mips, layers, 4u);
+
+	try {
+		auto base = write_->address();
+		write_->writeAt(base, nytl::bytes(ktxIdentifier));
+		write_->writeAt(base + sizeof(ktxIdentifier), nytl::bytes(header));
+
+		// Every face is padded to 4 bytes, so is every mip level.
+		auto off = base + sizeof(ktxIdentifier) + sizeof(header);
+		for(auto m = 0u; m < mips; ++m) {
+			auto faceSize = sizeBytes(size, m, format);
+			u32 imageSize = ktxImageSize(header, faceSize);
+			write_->writeAt(off, nytl::bytes(imageSize));
+			off += sizeof(imageSize);
+
+			for(auto l = 0u; l < layers; ++l) {
+				offsets_[m * layers + l] = off;
+				off += align(faceSize, 4u);
+			}
+		}
+
+		end_ = off;
+	} catch(const std::runtime_error& err) {
+		dlg_error("KtxWriter::begin: {}", err.what());
+		return WriteError::cantWrite;
+	}
+
+	return WriteError::none;
+}
+
+// KtxUpdater
+KtxUpdater::KtxUpdater(KtxUpdater&&) = default;
+KtxUpdater& KtxUpdater::operator=(KtxUpdater&&) = default;
+
+KtxUpdater::~KtxUpdater() {
+	if(write_) {
+		flush();
+	}
+}
+
+ReadError KtxUpdater::open(StringParam path) {
+	provider_ = {};
+	ktx_ = {};
+	write_ = {};
+
+	// The file is parsed via a separate, read-only handle. The provider
+	// is only used for the layout, never for reading data, so stale
+	// read buffers are not an issue.
+	auto readFile = FileHandle(path, "rb");
+	if(!readFile) {
+		dlg_debug("fopen('{}'): {}", path, std::strerror(errno));
+		return ReadError::cantOpen;
+	}
+
+	std::unique_ptr<Read> stream = std::make_unique<FileRead>(std::move(readFile));
+	auto res = loadKtx2(std::move(stream), provider_);
+	if(res == ReadError::invalidType) {
+		stream->seek(0u);
+		res = loadKtx(std::move(stream), provider_);
+	}
+
+	if(res != ReadError::none) {
+		return res;
+	}
+
+	ktx_ = dynamic_cast<const KtxProvider*>(provider_.get());
+	dlg_assert(ktx_);
+	if(!ktx_->dataOffset(0u, 0u)) {
+		dlg_debug("KtxUpdater: can't update supercompressed file in place");
+		provider_ = {};
+		ktx_ = {};
+		return ReadError::unsupportedFormat;
+	}
+
+	auto writeFile = FileHandle(path, "r+b");
+	if(!writeFile) {
+		dlg_debug("fopen('{}', 'r+b'): {}", path, std::strerror(errno));
+		provider_ = {};
+		ktx_ = {};
+		return ReadError::cantOpen;
+	}
+
+	write_ = std::make_unique<FileWrite>(std::move(writeFile));
+	return ReadError::none;
+}
+
+WriteError KtxUpdater::writeSubresource(unsigned mip, unsigned layer,
+		span<const std::byte> data) {
+	dlg_assert(write_);
+	if(mip >= mipLevels() || layer >= layers()) {
+		dlg_debug("KtxUpdater: invalid subresource mip {}, layer {}", mip, layer);
+		return WriteError::readError;
+	}
+
+	auto faceSize = sizeBytes(size(), mip, format());
+	if(data.size() != faceSize) {
+		dlg_debug("KtxUpdater: invalid subresource size: "
+			"got {}, expected {}", data.size(), faceSize);
+		return WriteError::readError;
+	}
+
+	auto address = ktx_->dataOffset(mip, layer);
+	dlg_assert(address);
+
+	try {
+		write_->writeAt(*address, data);
+	} catch(const std::runtime_error& err) {
+		dlg_error("KtxUpdater::writeSubresource: {}", err.what());
+		return WriteError::cantWrite;
+	}
+
+	return WriteError::none;
+}
+
+WriteError KtxUpdater::writeSubresource(const ImageProvider& src,
+		unsigned mip, unsigned layer) {
+	if(src.format() != format()) {
+		dlg_debug("KtxUpdater: format mismatch: file {}, image {}",
+			int(format()), int(src.format()));
+		return WriteError::unsupportedFormat;
+	}
+
+	if(src.size() != size() || mip >= src.mipLevels() || layer >= src.layers()) {
+		dlg_debug("KtxUpdater: image layout does not match file");
+		return WriteError::readError;
+	}
+
+	return writeSubresource(mip, layer, src.read(mip, layer));
+}
+
+WriteError KtxUpdater::flush(bool sync) {
+	dlg_assert(write_);
+
+	try {
+		write_->flush(sync);
+	} catch(const std::runtime_error& err) {
+		dlg_error("KtxUpdater::flush: {}", err.what());
+		return WriteError::cantWrite;
+	}
+
+	return WriteError::none;
+}
+
+Vec3ui KtxUpdater::size() const { return provider_->size(); }
+Format KtxUpdater::format() const { return provider_->format(); }
+unsigned KtxUpdater::mipLevels() const { return provider_->mipLevels(); }
+unsigned KtxUpdater::layers() const { return provider_->layers(); }
+bool KtxUpdater::cubemap() const { return provider_->cubemap(); }
+
 } // namespace
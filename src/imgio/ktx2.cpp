@@ -1,9 +1,14 @@
 #include <imgio/image.hpp>
+#include <imgio/ktx.hpp>
 #include <imgio/stream.hpp>
 #include <imgio/allocation.hpp>
 #include <imgio/format.hpp>
 #include <dlg/dlg.hpp>
 #include <memory>
+#include <numeric>
+#include <mutex>
+#include <atomic>
+#include "parallel.hpp"
 #include "../format_utils.h"
 
 // https://zlib.net/zlib_how.html
@@ -39,8 +44,10 @@ struct Ktx2LevelInfo {
 	u64 uncompressedLength;
 };
 
-class Ktx2Reader : public ImageProvider {
+class Ktx2Reader : public KtxProvider {
 public:
+	using KtxProvider::readMetadata;
+
 	Format format_;
 	Vec3ui size_;
 	u32 faces_;
@@ -117,6 +124,16 @@ public:
 		}
 	}
 
+	const Read& stream() const override { return *stream_; }
+
+	std::optional<u64> dataOffset(unsigned mip, unsigned layer) const override {
+		if(zlib_) {
+			return std::nullopt;
+		}
+
+		return offset(mip, layer);
+	}
+
 	u64 offset(unsigned mip = 0, unsigned layer = 0) const {
 		errno = {};
 		dlg_assert(mip < levels_.size());
@@ -193,7 +210,13 @@ ReadError loadKtx2(std::unique_ptr<Read>&& stream, Ktx2Reader& reader) {
 		}
 	}
 
-	// NOTE: could debug-output key/values as we do in the KTX1 loader.
+	if(header.kvdByteLength) {
+		stream->seek(reader.initialOffset_ + header.kvdByteOffset);
+		auto res = reader.readMetadata(*stream, header.kvdByteLength);
+		if(res != ReadError::none) {
+			return res;
+		}
+	}
 
 	reader.layerCount_ = header.layerCount;
 	reader.faces_ = header.faceCount;
@@ -231,36 +254,29 @@ u32 typeSize(Format fmt) {
 	return formatElementSize(fmt) / FormatComponentCount(vkfmt);
 }
 
-WriteError writeKtx2Throw(Write& write, const ImageProvider& img, bool useZlib) {
-	auto initialAddr = write.address();
-	write.write(ktx2Identifier);
-
+Ktx2Header ktx2Header(Vec3ui size, Format format, unsigned mips,
+		unsigned layers, bool cubemap, bool useZlib) {
 	// TODO:
 	// - check prohitibited formats
 
-	auto size = img.size();
-	auto format = img.format();
-	auto numMips = img.mipLevels();
-	auto numLayers = img.layers();
-	auto fmtSize = formatElementSize(format);
 	auto numFaces = 1u;
-	if(img.cubemap()) {
-		dlg_assert(numLayers % 6u == 0);
+	if(cubemap) {
+		dlg_assert(layers % 6u == 0);
 		numFaces = 6u;
-		numLayers = numLayers / 6u;
+		layers = layers / 6u;
 	}
 
 	Ktx2Header header {};
-	header.vkFormat = u32(img.format());
+	header.vkFormat = u32(format);
 	header.faceCount = numFaces;
-	header.levelCount = numMips;
+	header.levelCount = mips;
 	header.supercompression = 0u;
 	if(useZlib) {
 		header.supercompression = 3u;
 	}
 
-	header.layerCount = numLayers > 1 ? numLayers : 0;
-	header.typeSize = typeSize(img.format());
+	header.layerCount = layers > 1 ? layers : 0;
+	header.typeSize = typeSize(format);
 
 	header.pixelWidth = size.x;
 	header.pixelHeight = size.y > 1 ? size.y : 0;
@@ -274,6 +290,182 @@ WriteError writeKtx2Throw(Write& write, const ImageProvider& img, bool useZlib)
 	header.kvdByteLength = 0u;
 	header.kvdByteOffset = 0u;
 
+	return header;
+}
+
+// Computes the level index for data without supercompression.
+// Offsets are relative to the beginning of the file.
+// 'layers' includes cubemap faces.
+std::vector<Ktx2LevelInfo> ktx2Levels(Vec3ui size, Format format,
+		unsigned mips, unsigned layers) {
+	// Levels must be aligned to lcm(texel block size, 4)
+	auto alignment = std::lcm(formatElementSize(format), 4u);
+	auto off = u64(sizeof(ktx2Identifier) + sizeof(Ktx2Header) +
+		sizeof(Ktx2LevelInfo) * mips);
+
+	std::vector<Ktx2LevelInfo> levels(mips);
+	for(auto m = 0u; m < mips; ++m) {
+		off = align(off, alignment);
+		levels[m].offset = off;
+		levels[m].uncompressedLength = sizeBytes(size, m, format) * layers;
+		levels[m].length = levels[m].uncompressedLength;
+		off += levels[m].length;
+	}
+
+	return levels;
+}
+
+std::vector<std::byte> zlibCompress(span<const std::byte> data) {
+	constexpr auto level = 6u;
+	auto dstLen = compressBound(data.size());
+	std::vector<std::byte> ret(dstLen);
+	auto res = compress2(reinterpret_cast<unsigned char*>(ret.data()), &dstLen,
+		reinterpret_cast<const unsigned char*>(data.data()), data.size(), level);
+	if(res != Z_OK) {
+		dlg_error("compress2: {}", res);
+		throw std::runtime_error("zlib compression failed");
+	}
+
+	ret.resize(dstLen);
+	return ret;
+}
+
+// Writes the file strictly sequentially, for sinks that can't seek
+// (e.g. pipes). The level index must come before the data, so with zlib
+// all levels are compressed into memory first, in parallel.
+WriteError writeKtx2Sequential(Write& write, const ImageProvider& img,
+		bool useZlib) {
+	auto size = img.size();
+	auto format = img.format();
+	auto numMips = img.mipLevels();
+	auto numLayers = img.layers();
+
+	auto header = ktx2Header(size, format, numMips, numLayers,
+		img.cubemap(), useZlib);
+	auto levels = ktx2Levels(size, format, numMips, numLayers);
+
+	std::vector<std::vector<std::byte>> compressed;
+	if(useZlib) {
+		compressed.resize(numMips);
+
+		// Reading from the provider isn't threadsafe, only compression
+		// is done in parallel.
+		std::mutex readMutex;
+		std::atomic<bool> readFailed {false};
+		parallelFor(numMips, [&](u64 m) {
+			auto faceSize = sizeBytes(size, m, format);
+			std::vector<std::byte> levelData(faceSize * numLayers);
+
+			{
+				std::lock_guard lock(readMutex);
+				for(auto l = 0u; l < numLayers; ++l) {
+					auto dst = span<std::byte>(levelData).subspan(l * faceSize, faceSize);
+					auto res = img.read(dst, m, l);
+					if(res != faceSize) {
+						dlg_debug("invalid ImageProvider read size: "
+							"got {}, expected {}", res, faceSize);
+						readFailed = true;
+						return;
+					}
+				}
+			}
+
+			compressed[m] = zlibCompress(levelData);
+		});
+
+		if(readFailed) {
+			return WriteError::readError;
+		}
+
+		// same alignment as in the seekable zlib path
+		auto alignment = align(formatElementSize(format), 4u);
+		auto off = u64(sizeof(ktx2Identifier) + sizeof(Ktx2Header) +
+			sizeof(Ktx2LevelInfo) * numMips);
+		for(auto m = 0u; m < numMips; ++m) {
+			off = align(off, alignment);
+			levels[m].offset = off;
+			levels[m].length = compressed[m].size();
+			off += levels[m].length;
+		}
+	}
+
+	write.write(ktx2Identifier);
+	write.write(header);
+	write.write(levels);
+
+	auto off = u64(sizeof(ktx2Identifier) + sizeof(Ktx2Header) +
+		sizeof(Ktx2LevelInfo) * numMips);
+	for(auto m = 0u; m < numMips; ++m) {
+		for(; off < levels[m].offset; ++off) {
+			write.write(std::byte{});
+		}
+
+		if(useZlib) {
+			write.write(compressed[m]);
+			compressed[m] = {};
+		} else {
+			auto faceSize = sizeBytes(size, m, format);
+			for(auto l = 0u; l < numLayers; ++l) {
+				auto span = img.read(m, l);
+				if(span.size() != faceSize) {
+					dlg_debug("invalid ImageProvider read size: "
+						"got {}, expected {}", span.size(), faceSize);
+					return WriteError::readError;
+				}
+
+				write.write(span);
+			}
+		}
+
+		off += levels[m].length;
+	}
+
+	return WriteError::none;
+}
+
+WriteError writeKtx2Throw(Write& write, const ImageProvider& img, bool useZlib) {
+	auto size = img.size();
+	auto format = img.format();
+	auto numMips = img.mipLevels();
+	auto numLayers = img.layers();
+
+	if(!write.seekable()) {
+		return writeKtx2Sequential(write, img, useZlib);
+	}
+
+	if(!useZlib) {
+		Ktx2Writer writer(write);
+		auto res = writer.begin(size, format, numMips, numLayers, img.cubemap());
+		if(res != WriteError::none) {
+			return res;
+		}
+
+		res = writer.writeSubresources(img);
+		if(res != WriteError::none) {
+			return res;
+		}
+
+		res = writer.finish();
+		if(res == WriteError::none) {
+			write.seek(writer.endAddress());
+		}
+
+		return res;
+	}
+
+	auto initialAddr = write.address();
+	write.write(ktx2Identifier);
+
+	auto fmtSize = formatElementSize(format);
+	auto numFaces = 1u;
+	if(img.cubemap()) {
+		dlg_assert(numLayers % 6u == 0);
+		numFaces = 6u;
+		numLayers = numLayers / 6u;
+	}
+
+	auto header = ktx2Header(size, format, numMips, img.layers(),
+		img.cubemap(), useZlib);
 	write.write(header);
 
 	// level index
@@ -282,7 +474,7 @@ WriteError writeKtx2Throw(Write& write, const ImageProvider& img, bool useZlib)
 		sizeof(Ktx2Header);
 	auto dataStart = mipIndexStart + sizeof(Ktx2LevelInfo) * numMips;
 
-	// NOTE: for compressed writes, this will be patched later
+	// NOTE: this will be patched later
 	auto off = dataStart;
 	for(auto m = 0u; m < numMips; ++m) {
 		Ktx2LevelInfo info {};
@@ -310,87 +502,70 @@ WriteError writeKtx2Throw(Write& write, const ImageProvider& img, bool useZlib)
 			off += padding;
 		}
 
-		if(useZlib) {
-			// TODO: don't use stack, ThreadMemScope-like instead
-			constexpr auto bufSize = 32 * 1024;
-			constexpr auto level = 6u;
-			unsigned char buf[bufSize];
-
-			z_stream strm {};
-			auto res = deflateInit(&strm, level);
-			dlg_assert(res == Z_OK);
-
-			// track and back-patch the compressed size
-			auto mipLength = u32(0u);
-			for(auto l = 0u; l < numLayers; ++l) {
-				for(auto f = 0u; f < numFaces; ++f) {
-					auto span = img.read(m, l * numFaces + f);
-					if(span.size() != faceSize) {
-						dlg_debug("invalid ImageProvider read size: "
-							"got {}, expected {}", span.size(), faceSize);
-						return WriteError::readError;
-					}
+		// TODO: don't use stack, ThreadMemScope-like instead
+		constexpr auto bufSize = 32 * 1024;
+		constexpr auto level = 6u;
+		unsigned char buf[bufSize];
+
+		z_stream strm {};
+		auto res = deflateInit(&strm, level);
+		dlg_assert(res == Z_OK);
+
+		// track and back-patch the compressed size
+		auto mipLength = u32(0u);
+		for(auto l = 0u; l < numLayers; ++l) {
+			for(auto f = 0u; f < numFaces; ++f) {
+				auto span = img.read(m, l * numFaces + f);
+				if(span.size() != faceSize) {
+					dlg_debug("invalid ImageProvider read size: "
+						"got {}, expected {}", span.size(), faceSize);
+					return WriteError::readError;
+				}
 
-					strm.next_in = const_cast<unsigned char*>(
-						reinterpret_cast<const unsigned char*>(span.data()));
-					strm.avail_in = span.size();
+				strm.next_in = const_cast<unsigned char*>(
+					reinterpret_cast<const unsigned char*>(span.data()));
+				strm.avail_in = span.size();
 
-					auto last = (l == numLayers - 1 && f == numFaces - 1);
-					auto flush = last ? Z_FINISH : Z_NO_FLUSH;
+				auto last = (l == numLayers - 1 && f == numFaces - 1);
+				auto flush = last ? Z_FINISH : Z_NO_FLUSH;
 
-					do {
-						strm.avail_out = bufSize;
-						strm.next_out = buf;
+				do {
+					strm.avail_out = bufSize;
+					strm.next_out = buf;
 
-						res = deflate(&strm, flush);
-						dlg_assert(res != Z_STREAM_ERROR);
-						auto have = bufSize - strm.avail_out;
-						write.write(reinterpret_cast<const std::byte*>(buf), have);
-						mipLength += have;
-					} while(strm.avail_out == 0);
-					dlg_assert(strm.avail_in == 0);
-				}
+					res = deflate(&strm, flush);
+					dlg_assert(res != Z_STREAM_ERROR);
+					auto have = bufSize - strm.avail_out;
+					write.write(reinterpret_cast<const std::byte*>(buf), have);
+					mipLength += have;
+				} while(strm.avail_out == 0);
+				dlg_assert(strm.avail_in == 0);
 			}
+		}
 
-			dlg_assert(res == Z_STREAM_END);
-			(void) deflateEnd(&strm);
-
-			// back-patch compressed mip size
-			auto savedAddr = write.address();
-			auto levelInfoOff = initialAddr + mipIndexStart +
-				m * sizeof(Ktx2LevelInfo);
-			write.seek(levelInfoOff, Seek::Origin::set);
-
-			Ktx2LevelInfo info {};
-			info.offset = off;
-			info.uncompressedLength = faceSize * numLayers * numFaces;
-			info.length = mipLength;
-			write.write(info);
-
-			if(mipLength > 1024) {
-				auto uncompressedLength = numLayers * numFaces * faceSize;
-				dlg_trace("mip {}: zlib compression: {} KB -> {} KB",
-					m, uncompressedLength / 1024u, mipLength / 1024u);
-			}
+		dlg_assert(res == Z_STREAM_END);
+		(void) deflateEnd(&strm);
 
-			write.seek(savedAddr, Seek::Origin::set);
-			off += mipLength;
-		} else {
-			// just write layers directly
-			for(auto l = 0u; l < numLayers; ++l) {
-				for(auto f = 0u; f < numFaces; ++f) {
-					auto span = img.read(m, l * numFaces + f);
-					if(span.size() != faceSize) {
-						dlg_debug("invalid ImageProvider read size: "
-							"got {}, expected {}", span.size(), faceSize);
-						return WriteError::readError;
-					}
+		// back-patch compressed mip size
+		auto savedAddr = write.address();
+		auto levelInfoOff = initialAddr + mipIndexStart +
+			m * sizeof(Ktx2LevelInfo);
+		write.seek(levelInfoOff, Seek::Origin::set);
 
-					write.write(span);
-					off += span.size();
-				}
-			}
+		Ktx2LevelInfo info {};
+		info.offset = off;
+		info.uncompressedLength = faceSize * numLayers * numFaces;
+		info.length = mipLength;
+		write.write(info);
+
+		if(mipLength > 1024) {
+			auto uncompressedLength = numLayers * numFaces * faceSize;
+			dlg_trace("mip {}: zlib compression: {} KB -> {} KB",
+				m, uncompressedLength / 1024u, mipLength / 1024u);
 		}
+
+		write.seek(savedAddr, Seek::Origin::set);
+		off += mipLength;
 	}
 
 	return WriteError::none;
@@ -406,15 +581,91 @@ WriteError writeKtx2(Write& write, const ImageProvider& img, bool useZlib) {
 }
 
 WriteError writeKtx2(StringParam path, const ImageProvider& image, bool useZlib) {
-	auto file = FileHandle(path, "wb");
+	auto file = FileHandle(path, "w+b");
 	if(!file) {
 		dlg_debug("fopen: {}", std::strerror(errno));
 		return WriteError::cantOpen;
 	}
 
+	// Without supercompression the file size is known up front, so try
+	// to write directly into a memory mapping of the file. Data from
+	// other KTX files is copied directly between the files instead.
+	if(!useZlib && !KtxWriterBase::fileCopyable(image)) {
+		auto fileSize = Ktx2Writer::fileSize(image.size(), image.format(),
+			image.mipLevels(), image.layers());
+		try {
+			MappedFileWrite writer(std::move(file), fileSize);
+			return writeKtx2(writer, image, false);
+		} catch(const std::runtime_error& err) {
+			dlg_debug("writeKtx2: can't map output file: {}", err.what());
+		}
+	}
+
 	FileWrite writer(std::move(file));
 	return writeKtx2(writer, image, useZlib);
 }
 
+// Ktx2Writer
+u64 Ktx2Writer::fileSize(Vec3ui size, Format format, unsigned mips,
+		unsigned layers) {
+	auto ret = u64(sizeof(ktx2Identifier) + sizeof(Ktx2Header) +
+		mips * sizeof(Ktx2LevelInfo));
+	for(auto& lvl : ktx2Levels(size, format, mips, layers)) {
+		ret = std::max<u64>(ret, lvl.offset + lvl.length);
+	}
+
+	return ret;
+}
+
+WriteError Ktx2Writer::begin(Vec3ui size, Format format, unsigned mips,
+		unsigned layers, bool cubemap) {
+	dlg_assert(write_);
+	initLayout(size, format, mips, layers, 1u);
+
+	auto header = ktx2Header(size, format, mips, layers, cubemap, false);
+	auto levels = ktx2Levels(size, format, mips, layers);
+
+	try {
+		auto base = write_->address();
+
+		std::vector<std::byte> buf;
+		buf.reserve(sizeof(ktx2Identifier) + sizeof(header) +
+			levels.size() * sizeof(Ktx2LevelInfo));
+		auto append = [&](auto bytes) {
+			buf.insert(buf.end(), bytes.begin(), bytes.end());
+		};
+
+		append(nytl::bytes(ktx2Identifier));
+		append(nytl::bytes(header));
+		append(nytl::bytes(levels));
+		write_->writeAt(base, buf);
+
+		// zero the alignment padding in front of every level
+		const std::byte zeroBytes[32] {};
+		auto off = u64(buf.size());
+		for(auto m = 0u; m < mips; ++m) {
+			auto& lvl = levels[m];
+			dlg_assert(lvl.offset - off <= sizeof(zeroBytes));
+			if(lvl.offset > off) {
+				write_->writeAt(base + off, {zeroBytes, zeroBytes + (lvl.offset - off)});
+			}
+
+			auto faceSize = sizeBytes(size, m, format);
+			for(auto l = 0u; l < layers; ++l) {
+				offsets_[m * layers + l] = base + lvl.offset + l * faceSize;
+			}
+
+			off = lvl.offset + lvl.length;
+		}
+
+		end_ = base + off;
+	} catch(const std::runtime_error& err) {
+		dlg_error("Ktx2Writer::begin: {}", err.what());
+		return WriteError::cantWrite;
+	}
+
+	return WriteError::none;
+}
+
 } // namespace
 
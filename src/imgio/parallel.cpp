@@ -0,0 +1,127 @@
+#include "parallel.hpp"
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace imgio {
+namespace {
+
+// Fixed number of workers that run tasks in submission order.
+class ThreadPool {
+public:
+	explicit ThreadPool(unsigned numThreads) {
+		threads_.reserve(numThreads);
+		for(auto i = 0u; i < numThreads; ++i) {
+			threads_.emplace_back([this]{ run(); });
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard lock(mutex_);
+			stop_ = true;
+		}
+
+		cv_.notify_all();
+		for(auto& thread : threads_) {
+			thread.join();
+		}
+	}
+
+	unsigned size() const { return threads_.size(); }
+
+	void submit(std::function<void()> task) {
+		{
+			std::lock_guard lock(mutex_);
+			tasks_.push_back(std::move(task));
+		}
+
+		cv_.notify_one();
+	}
+
+private:
+	void run() {
+		while(true) {
+			std::function<void()> task;
+			{
+				std::unique_lock lock(mutex_);
+				cv_.wait(lock, [&]{ return stop_ || !tasks_.empty(); });
+				if(tasks_.empty()) { // stop_
+					return;
+				}
+
+				task = std::move(tasks_.front());
+				tasks_.pop_front();
+			}
+
+			task();
+		}
+	}
+
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::deque<std::function<void()>> tasks_;
+	bool stop_ {};
+};
+
+// The calling thread of parallelFor works as well, one thread less.
+ThreadPool& sharedPool() {
+	static ThreadPool pool(parallelThreadCount() - 1u);
+	return pool;
+}
+
+} // anon namespace
+
+void ParallelForState::work() {
+	while(!failed.load(std::memory_order_relaxed)) {
+		auto i = next.fetch_add(1u);
+		if(i >= count) {
+			break;
+		}
+
+		std::exception_ptr err;
+		try {
+			call(func, i);
+		} catch(...) {
+			err = std::current_exception();
+		}
+
+		{
+			std::lock_guard lock(mutex);
+			++done;
+			if(err && !error) {
+				error = err;
+			}
+		}
+
+		if(err) {
+			failed = true;
+		}
+
+		cv.notify_all();
+	}
+}
+
+void runParallel(const std::shared_ptr<ParallelForState>& state, unsigned helpers) {
+	auto& pool = sharedPool();
+	helpers = std::min(helpers, pool.size());
+	for(auto i = 0u; i < helpers; ++i) {
+		pool.submit([state]{ state->work(); });
+	}
+
+	state->work();
+
+	// Close the range so that tasks starting from now on don't claim
+	// anything, then wait for the indices that were claimed.
+	auto claimed = std::min(state->next.exchange(state->count), state->count);
+	std::unique_lock lock(state->mutex);
+	state->cv.wait(lock, [&]{ return state->done == claimed; });
+
+	if(state->error) {
+		std::rethrow_exception(state->error);
+	}
+}
+
+} // namespace imgio
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <imgio/fwd.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+namespace imgio {
+
+// Returns the number of threads used by parallelFor by default.
+inline unsigned parallelThreadCount() {
+	return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// State of a single parallelFor call, shared with the pool tasks.
+// Tasks may only start after the call returned (when the pool is busy),
+// they then find no indices left and don't touch 'func' anymore.
+struct ParallelForState {
+	u64 count {};
+	void* func {};
+	void (*call)(void* func, u64 i) {};
+
+	std::atomic<u64> next {0u};
+	std::atomic<bool> failed {false};
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	u64 done {}; // finished indices, guarded by mutex
+	std::exception_ptr error; // first error, guarded by mutex
+
+	// Claims and runs indices until none are left or one failed.
+	void work();
+};
+
+// Runs state.work() on the calling thread and up to 'helpers' threads
+// of the shared pool. Returns when all claimed indices have finished,
+// rethrows the first exception.
+void runParallel(const std::shared_ptr<ParallelForState>& state, unsigned helpers);
+
+// Calls func(i) for every i in [0, count), distributed over up to
+// 'maxThreads' threads (including the calling one). Uses
+// parallelThreadCount() threads when maxThreads is zero.
+// The other threads come from a pool that is created on first use and
+// shared by all calls, so calling this often (e.g. for every region
+// read) doesn't create threads every time. The calling thread works
+// on the indices as well and never waits for pool threads that didn't
+// start yet, so nested calls can't deadlock.
+// Indices are handed out in increasing order, but may finish in any order.
+// When an invocation throws, the remaining indices are skipped and the
+// first exception is rethrown after all started invocations finished.
+template<typename F>
+void parallelFor(u64 count, F&& func, unsigned maxThreads = 0u) {
+	if(count == 0u) {
+		return;
+	}
+
+	auto numThreads = maxThreads ? maxThreads : parallelThreadCount();
+	numThreads = unsigned(std::min<u64>(numThreads, count));
+	if(numThreads <= 1u) {
+		for(u64 i = 0u; i < count; ++i) {
+			func(i);
+		}
+		return;
+	}
+
+	using Func = std::remove_reference_t<F>;
+	auto state = std::make_shared<ParallelForState>();
+	state->count = count;
+	state->func = const_cast<void*>(static_cast<const void*>(&func));
+	state->call = [](void* f, u64 i) {
+		(*static_cast<Func*>(f))(i);
+	};
+
+	runParallel(state, numThreads - 1u);
+}
+
+} // namespace imgio
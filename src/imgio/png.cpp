@@ -7,9 +7,22 @@
 #include <png.h>
 #include <csetjmp>
 #include <cstdio>
+#include <cstring>
 #include <vector>
 
 namespace imgio {
+namespace {
+
+// png stores 16-bit samples in big endian, imgio formats use the
+// native byte order.
+bool nativeLittleEndian() {
+	u16 val = 1u;
+	unsigned char first;
+	std::memcpy(&first, &val, 1u);
+	return first == 1u;
+}
+
+} // anon namespace
 
 class PngReader : public ImageProvider {
 public:
@@ -163,6 +176,10 @@ ReadError loadPng(std::unique_ptr<Read>&& stream, PngReader& reader) {
 			return ReadError::unsupportedFormat;
 		}
 
+		if(bit_depth == 16 && nativeLittleEndian()) {
+			png_set_swap(reader.png_);
+		}
+
 		switch(color_type) {
 			case PNG_COLOR_TYPE_GRAY:
 				format = (bit_depth == 16) ? Format::r16Unorm : Format::r8Srgb;
@@ -240,34 +257,27 @@ WriteError writePngThrow(Write& write, const ImageProvider& img) {
 
 	png_set_write_fn(png, static_cast<void*>(&write), writeFunc, flushFunc);
 	auto type = 0;
-	auto comps = 0;
 	auto bitDepth = 0;
 	auto fmt = img.format();
 
 	if(fmt == Format::r8Unorm || fmt == Format::r8Srgb) {
 		type = PNG_COLOR_TYPE_GRAY;
 		bitDepth = 8;
-		comps = 1;
 	} else if(fmt == Format::r8g8b8Unorm || fmt == Format::r8g8b8Srgb) {
 		type = PNG_COLOR_TYPE_RGB;
 		bitDepth = 8;
-		comps = 3;
 	} else if(fmt == Format::r8g8b8a8Unorm || fmt == Format::r8g8b8a8Srgb) {
 		type = PNG_COLOR_TYPE_RGBA;
 		bitDepth = 8;
-		comps = 4;
 	} else if(fmt == Format::r16Unorm) {
 		type = PNG_COLOR_TYPE_GRAY;
 		bitDepth = 16;
-		comps = 1;
 	} else if(fmt == Format::r16g16b16Unorm) {
-		type = PNG_COLOR_TYPE_GRAY;
+		type = PNG_COLOR_TYPE_RGB;
 		bitDepth = 16;
-		comps = 3;
 	} else if(fmt == Format::r16g16b16a16Unorm) {
-		type = PNG_COLOR_TYPE_GRAY;
+		type = PNG_COLOR_TYPE_RGBA;
 		bitDepth = 16;
-		comps = 4;
 	} else {
 		dlg_error("Unsupported format for writing png");
 		return WriteError::unsupportedFormat;
@@ -279,17 +289,22 @@ WriteError writePngThrow(Write& write, const ImageProvider& img) {
     	PNG_FILTER_TYPE_DEFAULT);
 	png_write_info(png, info);
 
+	if(bitDepth == 16 && nativeLittleEndian()) {
+		png_set_swap(png);
+	}
+
 	auto s = img.size();
+	auto rowSize = u64(s.x) * formatElementSize(fmt);
 	auto data = img.read();
-	if(data.size() != s.x * s.y * comps) {
+	if(data.size() != rowSize * s.y) {
 		dlg_error("Invalid image data size. Expected {}, got {}",
-			s.x * s.y * comps, data.size());
+			rowSize * s.y, data.size());
 		return WriteError::readError;
 	}
 
 	auto rows = std::make_unique<png_bytep[]>(s.y);
 	for(auto y = 0u; y < img.size().y; ++y) {
-		auto off = y * s.x * comps;
+		auto off = y * rowSize;
 
 		// ugh, the libpng api is terrible. This param should be const
 		auto ptr = reinterpret_cast<const unsigned char*>(data.data() + off);
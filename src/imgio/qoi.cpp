@@ -0,0 +1,407 @@
+#include <imgio/image.hpp>
+#include <imgio/stream.hpp>
+#include <imgio/file.hpp>
+#include <imgio/format.hpp>
+#include <dlg/dlg.hpp>
+#include <array>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+
+// QOI, the "Quite OK Image Format". Specification:
+//   https://qoiformat.org/qoi-specification.pdf
+// Texels are encoded sequentially as runs, references into a 64-entry
+// hash table of recently seen texels, small differences to the previous
+// texel or full values. There is no compression beyond that, which makes
+// encoding and decoding a lot cheaper than PNG.
+
+namespace imgio {
+
+constexpr auto qoiHeaderSize = 14u;
+constexpr auto qoiMaxOpSize = 5u; // QOI_OP_RGBA
+constexpr std::array<u8, 8> qoiEndMarker {0, 0, 0, 0, 0, 0, 0, 1};
+
+constexpr u8 qoiOpIndex = 0x00; // 00xxxxxx
+constexpr u8 qoiOpDiff = 0x40; // 01xxxxxx
+constexpr u8 qoiOpLuma = 0x80; // 10xxxxxx
+constexpr u8 qoiOpRun = 0xC0; // 11xxxxxx
+constexpr u8 qoiOpRgb = 0xFE;
+constexpr u8 qoiOpRgba = 0xFF;
+constexpr u8 qoiMask2 = 0xC0;
+
+// Pixel limit of the reference implementation, protects
+// against allocating huge amounts of memory for broken files.
+constexpr auto qoiMaxPixels = 400'000'000u;
+
+struct QoiPixel {
+	u8 r, g, b, a;
+};
+
+inline unsigned qoiHash(QoiPixel px) {
+	return (px.r * 3u + px.g * 5u + px.b * 7u + px.a * 11u) % 64u;
+}
+
+inline bool operator==(QoiPixel a, QoiPixel b) {
+	return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+// Decodes all texels from the given stream, which must be positioned
+// at the first op. Reads the stream in blocks and only checks the block
+// bounds once per op.
+template<unsigned Channels>
+void decodeQoi(Read& stream, u8* dst, u64 numPixels) {
+	constexpr auto blockSize = 64u * 1024u;
+	std::vector<u8> buf(blockSize + qoiMaxOpSize);
+	std::size_t pos = 0u;
+	std::size_t end = 0u; // end of the valid data in buf
+	bool eof = false;
+
+	// Moves the remaining bytes to the front and reads the next block.
+	// At the end of the stream, pads with zeroes (QOI_OP_INDEX) so that
+	// the last ops can be decoded without further checks. Valid files
+	// end with the 8 byte end marker anyways.
+	auto refill = [&]{
+		auto rest = end - pos;
+		std::memmove(buf.data(), buf.data() + pos, rest);
+		pos = 0u;
+		end = rest;
+		while(end < blockSize) {
+			auto res = stream.readPartial(reinterpret_cast<std::byte*>(buf.data() + end),
+				blockSize - end);
+			if(res <= 0) {
+				eof = true;
+				std::memset(buf.data() + end, 0, buf.size() - end);
+				break;
+			}
+
+			end += res;
+		}
+	};
+
+	std::array<QoiPixel, 64> index {};
+	QoiPixel px {0, 0, 0, 255};
+	auto run = 0u;
+
+	for(auto i = 0u; i < numPixels; ++i) {
+		if(run > 0u) {
+			--run;
+		} else {
+			if(pos + qoiMaxOpSize > end) {
+				if(!eof) {
+					refill();
+				}
+
+				if(pos >= end) {
+					throw std::runtime_error("qoi: unexpected end of stream");
+				}
+			}
+
+			auto b1 = buf[pos++];
+			if(b1 == qoiOpRgb) {
+				px.r = buf[pos + 0];
+				px.g = buf[pos + 1];
+				px.b = buf[pos + 2];
+				pos += 3u;
+			} else if(b1 == qoiOpRgba) {
+				px.r = buf[pos + 0];
+				px.g = buf[pos + 1];
+				px.b = buf[pos + 2];
+				px.a = buf[pos + 3];
+				pos += 4u;
+			} else if((b1 & qoiMask2) == qoiOpIndex) {
+				px = index[b1];
+			} else if((b1 & qoiMask2) == qoiOpDiff) {
+				px.r += ((b1 >> 4) & 0x03) - 2;
+				px.g += ((b1 >> 2) & 0x03) - 2;
+				px.b += (b1 & 0x03) - 2;
+			} else if((b1 & qoiMask2) == qoiOpLuma) {
+				auto b2 = buf[pos++];
+				int vg = (b1 & 0x3f) - 32;
+				px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+				px.g += vg;
+				px.b += vg - 8 + (b2 & 0x0f);
+			} else { // qoiOpRun
+				run = (b1 & 0x3f);
+			}
+
+			index[qoiHash(px)] = px;
+		}
+
+		std::memcpy(dst, &px, Channels);
+		dst += Channels;
+	}
+
+	// the padding only covers the end marker of valid files
+	if(pos > end) {
+		throw std::runtime_error("qoi: unexpected end of stream");
+	}
+}
+
+class QoiReader : public ImageProvider {
+public:
+	std::unique_ptr<Read> stream_ {};
+	Vec2ui size_ {};
+	Format format_ {};
+	unsigned channels_ {};
+	u64 dataBegin_ {}; // stream address of the first op
+	mutable std::vector<std::byte> tmpData_ {};
+
+public:
+	Vec3ui size() const noexcept override { return {size_.x, size_.y, 1u}; }
+	Format format() const noexcept override { return format_; }
+	unsigned mipLevels() const noexcept override { return 1u; }
+	unsigned layers() const noexcept override { return 1u; }
+
+	u64 read(span<std::byte> data, unsigned mip, unsigned layer) const override {
+		dlg_assert(mip == 0);
+		dlg_assert(layer == 0);
+
+		auto byteSize = u64(size_.x) * size_.y * channels_;
+		dlg_assert(u64(data.size()) >= byteSize);
+
+		stream_->seek(dataBegin_);
+		auto dst = reinterpret_cast<u8*>(data.data());
+		auto numPixels = u64(size_.x) * size_.y;
+		if(channels_ == 4u) {
+			decodeQoi<4u>(*stream_, dst, numPixels);
+		} else {
+			decodeQoi<3u>(*stream_, dst, numPixels);
+		}
+
+		return byteSize;
+	}
+
+	span<const std::byte> read(unsigned mip, unsigned layer) const override {
+		tmpData_.resize(u64(size_.x) * size_.y * channels_);
+		read(tmpData_, mip, layer);
+		return tmpData_;
+	}
+};
+
+ReadError loadQoi(std::unique_ptr<Read>&& stream, std::unique_ptr<ImageProvider>& ret) {
+	std::array<u8, qoiHeaderSize> header;
+	auto res = stream->readPartial(reinterpret_cast<std::byte*>(header.data()), header.size());
+	if(res < i64(header.size())) {
+		return ReadError::unexpectedEnd;
+	}
+
+	if(std::memcmp(header.data(), "qoif", 4) != 0) {
+		return ReadError::invalidType;
+	}
+
+	auto be32 = [&](unsigned off) {
+		return (u32(header[off]) << 24u) | (u32(header[off + 1]) << 16u) |
+			(u32(header[off + 2]) << 8u) | u32(header[off + 3]);
+	};
+
+	auto width = be32(4u);
+	auto height = be32(8u);
+	auto channels = header[12];
+	auto colorspace = header[13];
+	if(width == 0u || height == 0u) {
+		return ReadError::empty;
+	}
+
+	if((channels != 3u && channels != 4u) || colorspace > 1u ||
+			height >= qoiMaxPixels / width) {
+		dlg_warn("qoi: invalid header");
+		return ReadError::invalidType;
+	}
+
+	// colorspace 0: sRGB with linear alpha, 1: all channels linear
+	auto reader = std::make_unique<QoiReader>();
+	reader->size_ = {width, height};
+	reader->channels_ = channels;
+	if(channels == 4u) {
+		reader->format_ = colorspace == 0u ? Format::r8g8b8a8Srgb : Format::r8g8b8a8Unorm;
+	} else {
+		reader->format_ = colorspace == 0u ? Format::r8g8b8Srgb : Format::r8g8b8Unorm;
+	}
+
+	if(!stream->seekable()) {
+		// We can't seek back to the data for reads, decode it now.
+		auto img = ImageData{};
+		img.size = reader->size();
+		img.format = reader->format_;
+		auto byteSize = u64(width) * height * channels;
+		img.data = std::make_unique<std::byte[]>(byteSize);
+		try {
+			auto dst = reinterpret_cast<u8*>(img.data.get());
+			if(channels == 4u) {
+				decodeQoi<4u>(*stream, dst, u64(width) * height);
+			} else {
+				decodeQoi<3u>(*stream, dst, u64(width) * height);
+			}
+		} catch(const std::runtime_error& err) {
+			dlg_warn("loadQoi: {}", err.what());
+			return ReadError::unexpectedEnd;
+		}
+
+		ret = wrap(std::move(img));
+		stream.reset();
+		return ReadError::none;
+	}
+
+	reader->dataBegin_ = stream->address();
+	reader->stream_ = std::move(stream);
+	ret = std::move(reader);
+	return ReadError::none;
+}
+
+// Encodes the texels into a buffer, flushing it to the stream when full.
+// Each texel produces at most a run and a QOI_OP_RGBA.
+template<unsigned Channels>
+void encodeQoi(Write& write, const u8* src, u64 numPixels) {
+	constexpr auto blockSize = 64u * 1024u;
+	std::vector<u8> buf(blockSize + 1u + qoiMaxOpSize);
+	std::size_t pos = 0u;
+
+	std::array<QoiPixel, 64> index {};
+	QoiPixel prev {0, 0, 0, 255};
+	QoiPixel px = prev;
+	auto run = 0u;
+
+	for(auto i = 0u; i < numPixels; ++i) {
+		if(pos >= blockSize) {
+			write.write(reinterpret_cast<const std::byte*>(buf.data()), pos);
+			pos = 0u;
+		}
+
+		std::memcpy(&px, src, Channels);
+		src += Channels;
+
+		if(px == prev) {
+			++run;
+			if(run == 62u || i + 1 == numPixels) {
+				buf[pos++] = qoiOpRun | u8(run - 1u);
+				run = 0u;
+			}
+
+			continue;
+		}
+
+		if(run > 0u) {
+			buf[pos++] = qoiOpRun | u8(run - 1u);
+			run = 0u;
+		}
+
+		auto hash = qoiHash(px);
+		if(index[hash] == px) {
+			buf[pos++] = qoiOpIndex | u8(hash);
+		} else {
+			index[hash] = px;
+			if(px.a == prev.a) {
+				// wrap-around arithmetic, like the reference implementation
+				auto vr = i8(px.r - prev.r);
+				auto vg = i8(px.g - prev.g);
+				auto vb = i8(px.b - prev.b);
+				auto vgr = i8(vr - vg);
+				auto vgb = i8(vb - vg);
+
+				if(vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+					buf[pos++] = qoiOpDiff | u8((vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+				} else if(vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+					buf[pos++] = qoiOpLuma | u8(vg + 32);
+					buf[pos++] = u8((vgr + 8) << 4 | (vgb + 8));
+				} else {
+					buf[pos++] = qoiOpRgb;
+					buf[pos++] = px.r;
+					buf[pos++] = px.g;
+					buf[pos++] = px.b;
+				}
+			} else {
+				buf[pos++] = qoiOpRgba;
+				buf[pos++] = px.r;
+				buf[pos++] = px.g;
+				buf[pos++] = px.b;
+				buf[pos++] = px.a;
+			}
+		}
+
+		prev = px;
+	}
+
+	write.write(reinterpret_cast<const std::byte*>(buf.data()), pos);
+}
+
+WriteError writeQoiThrow(Write& write, const ImageProvider& img) {
+	auto [width, height, depth] = img.size();
+	if(depth > 1) {
+		dlg_warn("writeQoi: discarding {} slices", depth - 1);
+	}
+
+	if(img.layers() > 1) {
+		dlg_warn("writeQoi: discarding {} layers", img.layers() - 1);
+	}
+
+	if(img.mipLevels() > 1) {
+		dlg_warn("writeQoi: discarding {} mip levels", img.mipLevels() - 1);
+	}
+
+	auto fmt = img.format();
+	u8 channels;
+	u8 colorspace;
+	switch(fmt) {
+		case Format::r8g8b8a8Srgb: channels = 4u; colorspace = 0u; break;
+		case Format::r8g8b8a8Unorm: channels = 4u; colorspace = 1u; break;
+		case Format::r8g8b8Srgb: channels = 3u; colorspace = 0u; break;
+		case Format::r8g8b8Unorm: channels = 3u; colorspace = 1u; break;
+		default:
+			dlg_error("writeQoi: unsupported format {}", (int) fmt);
+			return WriteError::unsupportedFormat;
+	}
+
+	auto numPixels = u64(width) * height;
+	auto data = img.read(0u, 0u);
+	if(u64(data.size()) < numPixels * channels) {
+		dlg_error("writeQoi: image provider returned too few bytes");
+		return WriteError::readError;
+	}
+
+	std::array<u8, qoiHeaderSize> header {'q', 'o', 'i', 'f'};
+	auto putBE32 = [&](unsigned off, u32 val) {
+		header[off + 0] = u8(val >> 24u);
+		header[off + 1] = u8(val >> 16u);
+		header[off + 2] = u8(val >> 8u);
+		header[off + 3] = u8(val);
+	};
+
+	putBE32(4u, width);
+	putBE32(8u, height);
+	header[12] = channels;
+	header[13] = colorspace;
+	write.write(reinterpret_cast<const std::byte*>(header.data()), header.size());
+
+	auto src = reinterpret_cast<const u8*>(data.data());
+	if(channels == 4u) {
+		encodeQoi<4u>(write, src, numPixels);
+	} else {
+		encodeQoi<3u>(write, src, numPixels);
+	}
+
+	write.write(reinterpret_cast<const std::byte*>(qoiEndMarker.data()), qoiEndMarker.size());
+	return WriteError::none;
+}
+
+WriteError writeQoi(Write& write, const ImageProvider& img) {
+	try {
+		return writeQoiThrow(write, img);
+	} catch(const std::runtime_error& err) {
+		dlg_error("writeQoi: {}", err.what());
+		return WriteError::cantWrite;
+	}
+}
+
+WriteError writeQoi(StringParam path, const ImageProvider& img) {
+	auto file = FileHandle(path, "wb");
+	if(!file) {
+		dlg_debug("fopen: {}", std::strerror(errno));
+		return WriteError::cantOpen;
+	}
+
+	FileWrite writer(std::move(file));
+	return writeQoi(writer, img);
+}
+
+} // namespace imgio
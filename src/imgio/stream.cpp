@@ -17,6 +17,10 @@
 	#include <fcntl.h>
 #endif
 
+#ifdef __linux__
+	#include <sys/sendfile.h>
+#endif
+
 namespace imgio {
 namespace {
 
@@ -44,6 +48,15 @@ int cSeekOrigin(Seek::Origin origin) {
 	}
 }
 
+// Returns false for pipes, sockets and terminals.
+bool fileSeekable(std::FILE* file) {
+#ifdef IMGIO_LINUX
+	return ::lseek(fileno(file), 0, SEEK_CUR) >= 0;
+#else // IMGIO_LINUX
+	return std::ftell(file) >= 0;
+#endif // IMGIO_LINUX
+}
+
 } // namespace tkn
 
 
@@ -76,14 +89,22 @@ u64 FileRead::address() const {
 		throw std::runtime_error("FileStream::ftell failed");
 	}
 
-	return u32(res);
+	return u64(res);
 }
 
 bool FileRead::eof() const {
 	return std::feof(file_);
 }
 
+bool FileRead::seekable() const {
+	return fileSeekable(file_);
+}
+
 // FileWrite
+bool FileWrite::seekable() const {
+	return fileSeekable(file_);
+}
+
 i64 FileWrite::writePartial(const std::byte* data, u64 size) {
 	return std::fwrite(data, 1u, size, file_);
 }
@@ -103,7 +124,242 @@ u64 FileWrite::address() const {
 		throw std::runtime_error("FileStream::ftell failed");
 	}
 
-	return u32(res);
+	return u64(res);
+}
+
+void FileWrite::writeAt(u64 address, span<const std::byte> buf) {
+#ifdef IMGIO_LINUX
+	// make sure previously buffered writes don't overwrite our data
+	if(std::fflush(file_) != 0) {
+		dlg_error("fflush: {}", std::strerror(errno));
+		throw std::runtime_error("FileWrite::writeAt: fflush failed");
+	}
+
+	auto fd = fileno(file_);
+	auto data = buf.data();
+	auto size = u64(buf.size());
+	while(size > 0) {
+		auto res = ::pwrite(fd, data, size, address);
+		if(res < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+
+			dlg_error("pwrite: {} ({})", res, std::strerror(errno));
+			throw std::runtime_error("FileWrite::writeAt: pwrite failed");
+		}
+
+		data += res;
+		size -= res;
+		address += res;
+	}
+#else // IMGIO_LINUX
+	Write::writeAt(address, buf);
+#endif // IMGIO_LINUX
+}
+
+bool FileWrite::concurrentWriteAt() const {
+#ifdef IMGIO_LINUX
+	// pwrite fails for pipes
+	return seekable();
+#else // IMGIO_LINUX
+	return false;
+#endif // IMGIO_LINUX
+}
+
+void FileWrite::flush(bool sync) {
+	if(std::fflush(file_) != 0) {
+		dlg_error("fflush: {}", std::strerror(errno));
+		throw std::runtime_error("FileWrite::flush: fflush failed");
+	}
+
+#ifdef IMGIO_LINUX
+	if(sync && ::fsync(fileno(file_)) != 0) {
+		dlg_error("fsync: {}", std::strerror(errno));
+		throw std::runtime_error("FileWrite::flush: fsync failed");
+	}
+#else // IMGIO_LINUX
+	(void) sync;
+#endif // IMGIO_LINUX
+}
+
+bool copyFileRange(const FileRead& src, u64 srcOffset,
+		FileWrite& dst, u64 dstOffset, u64 size) {
+#ifdef __linux__
+	if(std::fflush(dst.file()) != 0) {
+		dlg_error("fflush: {}", std::strerror(errno));
+		throw std::runtime_error("copyFileRange: fflush failed");
+	}
+
+	auto inFd = fileno(src.file());
+	auto outFd = fileno(dst.file());
+	if(inFd < 0 || outFd < 0) {
+		return false;
+	}
+
+	auto in = loff_t(srcOffset);
+	auto out = loff_t(dstOffset);
+	auto copied = false;
+
+	// sendfile writes at the current file offset, we have to restore
+	// it afterwards to keep the FILE consistent.
+	auto useSendfile = false;
+	off_t savedOut = -1;
+	auto restore = [&]{
+		if(savedOut >= 0) {
+			::lseek(outFd, savedOut, SEEK_SET);
+			savedOut = -1;
+		}
+	};
+
+	while(size > 0) {
+		ssize_t res;
+		if(!useSendfile) {
+			res = ::copy_file_range(inFd, &in, outFd, &out, size, 0u);
+		} else {
+			if(savedOut < 0) {
+				savedOut = ::lseek(outFd, 0, SEEK_CUR);
+			}
+
+			if(savedOut < 0 || ::lseek(outFd, out, SEEK_SET) < 0) {
+				restore();
+				return false;
+			}
+
+			auto inOff = off_t(in);
+			res = ::sendfile(outFd, inFd, &inOff, size);
+			if(res > 0) {
+				out += res;
+				in = inOff;
+			}
+		}
+
+		if(res < 0) {
+			auto err = errno;
+			if(err == EINTR) {
+				continue;
+			}
+
+			// e.g. different file systems on old kernels
+			if(!useSendfile && (err == ENOSYS || err == EXDEV ||
+					err == EOPNOTSUPP || err == EINVAL)) {
+				useSendfile = true;
+				continue;
+			}
+
+			restore();
+			if(!copied && (err == ENOSYS || err == EINVAL)) {
+				return false;
+			}
+
+			dlg_error("copyFileRange: {}", std::strerror(err));
+			throw std::runtime_error("copyFileRange failed");
+		}
+
+		if(res == 0) {
+			restore();
+			throw std::runtime_error("copyFileRange: unexpected end of source");
+		}
+
+		copied = true;
+		size -= res;
+	}
+
+	restore();
+	return true;
+#else // __linux__
+	(void) src;
+	(void) srcOffset;
+	(void) dst;
+	(void) dstOffset;
+	(void) size;
+	return false;
+#endif // __linux__
+}
+
+// MappedFileWrite
+MappedFileWrite::MappedFileWrite(FileHandle&& file, u64 size) {
+	dlg_assert(file);
+
+#ifdef IMGIO_LINUX
+	auto fd = fileno(file);
+	if(fd < 0) {
+		throw std::runtime_error("MappedFileWrite: file has no descriptor");
+	}
+
+	// Try to actually reserve the blocks, avoids fragmentation and
+	// out-of-space errors (SIGBUS) when writing into the mapping.
+	// Not all file systems support this, use ftruncate as fallback.
+	auto allocated = false;
+#ifdef __linux__
+	allocated = (size > 0 && ::fallocate(fd, 0, 0, size) == 0);
+#endif // __linux__
+	if(!allocated && ::ftruncate(fd, size) != 0) {
+		dlg_error("ftruncate: {}", std::strerror(errno));
+		throw std::runtime_error("MappedFileWrite: ftruncate failed");
+	}
+
+	if(size > 0) {
+		auto data = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(data == MAP_FAILED || !data) {
+			dlg_error("mmap failed: {}", std::strerror(errno));
+			throw std::runtime_error("MappedFileWrite: mmap failed");
+		}
+
+		data_ = static_cast<std::byte*>(data);
+	}
+
+	size_ = size;
+	file_ = std::move(file);
+#else // IMGIO_LINUX
+	(void) size;
+	throw std::runtime_error("MappedFileWrite: not supported on this platform");
+#endif // IMGIO_LINUX
+}
+
+MappedFileWrite::~MappedFileWrite() {
+#ifdef IMGIO_LINUX
+	if(data_) {
+		::munmap(data_, size_);
+	}
+#endif // IMGIO_LINUX
+}
+
+i64 MappedFileWrite::writePartial(const std::byte* buf, u64 size) {
+	auto count = std::clamp(i64(size_) - i64(at_), i64(0), i64(size));
+	std::memcpy(data_ + at_, buf, count);
+	at_ += count;
+	return count;
+}
+
+void MappedFileWrite::seek(i64 offset, Seek::Origin origin) {
+	switch(origin) {
+		case Seek::Origin::set: at_ = offset; break;
+		case Seek::Origin::curr: at_ += offset; break;
+		case Seek::Origin::end: at_ = size_ + offset; break;
+		default: throw std::logic_error("Invalid Stream::SeekOrigin");
+	}
+}
+
+void MappedFileWrite::writeAt(u64 address, span<const std::byte> buf) {
+	if(address > size_ || u64(buf.size()) > size_ - address) {
+		dlg_error("MappedFileWrite::writeAt: out of range ({} + {} > {})",
+			address, buf.size(), size_);
+		throw std::runtime_error("MappedFileWrite::writeAt: out of range");
+	}
+
+	std::memcpy(data_ + address, buf.data(), buf.size());
+}
+
+void MappedFileWrite::flush(bool sync) {
+#ifdef IMGIO_LINUX
+	if(data_ && ::msync(data_, size_, sync ? MS_SYNC : MS_ASYNC) != 0) {
+		dlg_error("msync: {}", std::strerror(errno));
+		throw std::runtime_error("MappedFileWrite::flush: msync failed");
+	}
+#else // IMGIO_LINUX
+	(void) sync;
+#endif // IMGIO_LINUX
 }
 
 // StreamMemoryMap
@@ -115,9 +371,9 @@ ReadStreamMemoryMap::ReadStreamMemoryMap(std::unique_ptr<Read>&& stream,
 	// NOTE: we could try to support file memory mapping on windows
 	// as well. But not sure if memory mapping is even worth it
 	// in our cases.
-#ifdef IRO_LINUX
+#ifdef IMGIO_LINUX
 	auto tryMap = [&]{
-		auto fstream = dynamic_cast<FileStream*>(stream.get());
+		auto fstream = dynamic_cast<FileRead*>(stream.get());
 		if(!fstream) {
 			return false;
 		}
@@ -126,7 +382,7 @@ ReadStreamMemoryMap::ReadStreamMemoryMap(std::unique_ptr<Read>&& stream,
 		// It's not an error, we just fall back to the default non-mmap
 		// implementation.
 		auto fd = fileno(fstream->file());
-		if(fd <= 0) {
+		if(fd < 0) {
 			return false;
 		}
 
@@ -155,7 +411,7 @@ ReadStreamMemoryMap::ReadStreamMemoryMap(std::unique_ptr<Read>&& stream,
 	}
 
 	// otherwise fall back to default solution
-#endif // TKN_LINUX
+#endif // IMGIO_LINUX
 
 	if(auto mstream = dynamic_cast<MemoryRead*>(stream.get()); mstream) {
 		data_ = mstream->buffer().data();
@@ -186,11 +442,11 @@ ReadStreamMemoryMap::~ReadStreamMemoryMap() {
 }
 
 std::unique_ptr<Read> ReadStreamMemoryMap::release() {
-#ifdef TKN_LINUX
+#ifdef IMGIO_LINUX
 	if(mmapped_ && data_) {
-		::munmap(const_cast<std::byte*>(data_), size_);
+		::munmap(const_cast<std::byte*>(data_), mapSize_);
 	}
-#endif // TKN_LINUX
+#endif // IMGIO_LINUX
 
 	owned_ = {};
 	data_ = {};
@@ -1,54 +1,249 @@
+#include <imgio/webp.hpp>
 #include <imgio/image.hpp>
 #include <imgio/stream.hpp>
+#include <imgio/format.hpp>
 #include <webp/decode.h>
 #include <dlg/dlg.hpp>
+#include <algorithm>
+#include <array>
+#include <mutex>
 #include <vector>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef IMGIO_WITH_WEBP_DEMUX
+	#include <webp/demux.h>
+#endif // IMGIO_WITH_WEBP_DEMUX
 
 namespace imgio {
 
-class WebpReader : public ImageProvider {
+class WebpReaderImpl : public WebpReader {
 public:
 	ReadStreamMemoryMap mmap_;
 	u32 width_ {};
 	u32 height_ {};
+	std::vector<unsigned> delays_; // per frame, empty for still images
+
+	// Still images are decoded once by read(mip, layer), the returned
+	// span stays valid and concurrent reads don't share a buffer.
+	// Animations are read sequentially and use tmpData_.
+	mutable std::once_flag stillOnce_;
+	mutable std::vector<std::byte> stillData_;
 	mutable std::vector<std::byte> tmpData_;
 
+#ifdef IMGIO_WITH_WEBP_DEMUX
+	// Animations are composed sequentially by the anim decoder, which
+	// holds the canvas. Created on the first read.
+	mutable WebPAnimDecoder* anim_ {};
+	mutable unsigned next_ {}; // index of the next frame to decode
+	mutable const u8* canvas_ {}; // frame next_ - 1, owned by anim_
+#endif // IMGIO_WITH_WEBP_DEMUX
+
 public:
+	~WebpReaderImpl() {
+#ifdef IMGIO_WITH_WEBP_DEMUX
+		if(anim_) {
+			WebPAnimDecoderDelete(anim_);
+		}
+#endif // IMGIO_WITH_WEBP_DEMUX
+	}
+
+	ReadError load(std::unique_ptr<Read>&& stream);
+	ReadError loadAnimation();
+
 	Vec3ui size() const noexcept override { return {width_, height_, 1u}; }
 	Format format() const noexcept override { return Format::r8g8b8a8Srgb; }
 	unsigned mipLevels() const noexcept override { return 1u; }
-	// TODO: parse animations, returns them as layers
-	unsigned layers() const noexcept override { return 1u; }
-	bool cubemap() const noexcept override { return false; }
+	unsigned layers() const noexcept override {
+		return delays_.empty() ? 1u : delays_.size();
+	}
+	bool concurrentRead() const noexcept override { return delays_.empty(); }
 
-	nytl::Span<const std::byte> read(unsigned mip, unsigned layer) const override {
-		dlg_assert(mip == 0u);
-		dlg_assert(layer == 0u);
-		tmpData_.resize(width_ * height_ * 4);
+	unsigned frameDelay(unsigned frame) const override {
+		dlg_assert(frame < layers());
+		return delays_.empty() ? 0u : delays_[frame];
+	}
+
+	span<const std::byte> read(unsigned mip, unsigned layer) const override {
+		if(delays_.empty()) {
+			// call_once doesn't set the flag when the decoding throws
+			std::call_once(stillOnce_, [&]{
+				std::vector<std::byte> data(sizeBytes(size(), mip, format()));
+				read(data, mip, layer);
+				stillData_ = std::move(data);
+			});
+
+			return stillData_;
+		}
+
+		tmpData_.resize(sizeBytes(size(), mip, format()));
 		read(tmpData_, mip, layer);
 		return tmpData_;
 	}
 
-	u64 read(nytl::Span<std::byte> data, unsigned mip, unsigned layer) const override {
-		WebPDecodeRGBAInto((const u8*) mmap_.data(), mmap_.mapSize(),
-			(u8*) data.data(), data.size(), 4 * width_);
-		return 4 * width_ * height_;
+	u64 read(span<std::byte> data, unsigned mip, unsigned layer) const override {
+		dlg_assert(mip == 0u);
+		dlg_assert(layer < layers());
+		auto byteSize = 4u * u64(width_) * height_;
+		dlg_assert(u64(data.size()) >= byteSize);
+
+		if(!delays_.empty()) {
+			readFrame(data.data(), layer);
+			return byteSize;
+		}
+
+		auto src = reinterpret_cast<const u8*>(mmap_.data());
+		auto dst = reinterpret_cast<u8*>(data.data());
+		if(!WebPDecodeRGBAInto(src, mmap_.size(), dst, data.size(), 4 * width_)) {
+			throw std::runtime_error("WebPDecodeRGBAInto failed");
+		}
+
+		return byteSize;
 	}
+
+	void readFrame(std::byte* dst, unsigned frame) const;
 };
 
-ReadError loadWebp(std::unique_ptr<Read>&& stream, WebpReader& reader) {
+ReadError WebpReaderImpl::load(std::unique_ptr<Read>&& stream) {
+	// "RIFF", file size, "WEBP". Checked before mapping, streams that
+	// can't be mapped are copied completely.
+	std::array<char, 12> header;
+	auto start = stream->address();
+	auto read = stream->readPartial(reinterpret_cast<std::byte*>(header.data()),
+		header.size());
+	stream->seek(i64(start));
+	if(read != i64(header.size()) || std::memcmp(header.data(), "RIFF", 4) != 0 ||
+			std::memcmp(header.data() + 8, "WEBP", 4) != 0) {
+		return ReadError::invalidType;
+	}
+
+	mmap_ = ReadStreamMemoryMap(std::move(stream));
+	auto data = reinterpret_cast<const u8*>(mmap_.data());
+
+	// cheap header probe, also rejects non-webp files
+	WebPBitstreamFeatures features;
+	if(WebPGetFeatures(data, mmap_.size(), &features) != VP8_STATUS_OK) {
+		return ReadError::invalidType;
+	}
+
+	if(features.has_animation) {
+		return loadAnimation();
+	}
+
+	int width, height;
+	if(!WebPGetInfo(data, mmap_.size(), &width, &height)) {
+		return ReadError::invalidType;
+	}
+
+	if(width <= 0 || height <= 0) {
+		return ReadError::empty;
+	}
+
+	width_ = width;
+	height_ = height;
+	return ReadError::none;
 }
 
+#ifdef IMGIO_WITH_WEBP_DEMUX
+
+ReadError WebpReaderImpl::loadAnimation() {
+	// The demuxer only parses the chunk structure, we use it to
+	// get the canvas size and frame durations.
+	WebPData webpData {reinterpret_cast<const u8*>(mmap_.data()), mmap_.size()};
+	auto demux = WebPDemux(&webpData);
+	if(!demux) {
+		dlg_warn("WebPDemux failed");
+		return ReadError::internal;
+	}
+
+	width_ = WebPDemuxGetI(demux, WEBP_FF_CANVAS_WIDTH);
+	height_ = WebPDemuxGetI(demux, WEBP_FF_CANVAS_HEIGHT);
+	if(width_ == 0u || height_ == 0u) {
+		WebPDemuxDelete(demux);
+		return ReadError::empty;
+	}
+
+	WebPIterator iter;
+	if(WebPDemuxGetFrame(demux, 1, &iter)) {
+		do {
+			delays_.push_back(std::max(iter.duration, 0));
+		} while(WebPDemuxNextFrame(&iter));
+		WebPDemuxReleaseIterator(&iter);
+	}
+
+	WebPDemuxDelete(demux);
+	if(delays_.empty()) {
+		dlg_warn("WebP animation without frames");
+		return ReadError::empty;
+	}
+
+	return ReadError::none;
+}
+
+void WebpReaderImpl::readFrame(std::byte* dst, unsigned frame) const {
+	if(!anim_) {
+		WebPAnimDecoderOptions opts;
+		WebPAnimDecoderOptionsInit(&opts);
+		opts.color_mode = MODE_RGBA;
+		opts.use_threads = 0;
+
+		WebPData webpData {reinterpret_cast<const u8*>(mmap_.data()), mmap_.size()};
+		anim_ = WebPAnimDecoderNew(&webpData, &opts);
+		if(!anim_) {
+			throw std::runtime_error("WebPAnimDecoderNew failed");
+		}
+
+		next_ = 0u;
+	}
+
+	// the decoder only keeps the current canvas
+	if(frame + 1u < next_) {
+		WebPAnimDecoderReset(anim_);
+		next_ = 0u;
+	}
+
+	while(next_ <= frame) {
+		u8* canvas;
+		int timestamp;
+		if(!WebPAnimDecoderGetNext(anim_, &canvas, &timestamp)) {
+			auto msg = dlg::format("WebP frame {}: decoding failed", next_);
+			WebPAnimDecoderReset(anim_);
+			next_ = 0u;
+			throw std::runtime_error(msg);
+		}
+
+		canvas_ = canvas;
+		++next_;
+	}
+
+	std::memcpy(dst, canvas_, 4u * std::size_t(width_) * height_);
+}
+
+#else // IMGIO_WITH_WEBP_DEMUX
+
+ReadError WebpReaderImpl::loadAnimation() {
+	dlg_warn("WebP animations need libwebpdemux");
+	return ReadError::unsupportedFormat;
+}
+
+void WebpReaderImpl::readFrame(std::byte*, unsigned) const {
+	dlg_error("unreachable");
+}
+
+#endif // IMGIO_WITH_WEBP_DEMUX
+
 ReadError loadWebp(std::unique_ptr<Read>&& stream,
-		std::unique_ptr<ImageProvider>& ret) {
-	auto reader = std::make_unique<WebpReader>();
-	auto res = loadWebp(std::move(stream), *reader);
+		std::unique_ptr<ImageProvider>& provider) {
+	auto reader = std::make_unique<WebpReaderImpl>();
+	auto res = reader->load(std::move(stream));
 	if(res == ReadError::none) {
-		ret = std::move(reader);
+		provider = std::move(reader);
+	} else if(auto mapped = reader->mmap_.release()) {
+		// we only move from the stream on success
+		stream = std::move(mapped);
 	}
 
 	return res;
 }
 
-} // namespace
-
+} // namespace imgio